@@ -88,6 +88,7 @@ namespace fleece {
             const Value *_value;
             
             friend class Value;
+            friend class Encoder;
         };
 
         iterator begin() const noexcept                      {return iterator(this);}
@@ -97,6 +98,7 @@ namespace fleece {
     private:
         friend class Value;
         friend class Dict;
+        friend class Encoder;
         template <bool WIDE> friend struct dictImpl;
     };
 
@@ -25,10 +25,13 @@
 #include "PlatformCompat.hh"
 #include "TempArray.hh"
 #include <algorithm>
+#include <atomic>
+#include <bitset>
 #include <assert.h>
 #include <cmath>
 #include <float.h>
 #include <stdlib.h>
+#include <thread>
 
 
 namespace fleece {
@@ -38,6 +41,14 @@ namespace fleece {
 
     static constexpr size_t kInitialStackSize = 4;
 
+    // In streaming mode, output is flushed once this much of it has accumulated in memory:
+    static constexpr size_t kFlushThreshold = 64 * 1024;
+
+    // With optimizeLayout, a string or number this far back is written again instead of being
+    // pointed to. This is less than a narrow pointer's reach, to leave room for the rest of the
+    // collection's values between the string and the item pointing to it.
+    static constexpr size_t kNearbyDistance = 0xC000;
+
     Encoder::Encoder(size_t reserveSize)
     :_out(reserveSize),
      _stack(kInitialStackSize),
@@ -46,6 +57,40 @@ namespace fleece {
         push(kSpecialTag, 1);                   // Top-level 'array' is just a single item
     }
 
+    Encoder::Encoder(FILE *outputFile)
+    :_out(outputFile),
+     _stack(kInitialStackSize),
+     _strings(10)
+    {
+        push(kSpecialTag, 1);
+    }
+
+    Encoder::Encoder(Writer::OutputCallback callback)
+    :_out(callback),
+     _stack(kInitialStackSize),
+     _strings(10)
+    {
+        push(kSpecialTag, 1);
+    }
+
+    Encoder::Encoder(slice outputBuffer)
+    :_out(outputBuffer),
+     _stack(kInitialStackSize),
+     _strings(10)
+    {
+        push(kSpecialTag, 1);
+    }
+
+#ifndef _MSC_VER
+    Encoder::Encoder(const char *mappedFilePath, size_t maxLength)
+    :_out(mappedFilePath, maxLength),
+     _stack(kInitialStackSize),
+     _strings(10)
+    {
+        push(kSpecialTag, 1);
+    }
+#endif
+
     void Encoder::end() {
         if (!_items)
             return;
@@ -53,22 +98,30 @@ namespace fleece {
         throwIf(_items->size() > 1, EncodeError, "top level must have only one value");
 
         if (_items->size() > 0) {
-            checkPointerWidths(_items, nextWritePos());
-            fixPointers(_items);
-            Value &root = (*_items)[0];
-            if (_items->wide) {
-                _out.write(&root, kWide);
-                // Top level Value is 4 bytes, so append a 2-byte pointer to it, because the trailer
-                // needs to be a 2-byte Value:
-                Value ptr(4, kNarrow);
-                _out.write(&ptr, kNarrow);
-            } else {
-                _out.write(&root, kNarrow);
-            }
-            _items->clear();
+            writeRoot();
+            if (_optimizeLayout && !_base && !_out.isStreaming() && !_out.isMappedFile())
+                relayout();
         }
         _items = nullptr;
         _stackDepth = 0;
+        _out.flush();
+    }
+
+    // Writes the single top-level item, and the trailer.
+    void Encoder::writeRoot() {
+        checkPointerWidths(_items, nextWritePos());
+        fixPointers(_items);
+        Value &root = (*_items)[0];
+        if (_items->wide) {
+            _out.write(&root, kWide);
+            // Top level Value is 4 bytes, so append a 2-byte pointer to it, because the trailer
+            // needs to be a 2-byte Value:
+            Value ptr(4, kNarrow);
+            _out.write(&ptr, kNarrow);
+        } else {
+            _out.write(&root, kNarrow);
+        }
+        _items->clear();
     }
 
     alloc_slice Encoder::extractOutput() {
@@ -79,6 +132,37 @@ namespace fleece {
         return out;
     }
 
+    slice Encoder::finishInPlace() {
+        end();
+        slice out = _out.contiguousOutput();
+        return out.size ? out : nullslice;
+    }
+
+    // In streaming mode, flushes the output if enough of it has accumulated. This must only be
+    // called when no slices returned by _writeString/writeData are in use, other than the keys
+    // in _stack (which flush() takes care of.)
+    inline void Encoder::checkFlush() {
+        if (_usuallyFalse(_out.bufferedLength() >= kFlushThreshold) && _out.isStreaming())
+            flush();
+    }
+
+    void Encoder::flush() {
+        // Pointers only store offsets, so they're unaffected by the flush; but the keys of open
+        // dicts (needed for sorting) and the strings in _strings point into the output buffer.
+        for (unsigned depth = 1; depth < _stackDepth; ++depth) {
+            auto &items = _stack[depth];
+            for (auto &key : items.keys) {
+                if (key.buf && !(_base && key.buf >= _base.buf && key.buf < _base.end())) {
+                    items.keyCopies.emplace_back(key);
+                    key = items.keyCopies.back();
+                }
+            }
+        }
+        _strings.clear();
+        _numbers.clear();
+        _out.flush();
+    }
+
     // Returns position in the stream of the next write. Pads stream to even pos if necessary.
     size_t Encoder::nextWritePos() {
         size_t pos = _out.length();
@@ -87,15 +171,44 @@ namespace fleece {
     }
 
     void Encoder::reset() {
-        if (_items) {
-            _items->clear();
-            _items = nullptr;
-        }
+        // Clear every collection that's still open, in case encoding was abandoned midway:
+        for (unsigned depth = 0; depth < _stackDepth; ++depth)
+            _stack[depth].clear();
+        _items = nullptr;
         _out.reset();
         _stackDepth = 0;
         push(kSpecialTag, 1);
         _strings.clear();
+        _numbers.clear();
+        _collections.clear();
+        _collectionContents.clear();
+        if (_reusingBaseCollections) {
+            _maxSharedStringSize = _optionsBeforeReuse.maxSharedStringSize;
+            _uniqueNumbers = _optionsBeforeReuse.uniqueNumbers;
+            _uniqueCollections = _optionsBeforeReuse.uniqueCollections;
+            _reusingBaseCollections = false;
+        }
         _writingKey = _blockedOnKey = false;
+        _stringStart = nullptr;
+        _statsAtReset = _stats;
+        _generation = nextGeneration();
+    }
+
+    // Returns a number no encoder has used as its generation before, so that an EncoderKey
+    // can't mistake a new encoder at the same address (or a reset one) for the one it cached.
+    uint64_t Encoder::nextGeneration() {
+        static std::atomic<uint64_t> sLastGeneration {0};
+        return ++sLastGeneration;
+    }
+
+    void Encoder::resetForReuse() {
+        reset();
+        _uniqueStrings = _sortKeys = true;
+        _maxSharedStringSize = kMaxSharedStringSize;
+        _uniqueNumbers = _uniqueCollections = _optimizeLayout = false;
+        _sharedKeys = nullptr;
+        _base = nullslice;
+        resetStats();
     }
 
 
@@ -115,8 +228,38 @@ namespace fleece {
 
     void Encoder::writeValue(tags tag, byte buf[], size_t size, bool canInline) {
         buf[0] |= tag << 4;
+        if (_usuallyFalse(_uniqueNumbers) && size > 4 && (tag == kIntTag || tag == kFloatTag)) {
+            writeUniqueNumber(slice(buf, size));
+            return;
+        }
         writeRawValue(slice(buf, size), canInline);
         _out.padToEvenLength();
+        checkFlush();
+    }
+
+    // Writes a number that's too big to inline, or a pointer to an identical one already written.
+    // _numbers is keyed by the numbers' encoded bytes, which compare equal iff the numbers do.
+    void Encoder::writeUniqueNumber(slice rawValue) {
+        auto &entry = _numbers.find(rawValue);
+        if (entry.first.buf != nullptr && isNearby(entry.second.offset)) {
+            writePointer(entry.second.offset - _base.size);
+            _stats.savedNumbers++;
+            return;
+        }
+        auto offset = _base.size + nextWritePos();
+        throwIf(offset > 1u<<31, MemoryError, "encoded data too large");
+        writePointer(nextWritePos());
+        auto dst = _out.write(rawValue.buf, rawValue.size);
+        _out.padToEvenLength();
+        if (entry.first.buf) {
+            // Later numbers will point to this closer copy:
+            entry.first = slice(dst, rawValue.size);
+            entry.second.offset = (uint32_t)offset;
+        } else {
+            StringTable::info i = {(uint32_t)offset};
+            _numbers.addAt(entry, slice(dst, rawValue.size), i);
+        }
+        checkFlush();
     }
 
     void Encoder::writeRawValue(slice rawValue, bool canInline) {
@@ -223,41 +366,68 @@ namespace fleece {
         return slice(dst, s.size);
     }
 
+    // Should this string be looked up in (and added to) _strings?
+    inline bool Encoder::isUniquable(slice s) const {
+        return _uniqueStrings && s.size >= kNarrow && s.size <= _maxSharedStringSize;
+    }
+
+    // Can the string or number written at this offset be pointed to? During the second pass of
+    // optimizeLayout, not if it's so far back that the pointer would make its collection wide.
+    inline bool Encoder::isNearby(size_t offset) {
+        return !_layingOut || _base.size + nextWritePos() - offset < kNearbyDistance;
+    }
+
+    // Counts a string that was written as a pointer to an earlier copy, instead of as itself.
+    inline void Encoder::savedString(slice s) {
+        size_t size = 1 + s.size + (s.size >= 0x0F ? SizeOfVarInt(s.size) : 0);
+        _stats.savedStrings++;
+        _stats.savedStringBytes += size + (size & 1);
+    }
+
     // Returns the location where s got written to, if possible, just like writeData above.
     slice Encoder::_writeString(slice s) {
+        checkFlush();
+        if (_usuallyTrue(isUniquable(s)))
+            return writeUniqueString(s, s.hash());
+        else
+            return writeData(kStringTag, s);
+    }
+
+    slice Encoder::writeUniqueString(slice s, uint32_t hash) {
         // Check whether this string's already been written:
-        if (_usuallyTrue(_uniqueStrings && s.size >= kNarrow && s.size <= kMaxSharedStringSize)) {
-            auto &entry = _strings.find(s);
-            if (entry.first.buf != nullptr) {
-//                fprintf(stderr, "Found `%.*s` --> %u\n", (int)s.size, s.buf, entry.second);
-                writePointer(entry.second.offset - _base.size);
-#ifndef NDEBUG
-                _numSavedStrings++;
-#endif
-                return entry.first;
-            } else {
-                auto offset = _base.size + nextWritePos();
-                throwIf(offset > 1u<<31, MemoryError, "encoded data too large");
-                s = writeData(kStringTag, s);
-                if (s.buf) {
+        auto &entry = _strings.find(s, hash);
+        if (entry.first.buf != nullptr && isNearby(entry.second.offset)) {
+//            fprintf(stderr, "Found `%.*s` --> %u\n", (int)s.size, s.buf, entry.second);
+            writePointer(entry.second.offset - _base.size);
+            savedString(s);
+            return entry.first;
+        } else {
+            auto offset = _base.size + nextWritePos();
+            throwIf(offset > 1u<<31, MemoryError, "encoded data too large");
+            s = writeData(kStringTag, s);
+            if (s.buf) {
 #if 0
-                    if (_strings.count() == 0)
-                        fprintf(stderr, "---- new encoder ----\n");
-                    fprintf(stderr, "Caching `%.*s` --> %u\n", (int)s.size, s.buf, offset);
+                if (_strings.count() == 0)
+                    fprintf(stderr, "---- new encoder ----\n");
+                fprintf(stderr, "Caching `%.*s` --> %u\n", (int)s.size, s.buf, offset);
 #endif
+                if (entry.first.buf) {
+                    // Later strings will point to this closer copy:
+                    entry.first = s;
+                    entry.second.offset = (uint32_t)offset;
+                } else {
                     StringTable::info i = {(uint32_t)offset};
                     _strings.addAt(entry, s, i);
                 }
-                return s;
             }
-        } else {
-            return writeData(kStringTag, s);
+            return s;
         }
     }
 
     // Adds a preexisting string to the cache
     void Encoder::cacheString(slice s, size_t offsetInBase) {
-        if (_usuallyTrue(_uniqueStrings && s.size >= kNarrow && s.size <= kMaxSharedStringSize)) {            auto &entry = _strings.find(s);
+        if (_usuallyTrue(isUniquable(s))) {
+            auto &entry = _strings.find(s);
             if (entry.first.buf == nullptr) {
                 StringTable::info i = {(unsigned)offsetInBase};
                 _strings.addAt(entry, s, i);
@@ -269,7 +439,97 @@ namespace fleece {
         _writeString(slice(s));
     }
 
+    // Writes a string's header (as writeData does) to buf, returning its length.
+    static size_t writeStringHeader(size_t size, uint8_t *buf) {
+        buf[0] = (uint8_t)(std::min(size, (size_t)0xF) | (kStringTag << 4));
+        size_t headerLen = 1;
+        if (size >= 0x0F)
+            headerLen += PutUVarInt(&buf[1], size);
+        return headerLen;
+    }
+
+    uint8_t* Encoder::beginString(size_t maxSize) {
+        throwIf(_stringStart != nullptr, EncodeError, "beginString called twice");
+        checkFlush();
+        uint8_t header[1 + kMaxVarintLen64];
+        size_t headerLen = writeStringHeader(maxSize, header);
+        _stringMaxSize = maxSize;
+        if (_usuallyFalse(headerLen + maxSize > _out.spaceLeft())) {
+            // The output can't hold that much, though the final string may fit; so write it to
+            // the side, and let endString copy it in:
+            _stringScratch.resize(maxSize);
+            _stringStart = _stringScratch.data();
+            return _stringStart;
+        }
+        _stringPos = nextWritePos();
+        _stringStart = (uint8_t*)_out.reserveSpace(headerLen + maxSize);
+        return _stringStart + headerLen;
+    }
+
+    void Encoder::endString(size_t size) {
+        throwIf(_stringStart == nullptr || size > _stringMaxSize, EncodeError,
+                "endString without a matching beginString");
+        if (_usuallyFalse(_stringStart == _stringScratch.data())) {
+            _stringStart = nullptr;
+            writeString(slice(_stringScratch.data(), size));
+            return;
+        }
+        uint8_t header[1 + kMaxVarintLen64];
+        size_t reservedHeaderLen = writeStringHeader(_stringMaxSize, header);
+        size_t reservedLen = reservedHeaderLen + _stringMaxSize;
+        slice str(_stringStart + reservedHeaderLen, size);
+        _stringStart = nullptr;
+
+        if (size < kNarrow) {
+            // It fits inline, so give back the space:
+            uint8_t tiny[kNarrow];
+            memcpy(tiny, str.buf, size);
+            _out.retract(reservedLen);
+            writeData(kStringTag, slice(tiny, size));
+            return;
+        }
+
+        StringTable::slot *entry = nullptr;
+        if (isUniquable(str)) {
+            entry = &_strings.find(str, str.hash());
+            if (entry->first.buf != nullptr && isNearby(entry->second.offset)) {
+                // It's already been written, so give back the space and point to that:
+                _out.retract(reservedLen);
+                writePointer(entry->second.offset - _base.size);
+                savedString(str);
+                return;
+            }
+        }
+
+        // Keep the string where it is. Its header can only be shorter than the one reserved;
+        // if it is, move the bytes down to meet it. Then give back the unused space:
+        auto offset = _base.size + _stringPos;
+        throwIf(offset > 1u<<31, MemoryError, "encoded data too large");
+        uint8_t *start = (uint8_t*)str.buf - reservedHeaderLen;
+        size_t headerLen = writeStringHeader(size, header);
+        if (headerLen < reservedHeaderLen) {
+            memmove(start + headerLen, str.buf, size);
+            str.setBuf(start + headerLen);
+        }
+        memcpy(start, header, headerLen);
+        _out.retract(reservedLen - headerLen - size);
+        writePointer(_stringPos);
+        _out.padToEvenLength();
+
+        if (entry) {
+            if (entry->first.buf) {
+                // Later strings will point to this closer copy:
+                entry->first = str;
+                entry->second.offset = (uint32_t)offset;
+            } else {
+                StringTable::info i = {(uint32_t)offset};
+                _strings.addAt(*entry, str, i);
+            }
+        }
+    }
+
     void Encoder::writeData(slice s) {
+        checkFlush();
         writeData(kBinaryTag, s);
     }
 
@@ -298,6 +558,86 @@ namespace fleece {
         }
     }
 
+    void Encoder::reuseBaseCollections() {
+        if (!_reusingBaseCollections) {
+            _optionsBeforeReuse = {_maxSharedStringSize, _uniqueNumbers, _uniqueCollections};
+            _reusingBaseCollections = true;
+        }
+        _uniqueCollections = _uniqueNumbers = true;
+        _maxSharedStringSize = SIZE_MAX;
+        const Value *root = Value::fromTrustedData(_base);
+        if (root && root->tag() >= kArrayTag)
+            reuseBaseCollection(root);
+    }
+
+    // Adds a collection in the base, and the collections, strings and numbers inside it, to
+    // _collections, _strings and _numbers. Its key is built the way endCollection builds one, so
+    // pointers are stored as wide pointers holding absolute positions, and narrow inline items
+    // are zero-padded. A value that appears more than once in the base (like a string too long
+    // to have been uniqued) is keyed by its first appearance, as the encoder would refer to it.
+    // Returns the position of the first appearance of this collection.
+    size_t Encoder::reuseBaseCollection(const Value *collection) {
+        size_t collectionOffset = (const uint8_t*)collection - (const uint8_t*)_base.buf;
+        Array::iterator iter((const Array*)collection);     // (works with dicts too)
+        size_t n = (collection->tag() == kDictTag) ? 2 * iter._count : iter._count;
+        if (n == 0)
+            return collectionOffset;
+        bool wide = iter._wide;
+        size_t contentsSize = 1 + n * sizeof(Value);
+        TempArray(contents, uint8_t, contentsSize);
+        contents[0] = collection->tag();
+        auto items = (Value*)&contents[1];
+        const Value *slot = iter._first;
+        for (size_t i = 0; i < n; ++i, slot = slot->next(wide)) {
+            if (slot->isPointer()) {
+                const Value *value = Value::deref(slot, wide);
+                size_t offset = (const uint8_t*)value - (const uint8_t*)_base.buf;
+                StringTable *table = nullptr;
+                slice key;
+                switch (value->tag()) {
+                    case kArrayTag:
+                    case kDictTag:
+                        offset = reuseBaseCollection(value);
+                        break;
+                    case kStringTag:
+                        key = value->asString();
+                        if (isUniquable(key))
+                            table = &_strings;
+                        break;
+                    case kIntTag:
+                    case kFloatTag:
+                        key = slice(value, value->dataSize());
+                        table = &_numbers;
+                        break;
+                    default:
+                        break;
+                }
+                if (table) {
+                    auto &entry = table->find(key);
+                    if (entry.first.buf) {
+                        offset = entry.second.offset;
+                    } else {
+                        StringTable::info info = {(uint32_t)offset};
+                        table->addAt(entry, key, info);
+                    }
+                }
+                items[i] = Value(offset, kWide);
+            } else {
+                uint8_t *item = &contents[1 + i * sizeof(Value)];
+                memset(item, 0, sizeof(Value));
+                memcpy(item, slot, width(wide));
+            }
+        }
+        slice key(contents, contentsSize);
+        auto &entry = _collections.find(key);
+        if (entry.first.buf)
+            return entry.second.offset;
+        _collectionContents.emplace_back(key);
+        StringTable::info info = {(uint32_t)collectionOffset};
+        _collections.addAt(entry, _collectionContents.back(), info);
+        return collectionOffset;
+    }
+
 
 #pragma mark - WRITING VALUES:
 
@@ -320,6 +660,7 @@ namespace fleece {
             case kSpecialTag:
                 writeRawValue(slice(value, value->dataSize()));
                 _out.padToEvenLength();
+                checkFlush();
                 break;
             case kStringTag:
                 writeString(value->asString());
@@ -328,6 +669,8 @@ namespace fleece {
                 writeData(value->asData());
                 break;
             case kArrayTag: {
+                if (copySubtree(value, sk))
+                    break;
                 auto iter = value->asArray()->begin();
                 beginArray(iter.count());
                 for (; iter; ++iter) {
@@ -337,6 +680,8 @@ namespace fleece {
                 break;
             }
             case kDictTag: {
+                if (copySubtree(value, sk))
+                    break;
                 auto iter = value->asDict()->begin();
                 beginDictionary(iter.count());
                 for (; iter; ++iter) {
@@ -361,6 +706,99 @@ namespace fleece {
     }
 
 
+#pragma mark - SPLICING:
+
+
+    void Encoder::writeEncoded(slice data) {
+        const Value *root = Value::fromTrustedData(data);
+        throwIf(!root, InvalidData, "invalid encoded data");
+        if (data.size == kNarrow) {
+            writeValue(root);                   // root is an inline value; just copy it
+            return;
+        }
+        checkFlush();
+        size_t start = nextWritePos();
+        _out.write(data);
+        writePointer(start + ((const uint8_t*)root - (const uint8_t*)data.buf));
+    }
+
+    // Copies the values in an Encoder's output, whose root is an array, then adds the array's
+    // items to the current collection: pointers are relocated to the items' new positions, and
+    // inline items are simply written again. The array itself and the trailer after it are left
+    // out, since nothing will point to them.
+    void Encoder::writeEncodedItems(slice data) {
+        const Array *root = Value::fromTrustedData(data)->asArray();
+        throwIf(!root, InvalidData, "invalid encoded array");
+        checkFlush();
+        size_t start = nextWritePos();
+        _out.write(slice(data.buf, root));
+        for (Array::iterator i(root); i; ++i) {
+            if (i.rawValue()->isPointer())
+                writePointer(start + ((const uint8_t*)i.value() - (const uint8_t*)data.buf));
+            else
+                writeValue(i.value());
+        }
+    }
+
+    void Encoder::writeParallel(size_t count, const ItemEncoder &encodeItem, unsigned maxThreads)
+    {
+        throwIf(_items->tag != kArrayTag, EncodeError, "parallel writes must go in an array");
+        throwIf(_sharedKeys != nullptr, EncodeError, "can't write in parallel with shared keys");
+        if (maxThreads == 0)
+            maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+        size_t nChildren = std::min((size_t)maxThreads, count);
+        if (nChildren == 0)
+            return;
+
+        // Fork: each child encodes an array of its range of items.
+        std::vector<std::unique_ptr<Encoder>> children(nChildren);
+        std::vector<slice> outputs(nChildren);
+        std::vector<std::exception_ptr> errors(nChildren);
+        auto encodeRange = [&](size_t n) {
+            try {
+                size_t begin = count * n / nChildren, end = count * (n + 1) / nChildren;
+                children[n].reset(new Encoder);
+                Encoder &child = *children[n];
+                child.uniqueStrings(_uniqueStrings);
+                child.maxSharedStringSize(_maxSharedStringSize);
+                child.uniqueNumbers(_uniqueNumbers);
+                child.uniqueCollections(_uniqueCollections);
+                child.sortKeys(_sortKeys);
+                child.beginArray(end - begin);
+                for (size_t i = begin; i < end; ++i)
+                    encodeItem(child, i);
+                child.endArray();
+                outputs[n] = child.finishInPlace();
+            } catch (...) {
+                errors[n] = std::current_exception();
+            }
+        };
+        std::vector<std::thread> threads;
+        auto joinThreads = [&]() {
+            for (auto &thread : threads)
+                thread.join();
+        };
+        try {
+            threads.reserve(nChildren - 1);
+            for (size_t n = 1; n < nChildren; ++n)
+                threads.emplace_back(encodeRange, n);
+            encodeRange(0);                     // the calling thread does its share too
+        } catch (...) {
+            joinThreads();                      // the threads reference the vectors above
+            throw;
+        }
+
+        // Join:
+        joinThreads();
+        for (auto &error : errors) {
+            if (error)
+                std::rethrow_exception(error);
+        }
+        for (slice output : outputs)
+            writeEncodedItems(output);
+    }
+
+
 #pragma mark - POINTERS:
 
 
@@ -429,14 +867,72 @@ namespace fleece {
 
     void Encoder::writeKey(slice s) {
         int encoded;
-        if (_sharedKeys && _sharedKeys->encodeAndAdd(s, encoded)) {
-            writeKey(encoded);
-            return;
+        if (_sharedKeys) {
+            if (_sharedKeys->encodeAndAdd(s, encoded)) {
+                _stats.sharedKeyHits++;
+                writeKey(encoded);
+                return;
+            }
+            _stats.sharedKeyMisses++;
         }
         addingKey();
         addedKey(_writeString(s));
     }
 
+    void Encoder::writeKey(slice s, uint32_t hash) {
+        if (_sharedKeys) {
+            writeKey(s);
+            return;
+        }
+        addingKey();
+        checkFlush();
+        if (_usuallyTrue(isUniquable(s)))
+            addedKey(writeUniqueString(s, hash));
+        else
+            addedKey(writeData(kStringTag, s));
+    }
+
+    void Encoder::writeKey(EncoderKey &key) {
+        if (_usuallyTrue(key._generation == _generation)) {
+            if (key._hasNumericKey) {
+                _stats.sharedKeyHits++;
+                writeKey(key._numericKey);
+                return;
+            } else if (key._hasOffset) {
+                if (_sharedKeys)
+                    _stats.sharedKeyMisses++;
+                addingKey();
+                writePointer(key._offset - _base.size);
+                savedString(key._rawString);
+                addedKey(key._rawString);
+                return;
+            }
+        }
+
+        // First time this encoder has seen the key, so write it normally and note how:
+        key._generation = _generation;
+        key._hasOffset = key._hasNumericKey = false;
+        if (_sharedKeys) {
+            if (_sharedKeys->encodeAndAdd(key._rawString, key._numericKey)) {
+                key._hasNumericKey = true;
+                _stats.sharedKeyHits++;
+                writeKey(key._numericKey);
+                return;
+            }
+            _stats.sharedKeyMisses++;
+        }
+        addingKey();
+        checkFlush();
+        if (_usuallyTrue(isUniquable(key._rawString))) {
+            addedKey(writeUniqueString(key._rawString, key._hash));
+            // The string was written as a pointer to itself, or to an earlier copy:
+            key._offset = _items->back().pointerValue<true>();
+            key._hasOffset = true;
+        } else {
+            addedKey(writeData(kStringTag, key._rawString));
+        }
+    }
+
     void Encoder::writeKey(int n) {
         addingKey();
         writeInt(n);
@@ -457,7 +953,11 @@ namespace fleece {
     }
 
     void Encoder::addedKey(slice str) {
-        if (_usuallyTrue(_sortKeys))
+#ifdef NDEBUG
+        if (_usuallyTrue(_sortKeys && !_items->presorted))
+#else
+        if (_usuallyTrue(_sortKeys))        // (presorted keys get checked in endCollection)
+#endif
             _items->keys.push_back(str);
     }
 
@@ -486,6 +986,11 @@ namespace fleece {
         _writingKey = _blockedOnKey = true;
     }
 
+    void Encoder::beginSortedDictionary(size_t reserve) {
+        beginDictionary(reserve);
+        _items->presorted = (_sharedKeys == nullptr);
+    }
+
     void Encoder::endArray() {
         endCollection(internal::kArrayTag);
     }
@@ -509,14 +1014,43 @@ namespace fleece {
         _items = &_stack[_stackDepth - 1];
         _writingKey = _blockedOnKey = false;
 
-        if (_sortKeys && tag == kDictTag)
-            sortDict(*items);
+        if (_sortKeys && tag == kDictTag) {
+            if (!items->presorted) {
+                sortDict(*items);
+            } else {
+#ifndef NDEBUG
+                resolveKeys(*items);
+                assert(keysAreSorted(items->keys));
+#endif
+            }
+        }
 
         auto nValues = items->size();    // includes keys if this is a dict!
         auto count = (uint32_t)nValues;
         if (items->tag == kDictTag)
             count /= 2;
 
+        // If an identical collection has already been written, just point to it. Pointers in
+        // items are still absolute positions, not relative ones, so the contents of identical
+        // collections are identical bytes wherever they end up. The tag comes first, since an
+        // array can have the same items as a dict.
+        StringTable::slot *entry = nullptr;
+        size_t contentsSize = _uniqueCollections ? 1 + nValues * sizeof(Value) : 0;
+        TempArray(contents, uint8_t, contentsSize);
+        if (_usuallyFalse(_uniqueCollections) && count > 0) {
+            contents[0] = (uint8_t)items->tag;
+            memcpy(&contents[1], &(*items)[0], nValues * sizeof(Value));
+            entry = &_collections.find(slice(contents, contentsSize));
+            if (entry->first.buf) {
+                writePointer(entry->second.offset - _base.size);
+                _stats.savedCollections++;
+                items->clear();
+                checkFlush();
+                return;
+            }
+        }
+        auto offset = _base.size + nextWritePos();
+
         // Write the array header to the outer Value:
         uint8_t buf[2 + kMaxVarintLen32];
         uint32_t inlineCount = std::min(count, (uint32_t)kLongArrayCount);
@@ -535,6 +1069,13 @@ namespace fleece {
             buf[0] |= 0x08;     // "wide" flag
         writeValue(items->tag, buf, bufLen, (count==0));          // can inline only if empty
 
+        if (entry) {
+            throwIf(offset > 1u<<31, MemoryError, "encoded data too large");
+            _collectionContents.emplace_back(contents, contentsSize);
+            StringTable::info i = {(uint32_t)offset};
+            _collections.addAt(*entry, _collectionContents.back(), i);
+        }
+
         fixPointers(items);
 
         // Write the values:
@@ -551,17 +1092,16 @@ namespace fleece {
             }
         }
 
-#ifndef NDEBUG
         if (items->wide) {
-            _numWide++;
-            _wideCount += count;
+            _stats.wideCollections++;
+            _stats.wideItems += count;
         } else {
-            _numNarrow++;
-            _narrowCount += count;
+            _stats.narrowCollections++;
+            _stats.narrowItems += count;
         }
-#endif
 
         items->clear();
+        checkFlush();
     }
 
     // compares dictionary keys as slices. If a slice has a null `buf`, it represents an integer
@@ -580,14 +1120,56 @@ namespace fleece {
         }
     }
 
-    void Encoder::sortDict(valueArray &items) {
-        auto &keys = items.keys;
-        size_t n = keys.size();
-        if (n < 2)
-            return;
+    bool Encoder::keysAreSorted(const std::vector<slice> &keys) {
+        for (size_t i = 1; i < keys.size(); i++)
+            if (!compareKeysByIndex(&keys[i-1], &keys[i]))
+                return false;
+        return true;
+    }
+
+    // Integer keys are stored in dictShape::keyData with this flag set in their 'size':
+    static constexpr uint32_t kIntKeyFlag = 0x80000000;
+
+    bool Encoder::dictShape::matches(const std::vector<slice> &keys) const {
+        if (keys.size() != order.size())
+            return false;
+        auto p = (const uint8_t*)keyData.data(), end = p + keyData.size();
+        for (auto &key : keys) {
+            uint32_t size;
+            if (_usuallyFalse(p + sizeof(size) > end))
+                return false;
+            memcpy(&size, p, sizeof(size));
+            p += sizeof(size);
+            if (key.buf) {
+                if (size != key.size || key.size > (size_t)(end - p)
+                                     || memcmp(p, key.buf, key.size) != 0)
+                    return false;
+                p += key.size;
+            } else if (size != (kIntKeyFlag | key.size)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void Encoder::dictShape::set(const std::vector<slice> &keys, const slice* const sorted[]) {
+        keyData.clear();
+        order.resize(keys.size());
+        for (size_t i = 0; i < keys.size(); i++) {
+            auto &key = keys[i];
+            uint32_t size = key.buf ? (uint32_t)key.size : (kIntKeyFlag | (uint32_t)key.size);
+            keyData.append((const char*)&size, sizeof(size));
+            if (key.buf)
+                keyData.append((const char*)key.buf, key.size);
+            order[i] = (uint32_t)(sorted[i] - &keys[0]);
+        }
+    }
 
-        // Fill in the pointers of any keys that refer to inline strings:
-        for (unsigned i = 0; i < n; i++) {
+    // Fills in the pointers of any keys that refer to inline strings, and the values of integer
+    // keys (as slices with a null `buf`.)
+    void Encoder::resolveKeys(valueArray &items) {
+        auto &keys = items.keys;
+        for (unsigned i = 0; i < keys.size(); i++) {
             if (keys[i].buf == nullptr) {
                 const Value *item = &items[2*i];
                 if (item->tag() == kStringTag)
@@ -596,13 +1178,51 @@ namespace fleece {
                     keys[i] = slice(nullptr, (size_t)item->asUnsigned());   // integer
             }
         }
+    }
 
-        // Construct an array that describes the permutation of item indices:
-        TempArray(indices, const slice*, n);
+    void Encoder::sortDict(valueArray &items) {
+        auto &keys = items.keys;
+        size_t n = keys.size();
+        if (n < 2)
+            return;
+
+        resolveKeys(items);
+
+        // Hash the key sequence to pick a slot in the shape cache:
+        bool cacheable = (n <= kMaxDictShapeKeys);
+        size_t hash = n;
+        for (auto &key : keys) {
+            hash = hash * 31 + key.size;
+            if (key.buf) {
+                if (key.size > 0)
+                    hash = hash * 31 + key[0];
+            } else if (key.size >= kIntKeyFlag) {
+                cacheable = false;
+            }
+        }
+
+        // Input that's already sorted, such as a Dict being copied, needs no work:
+        if (keysAreSorted(keys)) {
+            _stats.dictsPresorted++;
+            return;
+        }
+
+        // If these keys were seen before in this order, reuse the permutation; else sort:
         const slice* base = &keys[0];
-        for (unsigned i = 0; i < n; i++)
-            indices[i] = base + i;
-        std::sort(&indices[0], &indices[n], &compareKeysByIndex);
+        TempArray(indices, const slice*, n);
+        dictShape *shape = cacheable ? &_dictShapes[hash % kDictShapeCacheSize] : nullptr;
+        if (shape && shape->matches(keys)) {
+            _stats.dictShapeHits++;
+            for (unsigned i = 0; i < n; i++)
+                indices[i] = base + shape->order[i];
+        } else {
+            _stats.dictShapeMisses++;
+            for (unsigned i = 0; i < n; i++)
+                indices[i] = base + i;
+            std::sort(&indices[0], &indices[n], &compareKeysByIndex);
+            if (shape)
+                shape->set(keys, indices);
+        }
         // indices[i] is now a pointer to the Value that should go at index i
 
         // Now rewrite items according to the permutation in indices:
@@ -618,5 +1238,439 @@ namespace fleece {
         }
     }
 
-}
 
+#pragma mark - COPYING SUBTREES:
+
+
+    // Copies a non-empty array or dict from another document in one piece, instead of re-encoding
+    // it. The Values written while the collection was being encoded occupy a contiguous range of
+    // bytes that ends with the collection itself, so that range is copied as-is, and the relative
+    // pointers within it stay valid. Pointers that leave the range (usually to strings shared
+    // with other parts of the source document) are rewritten to point to copies of their targets.
+    // Returns false if the collection has to be re-encoded instead: if its keys need translating
+    // or sorting, if it points to a collection outside the range, or if a rewritten pointer
+    // doesn't fit in its width.
+    bool Encoder::copySubtree(const Value *root, const SharedKeys *sk) {
+        if (root->countIsZero() || sk != _sharedKeys || _writingKey)
+            return false;
+        _subtree.clear();
+        const uint8_t *hi = scanSubtree(root);
+        if (!hi)
+            return false;
+
+        // Find the range: grow it downwards from the root for as long as the Values are
+        // adjacent (allowing for a byte of padding after odd-sized ones):
+        std::sort(_subtree.begin(), _subtree.end(), [](const subtreeItem &a, const subtreeItem &b) {
+            return a.end > b.end;
+        });
+        auto lo = (const uint8_t*)root;
+        for (auto &item : _subtree) {
+            if (item.end + 1 < lo)
+                break;
+            lo = std::min(lo, item.start);
+        }
+
+        // Find the pointers that leave the range:
+        for (auto &item : _subtree) {
+            auto next = (const uint8_t*)Value::derefPointer(item.slot, item.wide);
+            item.outside = (next < lo || next >= hi);
+            if (item.outside && item.target->tag() >= kArrayTag && !valueIsInBase(item.target))
+                return false;
+        }
+
+        // Their targets have to be copied ahead of the range, so before writing anything, check
+        // that the narrow pointers will reach them. A target already in the output (or base)
+        // stays where it is; the others are written from the current position on, taking at
+        // most `extra` bytes, so the range will start no later than startPos + extra.
+        checkFlush();
+        size_t startPos = _base.size + nextWritePos(), extra = 0;
+        size_t size = hi - lo;
+        const subtreeItem *prev = nullptr;
+        for (auto &item : _subtree) {
+            if (!item.outside)
+                continue;
+            if (prev && item.target == prev->target) {
+                item.newPos = prev->newPos;
+            } else if (!findExistingValue(item.target, item.newPos)) {
+                item.newPos = startPos;                 // (the earliest it could be written)
+                extra += (item.target->dataSize() + 1) & ~1;
+            }
+            prev = &item;
+        }
+        size_t latestPos = startPos + extra;
+        throwIf(latestPos + size > 1u<<31, MemoryError, "encoded data too large");
+        for (auto &item : _subtree) {
+            if (item.outside && !item.wide
+                    && latestPos + ((const uint8_t*)item.slot - lo) - item.newPos >= 0x10000)
+                return false;
+        }
+
+        prev = nullptr;
+        for (auto &item : _subtree) {
+            if (!item.outside)
+                continue;
+            if (prev && item.target == prev->target)
+                item.newPos = prev->newPos;
+            else
+                item.newPos = copyExternalValue(item.target);
+            prev = &item;
+        }
+        size_t pos = nextWritePos();
+        size_t absPos = _base.size + pos;
+
+        // Copy the range, then fix up the pointers that leave it:
+        auto dst = (uint8_t*)_out.write(lo, size);
+        for (auto &item : _subtree) {
+            size_t slotOffset = (const uint8_t*)item.slot - lo;
+            if (item.outside) {
+                assert(item.wide || absPos + slotOffset - item.newPos < 0x10000);
+                Value ptr(absPos + slotOffset - item.newPos, item.wide ? kWide : kNarrow);
+                memcpy(dst + slotOffset, &ptr, width(item.wide));
+            } else if (item.target->tag() == kStringTag) {
+                slice str = item.target->asString();
+                cacheString(slice(dst + ((const uint8_t*)str.buf - lo), str.size),
+                            absPos + (item.start - lo));
+            }
+        }
+        writePointer(pos + ((const uint8_t*)root - lo));
+        _stats.subtreesCopied++;
+        return true;
+    }
+
+    // Adds the Values that a collection's pointers refer to, and the Values that _they_ refer
+    // to, etc., to _subtree. Returns the address of the end of the collection, or nullptr if it
+    // can't be copied because its keys aren't in the order this Encoder would write them in.
+    const uint8_t* Encoder::scanSubtree(const Value *collection) {
+        Array::iterator iter((const Array*)collection);     // (works with dicts too)
+        bool wide = iter._wide;
+        bool isDict = (collection->tag() == kDictTag);
+        size_t n = isDict ? 2 * iter._count : iter._count;
+        const Value *slot = iter._first;
+        slice prevKey;
+        for (size_t i = 0; i < n; ++i, slot = slot->next(wide)) {
+            const Value *value = Value::deref(slot, wide);
+            if (slot->isPointer()) {
+                subtreeItem item = {(const uint8_t*)value, nullptr, slot, value, wide, false, 0};
+                if (value->tag() >= kArrayTag) {
+                    item.end = scanSubtree(value);
+                    if (!item.end)
+                        return nullptr;
+                } else {
+                    item.end = item.start + value->dataSize();
+                }
+                _subtree.push_back(item);
+            }
+            if (isDict && _sortKeys && (i & 1) == 0) {
+                slice key = value->isInteger() ? slice(nullptr, (size_t)value->asInt())
+                                               : value->asString();
+                if (i > 0 && !compareKeysByIndex(&prevKey, &key))
+                    return nullptr;
+                prevKey = key;
+            }
+        }
+        return (const uint8_t*)slot;
+    }
+
+    // If a Value from another document doesn't need to be copied to the output, because it's in
+    // the base or is a string that's already been written, sets `pos` to its position.
+    bool Encoder::findExistingValue(const Value *value, size_t &pos) {
+        if (valueIsInBase(value)) {
+            pos = (const uint8_t*)value - (const uint8_t*)_base.buf;
+            return true;
+        }
+        if (value->tag() == kStringTag) {
+            slice str = value->asString();
+            if (isUniquable(str)) {
+                auto &entry = _strings.find(str);
+                if (entry.first.buf) {
+                    pos = entry.second.offset;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // Copies a scalar Value to the output, unless it's in the base or is a string that's already
+    // been written, and returns its position.
+    size_t Encoder::copyExternalValue(const Value *value) {
+        if (valueIsInBase(value))
+            return (const uint8_t*)value - (const uint8_t*)_base.buf;
+        StringTable::slot *entry = nullptr;
+        slice str;
+        if (value->tag() == kStringTag) {
+            str = value->asString();
+            if (isUniquable(str)) {
+                entry = &_strings.find(str);
+                if (entry->first.buf) {
+                    savedString(str);
+                    return entry->second.offset;
+                }
+            }
+        }
+        size_t pos = _base.size + nextWritePos();
+        throwIf(pos > 1u<<31, MemoryError, "encoded data too large");
+        auto dst = (const uint8_t*)_out.write(value, value->dataSize());
+        _out.padToEvenLength();
+        if (entry) {
+            StringTable::info i = {(uint32_t)pos};
+            _strings.addAt(*entry, slice(dst + ((const uint8_t*)str.buf - (const uint8_t*)value),
+                                         str.size), i);
+        }
+        return pos;
+    }
+
+
+#pragma mark - LAYOUT:
+
+
+    // The second pass of optimizeLayout: re-encodes the document just written, depth-first, so
+    // that each collection's children are written right before it.
+    void Encoder::relayout() {
+        alloc_slice firstPass(_out.contiguousOutput());
+        const Value *root = Value::fromTrustedData(firstPass);
+        if (root->tag() < kArrayTag || root->countIsZero())
+            return;
+
+        _out.reset();
+        _strings.clear();
+        _numbers.clear();
+        _collections.clear();
+        _collectionContents.clear();
+        _stackDepth = 0;
+        push(kSpecialTag, 1);
+
+        // Keys were already mapped and sorted by the first pass, so keep them as they are:
+        auto sortKeys = _sortKeys;
+        auto sharedKeys = _sharedKeys;
+        _sortKeys = false;
+        _sharedKeys = nullptr;
+        _layingOut = true;
+        EncoderStats firstPassStats = _stats;
+        _stats = _statsAtReset;
+        try {
+            writeLaidOut(root);
+            writeRoot();
+        } catch (...) {
+            _sortKeys = sortKeys;
+            _sharedKeys = sharedKeys;
+            _layingOut = false;
+            throw;
+        }
+        _sortKeys = sortKeys;
+        _sharedKeys = sharedKeys;
+        _layingOut = false;
+
+        // Only the first pass encoded keys and copied subtrees, so its counts of those stand:
+        _stats.sharedKeyHits = firstPassStats.sharedKeyHits;
+        _stats.sharedKeyMisses = firstPassStats.sharedKeyMisses;
+        _stats.dictsPresorted = firstPassStats.dictsPresorted;
+        _stats.dictShapeHits = firstPassStats.dictShapeHits;
+        _stats.dictShapeMisses = firstPassStats.dictShapeMisses;
+        _stats.subtreesCopied = firstPassStats.subtreesCopied;
+    }
+
+    // Writes a value for the second pass of optimizeLayout. A collection's child collections are
+    // written first, then its strings and numbers along with its items, so that what it points to
+    // comes right before it and can usually be reached with narrow pointers.
+    void Encoder::writeLaidOut(const Value *value) {
+        if (value->tag() < kArrayTag || value->countIsZero()) {
+            writeValue(value);
+            return;
+        }
+        auto isCollection = [](const Value *item) {
+            return item->tag() >= kArrayTag && !item->countIsZero();
+        };
+
+        std::vector<size_t> childPositions;
+        size_t nextChild = 0;
+        auto writeItem = [&](const Value *item) {
+            if (isCollection(item))
+                writePointer(childPositions[nextChild++] - _base.size);
+            else
+                writeValue(item);
+        };
+
+        if (value->tag() == kDictTag) {
+            const Dict *dict = value->asDict();
+            for (Dict::iterator i(dict); i; ++i)
+                if (isCollection(i.value()))
+                    childPositions.push_back(writeDetached(i.value()));
+            beginDictionary(dict->count());
+            for (Dict::iterator i(dict); i; ++i) {
+                const Value *key = i.key();
+                if (key->isInteger())
+                    writeKey((int)key->asInt());
+                else
+                    writeKey(key->asString());
+                writeItem(i.value());
+            }
+            endDictionary();
+        } else {
+            const Array *array = value->asArray();
+            for (Array::iterator i(array); i; ++i)
+                if (isCollection(i.value()))
+                    childPositions.push_back(writeDetached(i.value()));
+            beginArray(array->count());
+            for (Array::iterator i(array); i; ++i)
+                writeItem(i.value());
+            endArray();
+        }
+    }
+
+    // Writes a collection on its own, outside the one currently open, and returns its position.
+    size_t Encoder::writeDetached(const Value *collection) {
+        push(kSpecialTag, 1);
+        writeLaidOut(collection);
+        size_t pos = (*_items)[0].pointerValue<true>();
+        _items->clear();
+        --_stackDepth;
+        _items = &_stack[_stackDepth - 1];
+        return pos;
+    }
+
+
+#pragma mark - COMPACTING:
+
+
+    // Compaction slides the reachable Values down over the unreachable bytes between them,
+    // keeping them in the same order. Each pointer then only needs to shrink by the number of
+    // bytes removed between it and its target, so a narrow pointer always still fits, and every
+    // Value is copied exactly once without being decoded.
+    // The reachable bytes are tracked in a bitmap with one bit per 2-byte unit; the new position
+    // of a unit is the number of reachable units before it, times two. Finding the reachable
+    // Values also validates them, applying the same checks as Value::fromData.
+    alloc_slice Encoder::compact(slice data) {
+        throwIf(!Value::findRoot(data), InvalidData, "invalid Fleece data");
+        if (data.size == kNarrow)
+            return alloc_slice(data);                   // the root is an inline scalar
+
+        struct pointer {const Value *slot; bool wide;};
+        std::vector<pointer> pointers;                  // Every pointer in the reachable Values
+        std::vector<const Value*> collections;          // Collections whose items aren't scanned
+        size_t nUnits = data.size / kNarrow, nWords = (nUnits + 63) / 64;
+        std::vector<uint64_t> live(nWords);             // Bitmap of reachable units
+        auto unitOf = [&](const void *addr) {
+            return (size_t)((const byte*)addr - (const byte*)data.buf) / kNarrow;
+        };
+        auto isLive = [&](size_t unit) {
+            return (live[unit / 64] >> (unit % 64)) & 1;
+        };
+        auto setLive = [&](size_t unit, size_t endUnit) {
+            for (; unit < endUnit && unit % 64; ++unit)
+                live[unit / 64] |= 1ull << (unit % 64);
+            for (; unit + 64 <= endUnit; unit += 64)
+                live[unit / 64] = ~0ull;
+            for (; unit < endUnit; ++unit)
+                live[unit / 64] |= 1ull << (unit % 64);
+        };
+        auto checkValid = [](bool valid) {
+            throwIf(!valid, InvalidData, "invalid Fleece data");
+        };
+
+        // Marks a Value (or a wide pointer in a chain) as reachable, if it isn't already; it has
+        // to end by `limit`, the collection that refers to it:
+        auto reach = [&](const Value *v, const void *limit) {
+            size_t unit = unitOf(v);
+            if (isLive(unit))
+                return false;
+            const void *end;
+            if (v->isPointer()) {
+                end = offsetby(v, kWide);
+            } else if (v->tag() >= kArrayTag) {
+                Array::impl iter(v);                 // (works with dicts too)
+                size_t n = (v->tag() == kDictTag) ? 2 * iter._count : iter._count;
+                end = offsetby(iter._first, n * width(iter._wide));
+                if (n > 0)
+                    collections.push_back(v);
+            } else {
+                end = offsetby(v, v->dataSize());
+            }
+            checkValid(end <= limit);
+            setLive(unit, unitOf(offsetby(end, 1)));    // (rounds up past any padding byte)
+            return true;
+        };
+        // Adds a pointer in a collection, and the Value(s) it leads to:
+        auto follow = [&](const Value *slot, bool wide, const void *collection) {
+            const void *minTarget = data.buf, *maxTarget = collection;
+            for (;;) {
+                pointers.push_back({slot, wide});
+                slot = Value::derefPointer(slot, wide);
+                checkValid(slot >= minTarget && slot < maxTarget);
+                if (!reach(slot, collection) || !slot->isPointer())
+                    return;
+                maxTarget = slot;
+                wide = true;                            // (subsequent pointers must be wide)
+            }
+        };
+
+        // Start from the trailer, the 2-byte pointer to the root at the end of the data:
+        auto trailer = (const Value*)offsetby(data.buf, data.size - kNarrow);
+        setLive(nUnits - 1, nUnits);
+        follow(trailer, false, trailer);
+        while (!collections.empty()) {
+            const Value *collection = collections.back();
+            collections.pop_back();
+            Array::impl iter(collection);
+            size_t n = (collection->tag() == kDictTag) ? 2 * iter._count : iter._count;
+            bool wide = iter._wide;
+            const Value *slot = iter._first;
+            for (size_t i = 0; i < n; ++i) {
+                const Value *next = slot->next(wide);
+                if (slot->isPointer())
+                    follow(slot, wide, collection);
+                else
+                    checkValid(slot->tag() >= kArrayTag ? slot->countIsZero()
+                                                        : offsetby(slot, slot->dataSize()) <= next);
+                slot = next;
+            }
+        }
+
+        // Count the reachable units before each word of the bitmap:
+        std::vector<uint32_t> liveBefore(nWords + 1);
+        for (size_t w = 0; w < nWords; ++w)
+            liveBefore[w + 1] = liveBefore[w] + (uint32_t)std::bitset<64>(live[w]).count();
+        auto relocate = [&](const void *addr) {
+            size_t unit = unitOf(addr);
+            uint64_t below = live[unit / 64] & ((1ull << (unit % 64)) - 1);
+            return (liveBefore[unit / 64] + std::bitset<64>(below).count()) * kNarrow;
+        };
+
+        // Copy each run of reachable units, skipping over whole words where nothing changes:
+        alloc_slice output(liveBefore[nWords] * kNarrow);
+        auto dst = (byte*)output.buf;
+        size_t runStart = 0;
+        bool inRun = false;
+        for (size_t w = 0; w < nWords; ++w) {
+            uint64_t bits = live[w];
+            if (bits == (inRun ? ~0ull : 0))
+                continue;
+            for (size_t b = 0; b < 64; ++b) {
+                if (((bits >> b) & 1) != inRun) {
+                    size_t unit = w * 64 + b;
+                    if (inRun) {
+                        memcpy(dst, offsetby(data.buf, runStart * kNarrow),
+                               (unit - runStart) * kNarrow);
+                        dst += (unit - runStart) * kNarrow;
+                    } else {
+                        runStart = unit;
+                    }
+                    inRun = !inRun;
+                }
+            }
+        }
+        if (inRun)
+            memcpy(dst, offsetby(data.buf, runStart * kNarrow), (nUnits - runStart) * kNarrow);
+
+        // Then fix up the pointers:
+        dst = (byte*)output.buf;
+        for (auto &p : pointers) {
+            size_t slotPos = relocate(p.slot);
+            size_t targetPos = relocate(Value::derefPointer(p.slot, p.wide));
+            Value ptr(slotPos - targetPos, p.wide ? kWide : kNarrow);
+            memcpy(dst + slotPos, &ptr, width(p.wide));
+        }
+        return output;
+    }
+
+}
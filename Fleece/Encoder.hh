@@ -22,6 +22,7 @@
 #include "Writer.hh"
 #include "StringTable.hh"
 #include <array>
+#include <functional>
 #include <vector>
 
 
@@ -29,16 +30,110 @@ namespace fleece {
     class SharedKeys;
 
 
+    /** Counts of what an Encoder has done, for tuning its options (such as uniqueStrings and
+        sortKeys) to a workload. They're cheap to keep, so they're kept in all builds. */
+    struct EncoderStats {
+        uint64_t narrowCollections {0};     // Arrays and dicts written with 2-byte items
+        uint64_t wideCollections {0};       // Arrays and dicts written with 4-byte items
+        uint64_t narrowItems {0};           // Sum of the counts of narrow arrays and dicts
+        uint64_t wideItems {0};             // Sum of the counts of wide arrays and dicts
+        uint64_t savedStrings {0};          // Strings written as pointers to earlier copies
+        uint64_t savedStringBytes {0};      // Bytes of output saved by those pointers
+        uint64_t savedNumbers {0};          // Numbers written as pointers to earlier copies
+        uint64_t savedCollections {0};      // Collections written as pointers to earlier copies
+        uint64_t subtreesCopied {0};        // Collections copied from other data in one piece
+        uint64_t sharedKeyHits {0};         // Keys written as SharedKeys integers
+        uint64_t sharedKeyMisses {0};       // Keys written as strings despite SharedKeys
+        uint64_t dictsPresorted {0};        // Dicts whose keys were already in order
+        uint64_t dictShapeHits {0};         // Dicts sorted with a cached key order
+        uint64_t dictShapeMisses {0};       // Dicts whose keys had to be sorted from scratch
+    };
+
+
+    /** A dictionary key that an Encoder can write faster than a plain string, for producers that
+        write the same few keys over and over. The first time an encoder writes it, the key
+        remembers its SharedKeys integer, or where its string was written; after that, writing
+        it skips the hashing and table lookups. What it remembers is forgotten when the encoder
+        is reset or given a different base or SharedKeys.
+        Warning: the input string's memory MUST remain valid for as long as the key is in use!
+        (The key stores a pointer to the string, but does not copy it.) */
+    class EncoderKey {
+    public:
+        explicit EncoderKey(slice rawString)
+        :_rawString(rawString), _hash(rawString.hash()) { }
+
+        slice string() const noexcept               {return _rawString;}
+    private:
+        slice const _rawString;
+        uint64_t _generation {0};           // Encoder generation the cached state is valid for
+        uint32_t const _hash;
+        uint32_t _offset;                   // Where the string was written, if _hasOffset
+        int _numericKey;                    // SharedKeys encoding, if _hasNumericKey
+        bool _hasOffset {false};
+        bool _hasNumericKey {false};
+
+        friend class Encoder;
+    };
+
+
     /** Generates Fleece-encoded data. */
     class Encoder {
     public:
         /** Constructs an encoder. */
         Encoder(size_t reserveOutputSize =256);
 
+        /** Constructs an encoder that streams its output to a file. Finished data is flushed to
+            the file as encoding proceeds, so memory use is bounded by the currently open
+            collections instead of the size of the document. extractOutput() will return null.
+            (Strings are only uniqued within the data since the last flush.) */
+        Encoder(FILE *outputFile NONNULL);
+
+        /** Constructs an encoder that streams its output to a callback, in the same manner as
+            the FILE-based constructor. */
+        Encoder(Writer::OutputCallback);
+
+        /** Constructs an encoder that writes into a caller-provided buffer, allocating no memory
+            for the output. Call end(), then the encoded data is the first bytesWritten() bytes of
+            the buffer. Throws a MemoryError if the data doesn't fit. */
+        explicit Encoder(slice outputBuffer);
+
+#ifndef _MSC_VER
+        /** Constructs an encoder whose output is a memory-mapped file at the given path, which
+            grows in place as data is written. Call end() to finish the file.
+            extractOutput() will return null. */
+        Encoder(const char *mappedFilePath NONNULL,
+                size_t maxLength =Writer::kDefaultMaxMappedLength);
+#endif
+
         /** Sets the uniqueStrings property. If true (the default), the encoder tries to write
             each unique string only once. This saves space but makes the encoder slightly slower. */
         void uniqueStrings(bool b)      {_uniqueStrings = b;}
 
+        /** Sets the length of the longest strings that uniqueStrings applies to. The default is
+            kMaxSharedStringSize (15 bytes.) Raising it saves space in documents that repeat long
+            strings like URLs or UUIDs, at the cost of hashing every string up to that length. */
+        void maxSharedStringSize(size_t size)   {_maxSharedStringSize = size;}
+
+        /** Sets the uniqueNumbers property. If true, each distinct number that's too large to be
+            stored inline (most doubles, and integers that need more than 3 bytes) is written only
+            once, like a unique string. The default is false. */
+        void uniqueNumbers(bool b)      {_uniqueNumbers = b;}
+
+        /** Sets the uniqueCollections property. If true, an array or dict whose contents are
+            identical to one already written is replaced by a pointer to the earlier one. This
+            only finds collections whose strings and sub-collections were uniqued too, so it works
+            best with uniqueStrings. The default is false. */
+        void uniqueCollections(bool b)  {_uniqueCollections = b;}
+
+        /** Sets the optimizeLayout property. If true, end() encodes the data a second time,
+            writing each collection's strings and numbers just before it and its child
+            collections just before those, so that a collection and what it points to share
+            cache lines. A string written too far back for a narrow pointer to reach is written
+            again rather than pointed to, so more collections stay narrow. This makes encoding
+            about twice as slow. It has no effect when streaming, writing to a memory-mapped
+            file, or appending to a base. The default is false. */
+        void optimizeLayout(bool b)     {_optimizeLayout = b;}
+
         /** Sets the sortKeys property. If true (the default), dictionary keys will be written in
             sorted order. This makes dict::get faster but makes the encoder slightly slower. */
         void sortKeys(bool b)           {_sortKeys = b;}
@@ -46,23 +141,50 @@ namespace fleece {
         /** Sets the base Fleece data that the encoded data will be appended to.
             Any writeValue() calls whose Value points into the base data will be written as
             pointers. */
-        void setBase(slice base)        {_base = base;}
+        void setBase(slice base)        {_base = base; _generation = nextGeneration();}
 
         void reuseBaseStrings();
 
+        /** Indexes the arrays and dicts in the base by their contents, along with its strings and
+            numbers. After this, writing a collection identical to one in the base just writes a
+            pointer to it, so re-encoding a slightly changed document produces a small delta.
+            Since collections only match if their strings and numbers do, this turns on
+            uniqueCollections and uniqueNumbers, and uniques strings of any length, until the
+            next reset(). */
+        void reuseBaseCollections();
+
         bool isEmpty() const            {return _out.length() == 0 && _stackDepth == 1 && _items->empty();}
         size_t bytesWritten() const     {return _out.length();} // may be an underestimate
 
         /** Ends encoding, writing the last of the data to the Writer. */
         void end();
 
-        /** Returns the encoded data. This implicitly calls end(). */
+        /** Returns the encoded data. This implicitly calls end().
+            If the encoder is streaming, the data is flushed to the output and a null slice
+            is returned. */
         alloc_slice extractOutput();
 
+        /** Ends encoding and returns the encoded data, which still belongs to the encoder: it's
+            only valid until the encoder is reset or destroyed. Unlike extractOutput(), this
+            doesn't allocate or give away the output buffer, so a reused encoder needn't
+            allocate a new one. */
+        slice finishInPlace();
+
         /** Resets the encoder so it can be used again. This creates a new empty Writer,
             which can be accessed via the writer() method. */
         void reset();
 
+        /** Resets the encoder and also restores its options (uniqueStrings, uniqueNumbers,
+            uniqueCollections, optimizeLayout, sortKeys, base, shared keys) to their defaults
+            and clears its stats, leaving it like a new encoder except that it keeps its
+            allocated memory. Used by EncoderPool. */
+        void resetForReuse();
+
+        /** Statistics about the data encoded so far. These accumulate across calls to reset(),
+            so they can describe a workload of many documents, until resetStats() is called. */
+        const EncoderStats& stats() const   {return _stats;}
+        void resetStats()                   {_stats = _statsAtReset = EncoderStats();}
+
         /////// Writing data:
 
         void writeNull();
@@ -76,10 +198,31 @@ namespace fleece {
         void writeString(const std::string&);
         void writeString(slice s)           {(void)_writeString(s);}
 
+        /** Writes a string whose bytes the caller produces in place, such as by decoding them,
+            saving the copy writeString would make. beginString reserves room in the output
+            for up to `maxSize` bytes and returns where they go; endString then completes the
+            string, given the number of bytes actually written. No other Encoder method may be
+            called in between; if an exception interrupts them, the Encoder must be reset. */
+        uint8_t* beginString(size_t maxSize);
+        void endString(size_t size);
+
         void writeData(slice s);
 
         void writeValue(const Value* NONNULL, const SharedKeys *sk =nullptr);
 
+        /** Writes a value that was encoded by another Encoder, by copying its output instead of
+            re-encoding it. The data must be the complete output of an Encoder that had no base,
+            as returned by extractOutput() or finishInPlace(). Fleece pointers are relative, so
+            the data stays valid when moved; only the pointer to its root gets relocated. */
+        void writeEncoded(slice encodedData);
+
+        /** Rewrites Fleece data as a standalone document containing only the values reachable
+            from its root. This is meant for data made by appending deltas to a base, which
+            accumulates unreachable values with every update. The reachable values are copied
+            as-is, in their original order, and only their pointers are adjusted, which is much
+            faster than re-encoding them. Throws InvalidData if the data isn't valid Fleece. */
+        static alloc_slice compact(slice data);
+
 #ifdef __OBJC__
         /** Writes an Objective-C object. Supported classes are the ones allowed by
             NSJSONSerialization, as well as NSData. */
@@ -98,6 +241,17 @@ namespace fleece {
             the next outermost collection (or made the root if there is no collection active.) */
         void endArray();
 
+        /** Callback that encodes the item at `index` of an array being written in parallel. */
+        typedef std::function<void(Encoder&, size_t index)> ItemEncoder;
+
+        /** Adds `count` items to the current array, encoding them in parallel. The indices are
+            split into ranges handled by up to `maxThreads` threads (by default, one per CPU
+            core.) Each range is encoded by calling `encodeItem` with a child Encoder; when
+            all are done, the children's output is joined into this encoder in index order.
+            `encodeItem` is called on multiple threads at once, so it must be thread-safe.
+            (Not supported when using shared keys, since those aren't thread-safe.) */
+        void writeParallel(size_t count, const ItemEncoder &encodeItem, unsigned maxThreads =0);
+
         //////// Writing dictionaries:
 
         /** Begins creating a dictionary. Until endDict is called, values written to the encoder
@@ -107,6 +261,11 @@ namespace fleece {
                             effect on the output but can speed up encoding slightly. */
         void beginDictionary(size_t reserve =0);
 
+        /** Begins creating a dictionary whose keys the caller will write in sorted order, so the
+            encoder doesn't need to sort them. (If shared keys are in use, some keys may be
+            encoded as integers, which changes their order; then the dict is sorted as usual.) */
+        void beginSortedDictionary(size_t reserve =0);
+
         /** Ends creating a dictionary. The dict is written to the output and added as a value to
             the next outermost collection (or made the root if there is no collection active.) */
         void endDictionary();
@@ -115,6 +274,14 @@ namespace fleece {
         void writeKey(const std::string&);
         /** Writes a key to the current dictionary. This must be called before adding a value. */
         void writeKey(slice);
+        /** Writes a key whose hash, as computed by slice::hash(), is already known. This saves
+            the encoder from hashing the key itself. */
+        void writeKey(slice, uint32_t hash);
+
+        /** Writes a key whose encoding is cached in an EncoderKey. After the first time, this is
+            little more than appending a Value, so it's the fastest way to write a fixed set
+            of keys. */
+        void writeKey(EncoderKey&);
 
         /** Writes a numeric key (encoded with SharedKeys) to the current dictionary. */
         void writeKey(int);
@@ -124,7 +291,9 @@ namespace fleece {
 
         /** Associates a SharedKeys object with this Encoder. The writeKey() methods that take
             strings will consult this object to possibly map the key to an integer. */
-        void setSharedKeys(SharedKeys *s) {_sharedKeys = s;}
+        void setSharedKeys(SharedKeys *s) {_sharedKeys = s; _generation = nextGeneration();}
+
+        SharedKeys* sharedKeys() const          {return _sharedKeys;}
 
         //////// "<<" convenience operators;
 
@@ -152,17 +321,49 @@ namespace fleece {
         class valueArray : public std::vector<Value> {
         public:
             valueArray()                    { }
-            void reset(internal::tags t)    {tag = t; wide = false; keys.clear();}
+            void reset(internal::tags t)    {tag = t; wide = presorted = false; keys.clear();
+                                             keyCopies.clear();}
             internal::tags tag;
             bool wide;
+            bool presorted;                 // Keys are written in order, no need to sort
             std::vector<slice> keys;
+            std::vector<alloc_slice> keyCopies;   // Keys copied out of flushed output
         };
 
+        // A sequence of dict keys, in the order written, and the order they sort into.
+        // sortDict caches these, since most dicts in a document tend to share a few key sets.
+        struct dictShape {
+            bool matches(const std::vector<slice> &keys) const;
+            void set(const std::vector<slice> &keys, const slice* const sorted[]);
+
+            std::string keyData;                // Each key's size (or int value), then its bytes
+            std::vector<uint32_t> order;        // order[i] is the index of the i'th sorted key
+        };
+
+        // A Value found by scanSubtree, and the pointer that refers to it.
+        struct subtreeItem {
+            const uint8_t *start, *end;     // Address range of the Value
+            const Value *slot;              // The pointer to it, in a collection of the subtree
+            const Value *target;            // The Value itself (at the end of any pointer chain)
+            bool wide;                      // Is the pointer wide?
+            bool outside;                   // Is the Value outside the range being copied?
+            size_t newPos;                  // Where the Value got written, if outside the copy
+        };
+
+        static constexpr size_t kDictShapeCacheSize = 16;
+        static constexpr size_t kMaxDictShapeKeys = 64;
+
         void addItem(Value v);
         void writeRawValue(slice rawValue, bool canInline =true);
         void writeValue(internal::tags, uint8_t buf[], size_t size, bool canInline =true);
+        void writeEncodedItems(slice encodedArray);
+        bool copySubtree(const Value *collection NONNULL, const SharedKeys*);
+        const uint8_t* scanSubtree(const Value *collection NONNULL);
+        bool findExistingValue(const Value* NONNULL, size_t &pos);
+        size_t copyExternalValue(const Value* NONNULL);
         bool valueIsInBase(const Value *value NONNULL) const;
         void reuseBaseStrings(const Value* NONNULL);
+        size_t reuseBaseCollection(const Value *collection NONNULL);
         void cacheString(slice s, size_t offsetInBase);
         static bool isNarrowValue(const Value *value NONNULL);
         void writePointer(ssize_t pos);
@@ -171,14 +372,28 @@ namespace fleece {
         void _writeFloat(float);
         slice writeData(internal::tags, slice s);
         slice _writeString(slice);
+        slice writeUniqueString(slice, uint32_t hash);
+        void writeUniqueNumber(slice rawValue);
+        bool isUniquable(slice) const;
+        void savedString(slice);
+        void resolveKeys(valueArray &items);
         void addingKey();
         void addedKey(slice str);
         size_t nextWritePos();
         void sortDict(valueArray &items);
+        static bool keysAreSorted(const std::vector<slice> &keys);
         void checkPointerWidths(valueArray *items NONNULL, size_t writePos);
         void fixPointers(valueArray *items NONNULL);
         void endCollection(internal::tags tag);
+        static uint64_t nextGeneration();
+        void writeRoot();
+        void relayout();
+        void writeLaidOut(const Value* NONNULL);
+        size_t writeDetached(const Value* NONNULL);
+        bool isNearby(size_t offset);
         void push(internal::tags tag, size_t reserve);
+        void checkFlush();
+        void flush();
 
         Encoder(const Encoder&) = delete;
         Encoder& operator=(const Encoder&) = delete;
@@ -191,18 +406,35 @@ namespace fleece {
         unsigned _stackDepth {0};    // Current depth of _stack
         StringTable _strings;        // Maps strings to the offsets where they appear as values
         bool _uniqueStrings {true};  // Should strings be uniqued before writing?
+        size_t _maxSharedStringSize {internal::kMaxSharedStringSize}; // Longest string to unique
+        StringTable _numbers;        // Maps encoded numbers to their offsets, if _uniqueNumbers
+        bool _uniqueNumbers {false}; // Should out-of-line numbers be uniqued before writing?
+        StringTable _collections;    // Maps collections' contents to their offsets
+        std::vector<alloc_slice> _collectionContents;   // Keys of _collections
+        bool _uniqueCollections {false}; // Should collections be uniqued before writing?
+        bool _reusingBaseCollections {false}; // Has reuseBaseCollections() been called?
+        struct {                     // Options reuseBaseCollections() overrode, for reset()
+            size_t maxSharedStringSize;
+            bool uniqueNumbers, uniqueCollections;
+        } _optionsBeforeReuse;
+        bool _optimizeLayout {false}; // Should end() lay out the data again for locality?
+        bool _layingOut     {false}; // True during the second pass of optimizeLayout
         SharedKeys *_sharedKeys {nullptr};  // Client-provided key-to-int mapping
         slice _base;                 // Base Fleece data being appended to (if any)
         bool _sortKeys      {true};  // Should dictionary keys be sorted?
         bool _writingKey    {false}; // True if Value being written is a key
         bool _blockedOnKey  {false}; // True if writes should be refused
+        std::array<dictShape, kDictShapeCacheSize> _dictShapes; // Cache of recent key orders
+        std::vector<subtreeItem> _subtree;  // Scratch space used by copySubtree
+        uint8_t *_stringStart {nullptr};    // Space reserved by beginString, if any
+        size_t _stringPos, _stringMaxSize;  // Its position in the output, and its capacity
+        std::vector<uint8_t> _stringScratch; // Used by beginString if the output lacks room
+
+        EncoderStats _stats;                // Counts of what's been encoded
+        EncoderStats _statsAtReset;         // _stats when this document was begun
+        uint64_t _generation {nextGeneration()};  // Changes when EncoderKeys' caches go stale
 
         friend class EncoderTests;
-#ifndef NDEBUG
-    public: // Statistics for use in tests
-        unsigned _numNarrow {0}, _numWide {0}, _narrowCount {0}, _wideCount {0},
-                 _numSavedStrings {0};
-#endif
     };
 
 }
@@ -0,0 +1,94 @@
+//
+// EncoderPool.hh
+//
+// Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "Encoder.hh"
+#include <mutex>
+#include <vector>
+
+namespace fleece {
+
+    /** A thread-safe pool of reusable encoders. An encoder returned to the pool keeps the
+        memory it allocated for its output, value stack and string table, already sized by the
+        documents it encoded before; so once the pool is warmed up, encoding more documents of
+        similar size doesn't allocate memory.
+        Read the output of a pooled encoder with finishInPlace(), not extractOutput(), which
+        would give away its output buffer.
+        ENCODER needs a default constructor and a resetForReuse() method. */
+    template <class ENCODER>
+    class EncoderPoolOf {
+    public:
+        static const size_t kDefaultMaxPooled = 16;
+
+        explicit EncoderPoolOf(size_t maxPooled =kDefaultMaxPooled)
+        :_maxPooled(maxPooled)
+        {
+            _pool.reserve(maxPooled);
+        }
+
+        ~EncoderPoolOf() {
+            for (ENCODER *encoder : _pool)
+                delete encoder;
+        }
+
+        /** Returns a ready-to-use encoder, from the pool if possible. */
+        ENCODER* acquire() {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (!_pool.empty()) {
+                    ENCODER *encoder = _pool.back();
+                    _pool.pop_back();
+                    return encoder;
+                }
+            }
+            return new ENCODER;
+        }
+
+        /** Resets an encoder and returns it to the pool; or deletes it if the pool is full. */
+        void release(ENCODER *encoder) {
+            encoder->resetForReuse();
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (_pool.size() < _maxPooled) {
+                    _pool.push_back(encoder);
+                    return;
+                }
+            }
+            delete encoder;
+        }
+
+        /** The number of idle encoders in the pool. */
+        size_t count() const {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _pool.size();
+        }
+
+    private:
+        EncoderPoolOf(const EncoderPoolOf&) =delete;
+        EncoderPoolOf& operator=(const EncoderPoolOf&) =delete;
+
+        mutable std::mutex _mutex;
+        std::vector<ENCODER*> _pool;
+        const size_t _maxPooled;
+    };
+
+
+    /** A pool of reusable Encoders. */
+    typedef EncoderPoolOf<Encoder> EncoderPool;
+
+}
@@ -22,6 +22,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -46,6 +47,7 @@ extern "C" {
     typedef const struct _FLArray* FLArray;         ///< A reference to an array value.
     typedef const struct _FLDict*  FLDict;          ///< A reference to a dictionary (map) value.
     typedef struct _FLEncoder*     FLEncoder;       ///< A reference to an encoder
+    typedef struct _FLEncoderPool* FLEncoderPool;   ///< A reference to a pool of encoders
     typedef struct _FLSharedKeys*  FLSharedKeys;    ///< A reference to a shared-keys mapping
     typedef struct _FLKeyPath*     FLKeyPath;       ///< A reference to a key path
 #endif
@@ -139,6 +141,7 @@ extern "C" {
         kFLInternalError,      // Something that shouldn't happen
         kFLNotFound,           // Key not found
         kFLSharedKeysStateError, // Misuse of shared keys (not in transaction, etc.)
+        kFLPOSIXError,         // Something went wrong at the OS level (file I/O, etc.)
     } FLError;
 
     /** @} */
@@ -173,6 +176,11 @@ extern "C" {
     /** Produces a human-readable dump of the Value encoded in the data. */
     FLStringResult FLData_Dump(FLSlice data);
 
+    /** Rewrites Fleece data, such as a base with deltas appended to it, as a standalone document
+        containing only the values reachable from its root. The number of bytes reclaimed is the
+        difference between the input and output sizes. */
+    FLSliceResult FLData_Compact(FLSlice data, FLError *outError);
+
     /** @} */
     /** \name Value Accessors
         @{ */
@@ -245,6 +253,17 @@ extern "C" {
                                   bool json5,
                                   bool canonicalForm);
 
+    /** Like FLValue_ToJSONX, but writes the JSON to a file as it's generated instead of
+        returning it, flushing every 64KB or so; memory use stays bounded however large the
+        value is. Returns false on error, including a failure to write to the file.
+        (The file is not closed.) */
+    bool FLValue_WriteJSON(FLValue v,
+                           FLSharedKeys sk,
+                           bool json5,
+                           bool canonicalForm,
+                           FILE *output,
+                           FLError *outError);
+
 
     /** Converts valid JSON5 to JSON. */
     FLStringResult FLJSON5_ToJSON(FLString json5, FLError *error);
@@ -439,6 +458,26 @@ extern "C" {
                                        bool uniqueStrings,
                                        bool sortKeys);
 
+    /** Creates a new Fleece encoder that streams its output to a file as it goes, instead of
+        keeping it all in memory. Finished values are flushed to the file during encoding, so
+        memory use stays bounded even for very large documents.
+        FLEncoder_Finish will flush the remaining output and return a null slice.
+        (The file is not closed when the encoder is freed.) */
+    FLEncoder FLEncoder_NewWritingToFile(FILE*, bool uniqueStrings);
+
+    /** Creates a new Fleece encoder that writes directly into a caller-supplied buffer, without
+        allocating memory for the output. If the output doesn't fit, encoding fails with
+        kFLMemoryError. Finish with FLEncoder_FinishInPlace. */
+    FLEncoder FLEncoder_NewWithBuffer(void *buffer, size_t capacity, bool uniqueStrings);
+
+#ifndef _MSC_VER
+    /** Creates a new Fleece encoder whose output is a memory-mapped file, created or truncated
+        at the given path. The mapping grows in place as the data is written, so the output is
+        never copied. Finish with FLEncoder_FinishInPlace, which trims the file to the size of
+        the data. Returns NULL if the file can't be created. */
+    FLEncoder FLEncoder_NewWritingToMappedFile(const char *path, bool uniqueStrings);
+#endif
+
     /** Frees the space used by an encoder. */
     void FLEncoder_Free(FLEncoder);
 
@@ -460,10 +499,32 @@ extern "C" {
         be used by first appending it to the base data. */
     void FLEncoder_MakeDelta(FLEncoder e, FLSlice base, bool reuseStrings);
 
+    /** Call after FLEncoder_MakeDelta to also match arrays and dicts against the base by their
+        contents: writing one identical to one in the base will just create a pointer back to it.
+        This indexes the whole base, so it costs time proportional to the base's size. It lasts
+        until the encoder is next reset. */
+    void FLEncoder_ReuseBaseCollections(FLEncoder e);
+
     /** Resets the state of an encoder without freeing it. It can then be reused to encode
         another value. */
     void FLEncoder_Reset(FLEncoder);
 
+    /** Creates a pool of reusable Fleece encoders. Encoders returned to the pool keep their
+        allocated memory, so steady-state encoding of similar documents doesn't allocate.
+        Up to `maxPooled` idle encoders are kept. The pool is thread-safe. */
+    FLEncoderPool FLEncoderPool_New(size_t maxPooled);
+
+    /** Frees a pool and its idle encoders. Acquired encoders must have been released first. */
+    void FLEncoderPool_Free(FLEncoderPool);
+
+    /** Gets an encoder from a pool, or creates one if there aren't any idle ones.
+        Finish it with FLEncoder_FinishInPlace, then return it with FLEncoderPool_Release
+        instead of freeing it. */
+    FLEncoder FLEncoderPool_Acquire(FLEncoderPool);
+
+    /** Resets an encoder, including its options, and returns it to its pool. */
+    void FLEncoderPool_Release(FLEncoderPool, FLEncoder);
+
     // Note: The functions that write to the encoder do not return error codes, just a 'false'
     // result on error. The actual error is attached to the encoder and can be accessed by calling
     // FLEncoder_GetError or FLEncoder_End.
@@ -540,6 +601,30 @@ extern "C" {
     /** Specifies the key for the next value to be written to the current dictionary. */
     bool FLEncoder_WriteKey(FLEncoder, FLString);
 
+    /** Opaque key for writing to an encoder. You are responsible for creating space for these;
+        they can go on the stack, on the heap, inside other objects, anywhere.
+        The first time an encoder writes one, it stores the key's encoding in the struct, so
+        writing the same key again with the same encoder (until it's reset) is much faster than
+        FLEncoder_WriteKey. */
+    typedef struct {
+        void* _private1[2];
+        uint64_t _private2;
+        uint32_t _private3, _private4, _private5;
+        bool _private6, _private7;
+    } FLEncoderKey;
+
+    /** Initializes an FLEncoderKey struct with a key string.
+        Warning: the input string's memory MUST remain valid for as long as the FLEncoderKey is in
+        use! (The FLEncoderKey stores a pointer to the string, but does not copy it.) */
+    FLEncoderKey FLEncoderKey_Init(FLString);
+
+    /** Returns the string value of the key (which it was initialized with.) */
+    FLString FLEncoderKey_GetString(const FLEncoderKey*);
+
+    /** Specifies the key for the next value to be written to the current dictionary, using an
+        FLEncoderKey. */
+    bool FLEncoder_WriteEncoderKey(FLEncoder, FLEncoderKey*);
+
     /** Ends writing a dictionary value; pops back the previous encoding state. */
     bool FLEncoder_EndDict(FLEncoder);
 
@@ -560,10 +645,43 @@ extern "C" {
     /** Returns the number of bytes encoded so far. */
     size_t FLEncoder_BytesWritten(FLEncoder e);
 
+    /** Counts of what an encoder has done, as returned by FLEncoder_GetStats. */
+    typedef struct FLEncoderStats {
+        uint64_t narrowCollections;     ///< Arrays and dicts written with 2-byte items
+        uint64_t wideCollections;       ///< Arrays and dicts written with 4-byte items
+        uint64_t narrowItems;           ///< Sum of the counts of narrow arrays and dicts
+        uint64_t wideItems;             ///< Sum of the counts of wide arrays and dicts
+        uint64_t savedStrings;          ///< Strings written as pointers to earlier copies
+        uint64_t savedStringBytes;      ///< Bytes of output saved by those pointers
+        uint64_t savedNumbers;          ///< Numbers written as pointers to earlier copies
+        uint64_t savedCollections;      ///< Collections written as pointers to earlier copies
+        uint64_t subtreesCopied;        ///< Collections copied from other data in one piece
+        uint64_t sharedKeyHits;         ///< Keys written as shared-key integers
+        uint64_t sharedKeyMisses;       ///< Keys written as strings despite shared keys
+        uint64_t dictsPresorted;        ///< Dicts whose keys were already in order
+        uint64_t dictShapeHits;         ///< Dicts sorted with a cached key order
+        uint64_t dictShapeMisses;       ///< Dicts whose keys had to be sorted from scratch
+    } FLEncoderStats;
+
+    /** Gets an encoder's statistics, which are useful for choosing its options (such as
+        uniqueStrings and sortKeys) for a workload. They accumulate across FLEncoder_Reset
+        calls until FLEncoder_ResetStats is called. A JSON encoder's stats are all zero. */
+    void FLEncoder_GetStats(FLEncoder e, FLEncoderStats *outStats);
+
+    /** Sets an encoder's statistics back to zero. */
+    void FLEncoder_ResetStats(FLEncoder e);
+
     /** Ends encoding; if there has been no error, it returns the encoded data, else null.
         This does not free the FLEncoder; call FLEncoder_Free (or FLEncoder_Reset) next. */
     FLSliceResult FLEncoder_Finish(FLEncoder, FLError*);
 
+    /** Ends encoding and returns the encoded data without copying it, or a null slice on error.
+        The data still belongs to the encoder: it's only valid until the encoder is reset or
+        freed. With FLEncoder_NewWithBuffer or FLEncoder_NewWritingToMappedFile, the data is in
+        the caller's buffer or in the file. This is also the way to finish a pooled encoder,
+        since it doesn't allocate memory or give away the encoder's output buffer. */
+    FLSlice FLEncoder_FinishInPlace(FLEncoder, FLError*);
+
     /** Returns the error code of an encoder, or NoError (0) if there's no error. */
     FLError FLEncoder_GetError(FLEncoder e);
 
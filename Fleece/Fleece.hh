@@ -26,5 +26,7 @@
 #include "Array.hh"
 #include "Dict.hh"
 #include "Encoder.hh"
+#include "EncoderPool.hh"
 #include "JSONConverter.hh"
+#include "NDJSONConverter.hh"
 #include "SharedKeys.hh"
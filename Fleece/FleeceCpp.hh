@@ -287,6 +287,7 @@ namespace fleeceapi {
         void setSharedKeys(FLSharedKeys sk)             {FLEncoder_SetSharedKeys(_enc, sk);}
 
         inline void makeDelta(FLSlice base, bool reuseStrings =true);
+        inline void reuseBaseCollections();
 
         static FLSliceResult convertJSON(FLSlice json, FLError *error) {
             return FLData_ConvertJSON(json, error);
@@ -429,6 +430,7 @@ namespace fleeceapi {
 
     inline void Encoder::makeDelta(FLSlice base, bool reuseStrings)
                                                 {FLEncoder_MakeDelta(_enc, base, reuseStrings);}
+    inline void Encoder::reuseBaseCollections() {FLEncoder_ReuseBaseCollections(_enc);}
     inline bool Encoder::writeNull()            {return FLEncoder_WriteNull(_enc);}
     inline bool Encoder::writeBool(bool b)      {return FLEncoder_WriteBool(_enc, b);}
     inline bool Encoder::writeInt(int64_t n)    {return FLEncoder_WriteInt(_enc, n);}
@@ -17,8 +17,10 @@
 //
 
 #include "FleeceException.hh"
+#include <errno.h>
 #include <memory>
 #include <string>
+#include <string.h>
 
 
 namespace fleece {
@@ -35,6 +37,7 @@ namespace fleece {
         "internal Fleece library error",
         "key not found",
         "incorrect use of persistent shared keys",
+        "POSIX error",
     };
 
     void FleeceException::_throw(ErrorCode code, const char *what) {
@@ -45,6 +48,12 @@ namespace fleece {
     }
 
 
+    void FleeceException::_throwErrno(const char *what) {
+        std::string message = std::string(what) + ": " + strerror(errno);
+        _throw(POSIXError, message.c_str());
+    }
+
+
     ErrorCode FleeceException::getCode(const std::exception &x) noexcept {
         auto fleecex = dynamic_cast<const FleeceException*>(&x);
         if (fleecex)
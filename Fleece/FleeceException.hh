@@ -35,6 +35,7 @@ namespace fleece {
         InternalError,      // This shouldn't happen
         NotFound,           // Key not found
         SharedKeysStateError, // Incorrect use of persistent shared keys (not in transaction, etc.)
+        POSIXError,         // Something went wrong at the OS level (file I/O, etc.)
     } ErrorCode;
 
 
@@ -48,6 +49,9 @@ namespace fleece {
 
         [[noreturn]] static void _throw(ErrorCode code, const char *what);
 
+        /** Throws a POSIXError whose message includes the current value of errno. */
+        [[noreturn]] static void _throwErrno(const char *what);
+
         static ErrorCode getCode(const std::exception&) noexcept;
 
         const ErrorCode code;
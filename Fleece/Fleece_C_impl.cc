@@ -92,6 +92,26 @@ FLSliceResult FLValue_ToJSONX(FLValue v,
     return {nullptr, 0};
 }
 
+bool FLValue_WriteJSON(FLValue v,
+                       FLSharedKeys sk,
+                       bool json5,
+                       bool canonical,
+                       FILE *output,
+                       FLError *outError)
+{
+    try {
+        JSONEncoder encoder(output);
+        encoder.setSharedKeys(sk);
+        encoder.setJSON5(json5);
+        encoder.setCanonical(canonical);
+        if (v)
+            encoder.writeValue(v);
+        encoder.flush();
+        return true;
+    } catchError(outError)
+    return false;
+}
+
 FLSliceResult FLValue_ToJSON(FLValue v)      {return FLValue_ToJSONX(v, nullptr, false, false);}
 FLSliceResult FLValue_ToJSON5(FLValue v)     {return FLValue_ToJSONX(v, nullptr, true,  false);}
 
@@ -120,6 +140,14 @@ FLSliceResult FLData_Dump(FLSlice data) {
 }
 
 
+FLSliceResult FLData_Compact(FLSlice data, FLError *outError) {
+    try {
+        return toSliceResult(Encoder::compact(data));
+    } catchError(outError)
+    return {nullptr, 0};
+}
+
+
 #pragma mark - ARRAYS:
 
 
@@ -290,10 +318,46 @@ FLEncoder FLEncoder_NewWithOptions(FLEncoderFormat format,
     return new FLEncoderImpl(format, reserveSize, uniqueStrings, sortKeys);
 }
 
+FLEncoder FLEncoder_NewWritingToFile(FILE *outputFile, bool uniqueStrings) {
+    return new FLEncoderImpl(outputFile, uniqueStrings);
+}
+
+FLEncoder FLEncoder_NewWithBuffer(void *buffer, size_t capacity, bool uniqueStrings) {
+    return new FLEncoderImpl(new Encoder(slice(buffer, capacity)), uniqueStrings);
+}
+
+#ifndef _MSC_VER
+FLEncoder FLEncoder_NewWritingToMappedFile(const char *path, bool uniqueStrings) {
+    try {
+        return new FLEncoderImpl(new Encoder(path), uniqueStrings);
+    } catchError(nullptr)
+    return nullptr;
+}
+#endif
+
 void FLEncoder_Reset(FLEncoder e) {
     e->reset();
 }
 
+FLEncoderPool FLEncoderPool_New(size_t maxPooled) {
+    return new EncoderPoolOf<FLEncoderImpl>(maxPooled);
+}
+
+void FLEncoderPool_Free(FLEncoderPool pool) {
+    delete pool;
+}
+
+FLEncoder FLEncoderPool_Acquire(FLEncoderPool pool) {
+    try {
+        return pool->acquire();
+    } catchError(nullptr)
+    return nullptr;
+}
+
+void FLEncoderPool_Release(FLEncoderPool pool, FLEncoder e) {
+    pool->release(e);
+}
+
 void FLEncoder_Free(FLEncoder e)                         {
     delete e;
 }
@@ -310,10 +374,41 @@ void FLEncoder_MakeDelta(FLEncoder e, FLSlice base, bool reuseStrings) {
     }
 }
 
+void FLEncoder_ReuseBaseCollections(FLEncoder e) {
+    if (e->isFleece())
+        e->fleeceEncoder->reuseBaseCollections();
+}
+
 size_t FLEncoder_BytesWritten(FLEncoder e) {
     return ENCODER_DO(e, bytesWritten());
 }
 
+void FLEncoder_GetStats(FLEncoder e, FLEncoderStats *outStats) {
+    *outStats = {};
+    if (!e->isFleece())
+        return;
+    auto &stats = e->fleeceEncoder->stats();
+    outStats->narrowCollections = stats.narrowCollections;
+    outStats->wideCollections   = stats.wideCollections;
+    outStats->narrowItems       = stats.narrowItems;
+    outStats->wideItems         = stats.wideItems;
+    outStats->savedStrings      = stats.savedStrings;
+    outStats->savedStringBytes  = stats.savedStringBytes;
+    outStats->savedNumbers      = stats.savedNumbers;
+    outStats->savedCollections  = stats.savedCollections;
+    outStats->subtreesCopied    = stats.subtreesCopied;
+    outStats->sharedKeyHits     = stats.sharedKeyHits;
+    outStats->sharedKeyMisses   = stats.sharedKeyMisses;
+    outStats->dictsPresorted    = stats.dictsPresorted;
+    outStats->dictShapeHits     = stats.dictShapeHits;
+    outStats->dictShapeMisses   = stats.dictShapeMisses;
+}
+
+void FLEncoder_ResetStats(FLEncoder e) {
+    if (e->isFleece())
+        e->fleeceEncoder->resetStats();
+}
+
 bool FLEncoder_WriteNull(FLEncoder e)                    {ENCODER_TRY(e, writeNull());}
 bool FLEncoder_WriteBool(FLEncoder e, bool b)            {ENCODER_TRY(e, writeBool(b));}
 bool FLEncoder_WriteInt(FLEncoder e, int64_t i)          {ENCODER_TRY(e, writeInt(i));}
@@ -330,6 +425,33 @@ bool FLEncoder_BeginDict(FLEncoder e, size_t reserve)    {ENCODER_TRY(e, beginDi
 bool FLEncoder_WriteKey(FLEncoder e, FLSlice s)          {ENCODER_TRY(e, writeKey(s));}
 bool FLEncoder_EndDict(FLEncoder e)                      {ENCODER_TRY(e, endDictionary());}
 
+FLEncoderKey FLEncoderKey_Init(FLSlice string) {
+    FLEncoderKey key;
+    static_assert(sizeof(FLEncoderKey) >= sizeof(EncoderKey), "FLEncoderKey is too small");
+    new (&key) EncoderKey(string);
+    return key;
+}
+
+FLSlice FLEncoderKey_GetString(const FLEncoderKey *key) {
+    return ((const EncoderKey*)key)->string();
+}
+
+bool FLEncoder_WriteEncoderKey(FLEncoder e, FLEncoderKey *k) {
+    auto &key = *(EncoderKey*)k;
+    try {
+        if (!e->hasError()) {
+            if (e->isFleece())
+                e->fleeceEncoder->writeKey(key);
+            else
+                e->jsonEncoder->writeKey(key.string());
+            return true;
+        }
+    } catch (const std::exception &x) {
+        e->recordException(x);
+    }
+    return false;
+}
+
 bool FLEncoder_WriteValueWithSharedKeys(FLEncoder e, FLValue v, FLSharedKeys sk)
                                                          {ENCODER_TRY(e, writeValue(v, sk));}
 bool FLEncoder_WriteValue(FLEncoder e, FLValue v) {
@@ -394,3 +516,17 @@ FLSliceResult FLEncoder_Finish(FLEncoder e, FLError *outError) {
         *outError = e->errorCode;
     return {nullptr, 0};
 }
+
+FLSlice FLEncoder_FinishInPlace(FLEncoder e, FLError *outError) {
+    if (!e->hasError()) {
+        try {
+            throwIf(!e->isFleece(), EncodeError, "not a Fleece encoder");
+            return e->fleeceEncoder->finishInPlace();
+        } catch (const std::exception &x) {
+            e->recordException(x);
+        }
+    }
+    if (outError)
+        *outError = e->errorCode;
+    return {nullptr, 0};
+}
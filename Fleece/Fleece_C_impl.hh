@@ -21,6 +21,7 @@
 #include "JSONEncoder.hh"
 #include "Path.hh"
 #include "FleeceException.hh"
+#include "EncoderPool.hh"
 using namespace fleece;
 
 namespace fleece {
@@ -32,6 +33,7 @@ typedef const Value* FLValue;
 typedef const Array* FLArray;
 typedef const Dict* FLDict;
 typedef FLEncoderImpl* FLEncoder;
+typedef EncoderPoolOf<FLEncoderImpl>* FLEncoderPool;
 typedef SharedKeys* FLSharedKeys;
 typedef Path*       FLKeyPath;
 
@@ -57,7 +59,7 @@ namespace fleece {
         std::unique_ptr<JSONConverter> jsonConverter;
         void* extraInfo {nullptr};
 
-        FLEncoderImpl(FLEncoderFormat format,
+        FLEncoderImpl(FLEncoderFormat format =kFLEncodeFleece,
                       size_t reserveSize =0, bool uniqueStrings =true, bool sortKeys =true)
         {
             if (reserveSize == 0)
@@ -72,6 +74,17 @@ namespace fleece {
             }
         }
 
+        FLEncoderImpl(FILE *outputFile, bool uniqueStrings =true) {
+            fleeceEncoder.reset(new Encoder(outputFile));
+            fleeceEncoder->uniqueStrings(uniqueStrings);
+        }
+
+        FLEncoderImpl(Encoder *encoder, bool uniqueStrings)
+        :fleeceEncoder(encoder)
+        {
+            fleeceEncoder->uniqueStrings(uniqueStrings);
+        }
+
         FLEncoderImpl(Encoder *encoder)
         :ownsFleeceEncoder(false)
         ,fleeceEncoder(encoder)
@@ -105,6 +118,17 @@ namespace fleece {
             errorCode = ::kFLNoError;
             extraInfo = nullptr;
         }
+
+        // Called by EncoderPoolOf when the encoder is returned to the pool:
+        void resetForReuse() {
+            if (fleeceEncoder)
+                fleeceEncoder->resetForReuse();
+            if (jsonConverter)
+                jsonConverter->reset();
+            errorCode = ::kFLNoError;
+            errorMessage.clear();
+            extraInfo = nullptr;
+        }
     };
 
     #define ENCODER_DO(E, METHOD) \
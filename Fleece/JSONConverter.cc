@@ -17,216 +17,945 @@
 //
 
 #include "JSONConverter.hh"
-#include "jsonsl.h"
-#include <map>
+#include "NumConversion.hh"
+#include "PlatformCompat.hh"
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#if defined(__AVX2__)
+    #include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define FLEECE_JSON_SSE2
+    #include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+    #include <intrin.h>
+#endif
 
 namespace fleece {
 
-    static int errorCallback(struct jsonsl_st * jsn,
-                             jsonsl_error_t err,
-                             struct jsonsl_state_st *state,
-                             char *errat) noexcept;
-    static void writePushCallback(struct jsonsl_st * jsn,
-                                  jsonsl_action_t action,
-                                  struct jsonsl_state_st *state,
-                                  const char *buf) noexcept;
-    static void writePopCallback(struct jsonsl_st * jsn,
-                                 jsonsl_action_t action,
-                                 struct jsonsl_state_st *state,
-                                 const char *buf) noexcept;
+    // Thrown by JSONConverter::fail, after it records the error; caught by encodeJSON.
+    struct JSONParseError { };
 
-    JSONConverter::JSONConverter(Encoder &e) noexcept
-    :_encoder(e),
-     _jsn(jsonsl_new(50)),      // never returns nullptr, according to source code
-     _jsonError(JSONSL_ERROR_SUCCESS),
-     _errorPos(0)
-    {
-        _jsn->data = this;
-    }
+    // Decimal exponents are clamped to this; anything beyond it is already infinity or zero.
+    static const int kMaxExponent = 100000;
 
-    JSONConverter::~JSONConverter() {
-        jsonsl_destroy(_jsn);
+    // True for the characters that can end a number or literal.
+    static inline bool isDelimiter(uint8_t c) {
+        switch (c) {
+            case ' ': case '\t': case '\n': case '\r':
+            case '{': case '}': case '[': case ']': case ':': case ',': case '"':
+                return true;
+            default:
+                return false;
+        }
     }
 
+
+    // (C++11 needs these definitions if the constants are bound to references.)
+    constexpr size_t JSONConverter::kMinParallelSize;
+    constexpr size_t JSONConverter::kMaxDepth;
+    constexpr size_t JSONConverter::kMaxRunSize;
+    constexpr size_t JSONConverter::kWindowSize;
+
+
+    JSONConverter::JSONConverter(Encoder &e) noexcept
+    :_encoder(e)
+    { }
+
     void JSONConverter::reset() {
-        jsonsl_reset(_jsn);
-        _jsonError = JSONSL_ERROR_SUCCESS;
+        _jsonError = kErrNone;
+        _errorCode = NoError;
+        _errorMessage.clear();
         _errorPos = 0;
+        _inputOffset = _docSize = 0;
+        _pending.clear();
+        _state = kValue;
+        _inObject.clear();
     }
 
     const char* JSONConverter::errorMessage() noexcept {
         if (!_errorMessage.empty())
             return _errorMessage.c_str();
-        else if (_jsonError == kErrExceptionThrown)
-            return "Unexpected C++ exception";
-        else if (_jsonError == kErrTruncatedJSON)
-            return "Truncated JSON";
-        else
-            return jsonsl_strerror((jsonsl_error_t)_jsonError);
+        switch (_jsonError) {
+            case kErrNone:              return "No error";
+            case kErrSyntax:            return "Syntax error";
+            case kErrInvalidEscape:     return "Invalid escape sequence in string";
+            case kErrUEscapeTooShort:   return "Incomplete \\u escape in string";
+            case kErrBadHex:            return "Invalid hex digit in \\u escape";
+            case kErrInvalidCodepoint:  return "Invalid Unicode code point in \\u escape";
+            case kErrControlCharacter:  return "Unescaped control character in string";
+            case kErrInvalidNumber:     return "Invalid number";
+            case kErrTooDeep:           return "Arrays/objects nested too deeply";
+            case kErrTooLarge:          return "JSON data too large";
+            case kErrTruncatedJSON:     return "Truncated JSON";
+            default:                    return "Unexpected C++ exception";
+        }
     }
 
 
     bool JSONConverter::encodeJSON(slice json) {
-        _input = json;
-        _errorMessage.clear();
-        _errorCode = NoError;
-        _jsonError = JSONSL_ERROR_SUCCESS;
-        _errorPos = 0;
+        reset();
+        try {
+            parse(json, 0, true);
+            _docSize = json.size;
+        } catch (const JSONParseError&) {
+        }
+        return finish();
+    }
 
-        _jsn->data = this;
-        _jsn->action_callback_PUSH = writePushCallback;
-        _jsn->action_callback_POP  = writePopCallback;
-        _jsn->error_callback = errorCallback;
-        jsonsl_enable_all_callbacks(_jsn);
+    bool JSONConverter::feed(slice chunk) {
+        if (_state == kFinished)
+            reset();
+        if (_jsonError)
+            return false;
+        try {
+            if (!_pending.empty()) {
+                // Complete the token left over from the last chunk, and parse it by itself:
+                size_t tokenEnd = endOfToken(slice(_pending), chunk);
+                bool completed = (tokenEnd != SIZE_MAX);
+                if (!completed)
+                    tokenEnd = chunk.size;
+                _pending.append((const char*)chunk.buf, tokenEnd);
+                _docSize += tokenEnd;
+                chunk.moveStart(tokenEnd);
+                if (!completed)
+                    return true;
+                parse(slice(_pending), _docSize - _pending.size(), true);
+                _pending.clear();
+            }
+            // Parse the rest of the chunk, up to any token that's cut off at its end:
+            size_t used = parse(chunk, _docSize, false);
+            _pending.assign((const char*)chunk.buf + used, chunk.size - used);
+            _docSize += chunk.size;
+        } catch (const JSONParseError&) {
+        }
+        return (_jsonError == kErrNone);
+    }
 
-        jsonsl_feed(_jsn, (char*)json.buf, json.size);
-        if (_jsn->level > 0 && !_jsonError) {
-            // Input is valid JSON so far, but truncated:
-            _jsonError = kErrTruncatedJSON;
-            _errorPos = json.size;
+    bool JSONConverter::finish() {
+        if (_state != kFinished && _jsonError == kErrNone) {
+            try {
+                if (!_pending.empty())
+                    parse(slice(_pending), _docSize - _pending.size(), true);
+                if (!_inObject.empty())
+                    fail(kErrTruncatedJSON, _docSize);
+            } catch (const JSONParseError&) {
+            }
         }
-        jsonsl_reset(_jsn);
-        return (_jsonError == JSONSL_ERROR_SUCCESS);
+        _pending.clear();
+        _state = kFinished;
+        return (_jsonError == kErrNone);
     }
 
-    /*static*/ alloc_slice JSONConverter::convertJSON(slice json, SharedKeys *sk) {
-        Encoder enc;
-        enc.setSharedKeys(sk);
-        JSONConverter cvt(enc);
-        throwIf(!cvt.encodeJSON(slice(json)), JSONError, cvt.errorMessage());
-        return enc.extractOutput();
+    bool JSONConverter::encodeJSONParallel(slice json, unsigned maxThreads) {
+        if (maxThreads == 0)
+            maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+        std::vector<slice> runs;
+        if (maxThreads > 1 && json.size >= kMinParallelSize && !_encoder.sharedKeys())
+            runs = splitArrayItems(json, std::max((size_t)maxThreads, json.size / kMaxRunSize));
+        if (runs.size() < 2)
+            return encodeJSON(json);
+
+        // Convert the runs of items into child encoders, which writeParallel joins:
+        reset();
+        std::vector<std::unique_ptr<JSONConverter>> failed(runs.size());
+        try {
+            _encoder.beginArray();
+            _encoder.writeParallel(runs.size(), [&](Encoder &child, size_t i) {
+                std::unique_ptr<JSONConverter> cvt(new JSONConverter(child));
+                if (!cvt->encodeItems(runs[i], (const uint8_t*)runs[i].buf
+                                                    - (const uint8_t*)json.buf)) {
+                    failed[i] = std::move(cvt);
+                    throw JSONParseError();
+                }
+            }, maxThreads);
+            _encoder.endArray();
+            _docSize = json.size;
+            _state = kFinished;
+        } catch (const JSONParseError&) {
+            // Report the error in the earliest run:
+            for (auto &cvt : failed) {
+                if (cvt) {
+                    _jsonError = cvt->_jsonError;
+                    _errorCode = cvt->_errorCode;
+                    _errorMessage = cvt->_errorMessage;
+                    _errorPos = cvt->_errorPos;
+                    break;
+                }
+            }
+        } catch (const FleeceException &x) {
+            gotException(x.code, x.what(), 0);
+        } catch (const std::bad_alloc&) {
+            gotException(MemoryError, nullptr, 0);
+        }
+        return (_jsonError == kErrNone);
     }
 
-    inline void JSONConverter::push(struct jsonsl_state_st *state) {
-        switch (state->type) {
-            case JSONSL_T_LIST:
-                _encoder.beginArray();
-                break;
-            case JSONSL_T_OBJECT:
-                _encoder.beginDictionary();
-                break;
+    // Converts a run of array items separated by commas, adding them to the encoder's current
+    // array. `offset` is the run's position in the whole document, for error reporting.
+    bool JSONConverter::encodeItems(slice items, size_t offset) {
+        reset();
+        _inObject.push_back(false);             // as though the '[' had already been parsed
+        try {
+            parse(items, offset, true);
+            if (_state != kAfterValue || _inObject.size() != 1)
+                fail(kErrSyntax, offset + items.size);
+        } catch (const JSONParseError&) {
         }
+        return (_jsonError == kErrNone);
     }
 
-    inline void JSONConverter::pop(struct jsonsl_state_st *state) {
-        switch (state->type) {
-            case JSONSL_T_SPECIAL: {
-                unsigned f = state->special_flags;
-                if (f & JSONSL_SPECIALf_FLOAT) {
-                    char *start = (char*)&_input[state->pos_begin];
-                    char *end;
-                    double n = ::strtod(start, &end);
-                    _encoder.writeDouble(n);
-                } else if (f & JSONSL_SPECIALf_UNSIGNED) {
-                    _encoder.writeUInt(state->nelem);
-                } else if (f & JSONSL_SPECIALf_SIGNED) {
-                    _encoder.writeInt(-(int64_t)state->nelem);
-                } else if (f & JSONSL_SPECIALf_TRUE) {
-                    _encoder.writeBool(true);
-                } else if (f & JSONSL_SPECIALf_FALSE) {
-                    _encoder.writeBool(false);
-                } else if (f & JSONSL_SPECIALf_NULL) {
-                    _encoder.writeNull();
-                }
-                break;
+    // Parses as much of `input` as possible and returns the number of bytes consumed. If it's not
+    // `complete`, a string, number or literal at its end might continue in the next chunk, so
+    // it's left unparsed.
+    // The two stages take turns on windows of kWindowSize bytes. A token cut off at the end of a
+    // window starts the next one, the way feed() carries one over to the next chunk; if the
+    // token fills the whole window, the next window is stretched to just past its end.
+    size_t JSONConverter::parse(slice input, size_t inputOffset, bool complete) {
+        auto in = (const uint8_t*)input.buf;
+        size_t start = 0, windowSize = kWindowSize;
+        for (;;) {
+            bool last = (input.size - start <= windowSize);
+            _input = slice(in + start, last ? input.size - start : windowSize);
+            _inputOffset = inputOffset + start;
+            if (_input.size > UINT32_MAX)
+                fail(kErrTooLarge, _inputOffset);
+            size_t used;
+            try {
+                used = findStructurals(last && complete);
+            } catch (const std::bad_alloc&) {
+                gotException(MemoryError, nullptr, _inputOffset);
+                throw JSONParseError();
             }
-            case JSONSL_T_STRING:
-            case JSONSL_T_HKEY: {
-                slice str(&_input[state->pos_begin + 1],
-                          state->pos_cur - state->pos_begin - 1);
-                char *buf = nullptr;
-                bool mallocedBuf = false;
-                if (state->nescapes > 0) {
-                    // De-escape str:
-                    mallocedBuf = str.size > 100;
-                    buf = (char*)(mallocedBuf ? malloc(str.size) : alloca(str.size));
-                    jsonsl_error_t err = JSONSL_ERROR_SUCCESS;
-                    const char *errat;
-                    auto size = jsonsl_util_unescape_ex((const char*)str.buf, buf, str.size,
-                                                        nullptr, nullptr, &err, &errat);
-                    if (err) {
-                        errorCallback(_jsn, err, state, (char*)errat);
-                        if (mallocedBuf)
-                            free(buf);
-                        return;
-                    }
-                    str = slice(buf, size);
-                }
-                if (state->type == JSONSL_T_STRING)
-                    _encoder.writeString(str);
-                else
-                    _encoder.writeKey(str);
-                if (mallocedBuf)
-                    free(buf);
-                break;
+            writeValues();
+            if (last)
+                return start + used;
+            if (used > 0) {
+                windowSize = kWindowSize;
+            } else {
+                size_t tokenEnd = endOfToken(_input, slice(in + start + _input.size,
+                                                           input.size - start - _input.size));
+                windowSize = (tokenEnd == SIZE_MAX) ? SIZE_MAX : _input.size + tokenEnd + 1;
             }
-            case JSONSL_T_LIST:
-                _encoder.endArray();
-                break;
-            case JSONSL_T_OBJECT:
-                _encoder.endDictionary();
-                break;
+            start += used;
         }
     }
 
-    int JSONConverter::gotError(int err, size_t pos) noexcept {
+    // Returns the length of the prefix of `next` that completes `token`, which is either the
+    // start of a string or of a number/literal, or SIZE_MAX if it doesn't end in `next`.
+    /*static*/ size_t JSONConverter::endOfToken(slice token, slice next) {
+        auto tok = (const uint8_t*)token.buf;
+        auto in = (const uint8_t*)next.buf;
+        if (tok[0] == '"') {
+            bool escaped = false;
+            for (size_t i = token.size - 1; i > 0 && tok[i] == '\\'; --i)
+                escaped = !escaped;
+            for (size_t i = 0; i < next.size; ++i) {
+                if (escaped)
+                    escaped = false;
+                else if (in[i] == '\\')
+                    escaped = true;
+                else if (in[i] == '"')
+                    return i + 1;
+            }
+        } else {
+            for (size_t i = 0; i < next.size; ++i) {
+                if (isDelimiter(in[i]))
+                    return i;
+            }
+        }
+        return SIZE_MAX;
+    }
+
+    /*static*/ alloc_slice JSONConverter::convertJSON(slice json, SharedKeys *sk) {
+        Encoder enc;
+        enc.setSharedKeys(sk);
+        JSONConverter cvt(enc);
+        throwIf(!cvt.encodeJSON(slice(json)), JSONError, cvt.errorMessage());
+        return enc.extractOutput();
+    }
+
+    // `pos` is the position in the whole document.
+    void JSONConverter::fail(int err, size_t pos) {
         _jsonError = err;
         _errorPos = pos;
         _errorCode = JSONError;
-        jsonsl_stop(_jsn);
-        return 0;
+        throw JSONParseError();
     }
 
-    int JSONConverter::gotError(int err, const char *errat) noexcept {
-        return gotError(err, errat - (char*)_input.buf);
+    void JSONConverter::fail(int err, const uint8_t *at) {
+        fail(err, _inputOffset + (at - (const uint8_t*)_input.buf));
     }
 
     void JSONConverter::gotException(ErrorCode code, const char *what, size_t pos) noexcept {
-        gotError(kErrExceptionThrown, pos);
+        _jsonError = kErrExceptionThrown;
+        _errorPos = pos;
         _errorCode = code;
-        _errorMessage = what;
+        if (what)
+            _errorMessage = what;
     }
 
-    // Callbacks:
 
-    static inline JSONConverter* converter(jsonsl_t jsn) noexcept {
-        return (JSONConverter*)jsn->data;
+#pragma mark - STAGE 1: FINDING STRUCTURAL CHARACTERS:
+
+
+    // Bit masks of the characters of interest in a 64-byte block of input; bit i is byte i.
+    // `op` is all of the brackets, braces, colons and commas; `open` and `close` are the brackets
+    // and braces.
+    struct blockMasks {
+        uint64_t quote, backslash, whitespace, op, open, close, control;
+    };
+
+    static inline int countTrailingZeros(uint64_t n) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward64(&index, n);
+        return (int)index;
+#else
+        return __builtin_ctzll(n);
+#endif
     }
-    
-    static void writePushCallback(jsonsl_t jsn,
-                                  jsonsl_action_t action,
-                                  struct jsonsl_state_st *state,
-                                  const char *buf) noexcept
-    {
-        try {
-            converter(jsn)->push(state);
-        } catch (const FleeceException &x) {
-            converter(jsn)->gotException(x.code, x.what(), state->pos_begin);
-        } catch (...) {
-            converter(jsn)->gotException(InternalError, nullptr, state->pos_begin);
+
+    static inline int countOnes(uint64_t n) {
+#ifdef _MSC_VER
+        return (int)__popcnt64(n);
+#else
+        return __builtin_popcountll(n);
+#endif
+    }
+
+    // Sets each bit to the XOR of itself and all the bits below it. Applied to a mask of quotes,
+    // this sets the bits from each opening quote up to (not including) its closing quote.
+    static inline uint64_t prefixXor(uint64_t bits) {
+        bits ^= bits << 1;
+        bits ^= bits << 2;
+        bits ^= bits << 4;
+        bits ^= bits << 8;
+        bits ^= bits << 16;
+        bits ^= bits << 32;
+        return bits;
+    }
+
+#if defined(__AVX2__)
+
+    static inline void scanBlock(const uint8_t *block, blockMasks &m) {
+        m = {};
+        for (unsigned half = 0; half < 2; ++half) {
+            __m256i c = _mm256_loadu_si256((const __m256i*)(block + 32 * half));
+            __m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+            auto bits = [=](__m256i eq) {
+                return (uint64_t)(uint32_t)_mm256_movemask_epi8(eq) << (32 * half);
+            };
+            auto is = [=](char ch) {return _mm256_cmpeq_epi8(c, _mm256_set1_epi8(ch));};
+            m.quote |= bits(is('"'));
+            m.backslash |= bits(is('\\'));
+            m.whitespace |= bits(_mm256_or_si256(_mm256_or_si256(is(' '), is('\t')),
+                                                 _mm256_or_si256(is('\n'), is('\r'))));
+            // ('[' | 0x20) == '{' and (']' | 0x20) == '}'
+            m.open |= bits(_mm256_cmpeq_epi8(lower, _mm256_set1_epi8('{')));
+            m.close |= bits(_mm256_cmpeq_epi8(lower, _mm256_set1_epi8('}')));
+            m.op |= bits(_mm256_or_si256(is(':'), is(',')));
+            __m256i k1F = _mm256_set1_epi8(0x1F);
+            m.control |= bits(_mm256_cmpeq_epi8(_mm256_max_epu8(c, k1F), k1F));
         }
+        m.op |= m.open | m.close;
     }
 
-    static void writePopCallback(jsonsl_t jsn,
-                                 jsonsl_action_t action,
-                                 struct jsonsl_state_st *state,
-                                 const char *buf) noexcept
-    {
+#elif defined(FLEECE_JSON_SSE2)
+
+    static inline void scanBlock(const uint8_t *block, blockMasks &m) {
+        m = {};
+        for (unsigned quarter = 0; quarter < 4; ++quarter) {
+            __m128i c = _mm_loadu_si128((const __m128i*)(block + 16 * quarter));
+            __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+            auto bits = [=](__m128i eq) {
+                return (uint64_t)(uint16_t)_mm_movemask_epi8(eq) << (16 * quarter);
+            };
+            auto is = [=](char ch) {return _mm_cmpeq_epi8(c, _mm_set1_epi8(ch));};
+            m.quote |= bits(is('"'));
+            m.backslash |= bits(is('\\'));
+            m.whitespace |= bits(_mm_or_si128(_mm_or_si128(is(' '), is('\t')),
+                                              _mm_or_si128(is('\n'), is('\r'))));
+            // ('[' | 0x20) == '{' and (']' | 0x20) == '}'
+            m.open |= bits(_mm_cmpeq_epi8(lower, _mm_set1_epi8('{')));
+            m.close |= bits(_mm_cmpeq_epi8(lower, _mm_set1_epi8('}')));
+            m.op |= bits(_mm_or_si128(is(':'), is(',')));
+            __m128i k1F = _mm_set1_epi8(0x1F);
+            m.control |= bits(_mm_cmpeq_epi8(_mm_max_epu8(c, k1F), k1F));
+        }
+        m.op |= m.open | m.close;
+    }
+
+#else
+
+    static inline void scanBlock(const uint8_t *block, blockMasks &m) {
+        m = {};
+        for (unsigned i = 0; i < 64; ++i) {
+            uint64_t bit = 1ull << i;
+            switch (block[i]) {
+                case '"':   m.quote |= bit; break;
+                case '\\':  m.backslash |= bit; break;
+                case ' ': case '\t': case '\n': case '\r':
+                            m.whitespace |= bit; break;
+                case '{': case '[':
+                            m.open |= bit; break;
+                case '}': case ']':
+                            m.close |= bit; break;
+                case ':': case ',':
+                            m.op |= bit; break;
+            }
+            if (block[i] < 0x20)
+                m.control |= bit;
+        }
+        m.op |= m.open | m.close;
+    }
+
+#endif
+
+    // Finds the quotes in a block that aren't escaped by backslashes, and the bytes that are inside
+    // strings, carrying the state over from the previous block.
+    struct stringTracker {
+        uint64_t prevEscaped {0}, prevInString {0};
+
+        // Clears the escaped quotes out of m.quote, and returns the mask of bytes inside strings
+        // (including the opening quotes but not the closing ones.)
+        inline uint64_t track(blockMasks &m) {
+            // Find the characters escaped by backslashes. Backslashes are rare, so visit each:
+            uint64_t escaped = prevEscaped;
+            prevEscaped = 0;
+            uint64_t backslashes = m.backslash & ~escaped;
+            while (backslashes) {
+                uint64_t bit = backslashes & (~backslashes + 1);
+                if (bit == (1ull << 63)) {
+                    prevEscaped = 1;
+                    break;
+                }
+                escaped |= bit << 1;
+                backslashes &= ~(bit | (bit << 1));
+            }
+
+            m.quote &= ~escaped;
+            uint64_t inString = prefixXor(m.quote) ^ prevInString;
+            prevInString = (uint64_t)((int64_t)inString >> 63);
+            return inString;
+        }
+    };
+
+    // Stage 1: Fills _structurals with the offsets of every bracket, brace, colon and comma
+    // outside strings, every (unescaped) quote, and the first character of every number or
+    // literal. Also notes the first control character inside a string, which is invalid.
+    // If the input is `complete`, fails if it ends inside a string; otherwise leaves out a string,
+    // number or literal that the input ends in. Returns the length of the input indexed.
+    size_t JSONConverter::findStructurals(bool complete) {
+        auto in = (const uint8_t*)_input.buf;
+        size_t size = _input.size;
+        // A window is only larger than kWindowSize if it's stretched to hold one long token, so
+        // it has at most a few structurals; but grow the index if a block might not fit:
+        size_t capacity = std::min(size, kWindowSize) + 64;
+        if (_structuralsCapacity < capacity) {
+            _structurals.reset(new uint32_t[capacity]);
+            _structuralsCapacity = capacity;
+        }
+        uint32_t *out = _structurals.get();
+        uint32_t *outLimit = out + _structuralsCapacity - 64;
+        _firstControlChar = SIZE_MAX;
+
+        stringTracker strings;
+        uint64_t prevScalar = 0;
+        uint8_t tail[64];
+        for (size_t blockPos = 0; blockPos < size; blockPos += 64) {
+            const uint8_t *block = in + blockPos;
+            if (size - blockPos < 64) {
+                memset(tail, ' ', sizeof(tail));
+                memcpy(tail, block, size - blockPos);
+                block = tail;
+            }
+            blockMasks m;
+            scanBlock(block, m);
+            uint64_t inString = strings.track(m);
+            uint64_t quote = m.quote;
+
+            uint64_t control = m.control & inString;
+            if (_usuallyFalse(control != 0) && _firstControlChar == SIZE_MAX)
+                _firstControlChar = blockPos + countTrailingZeros(control);
+
+            uint64_t scalar = ~(m.op | m.whitespace | quote | inString);
+            uint64_t scalarStart = scalar & ~((scalar << 1) | prevScalar);
+            prevScalar = scalar >> 63;
+
+            uint64_t structurals = (m.op & ~inString) | quote | scalarStart;
+            if (_usuallyFalse(out > outLimit)) {
+                size_t count = out - _structurals.get();
+                std::unique_ptr<uint32_t[]> bigger(new uint32_t[2 * _structuralsCapacity]);
+                memcpy(bigger.get(), _structurals.get(), count * sizeof(uint32_t));
+                _structurals = std::move(bigger);
+                _structuralsCapacity *= 2;
+                out = _structurals.get() + count;
+                outLimit = _structurals.get() + _structuralsCapacity - 64;
+            }
+            while (structurals) {
+                *out++ = (uint32_t)(blockPos + countTrailingZeros(structurals));
+                structurals &= structurals - 1;
+            }
+        }
+        _nStructurals = out - _structurals.get();
+
+        // (The padding of the last block hides whether the input ends in a number or literal.)
+        bool endsInScalar = size > 0 && !isDelimiter(in[size - 1]);
+        if (strings.prevInString || endsInScalar) {
+            if (complete) {
+                // If the input ends inside a string, it's truncated, whatever else is wrong:
+                if (strings.prevInString)
+                    fail(kErrTruncatedJSON, in + size);
+            } else {
+                // The last token may continue in the next chunk; it's the last structural:
+                return _structurals[--_nStructurals];
+            }
+        }
+        return size;
+    }
+
+
+    // Divides the items of a JSON array into about `nRuns` runs of similar size, split at commas
+    // between top-level items, for encodeJSONParallel. Uses the stage 1 block scanner, but only
+    // to track the nesting depth: exactly, near the places to split, and otherwise by counting
+    // the brackets in each block. Returns no runs if the JSON isn't an array.
+    /*static*/ std::vector<slice> JSONConverter::splitArrayItems(slice json, size_t nRuns) {
+        std::vector<slice> runs;
+        auto in = (const uint8_t*)json.buf;
+        size_t start = 0, end = json.size;
+        auto isSpace = [](uint8_t c) {return c == ' ' || c == '\t' || c == '\n' || c == '\r';};
+        while (start < end && isSpace(in[start]))
+            ++start;
+        while (end > start && isSpace(in[end - 1]))
+            --end;
+        if (end - start < 2 || in[start] != '[' || in[end - 1] != ']')
+            return runs;
+        runs.reserve(nRuns);
+
+        size_t runStart = start + 1, runSize = (end - start) / nRuns;
+        size_t nextSplit = runStart + runSize;
+        stringTracker strings;
+        int64_t depth = 0;
+        uint8_t tail[64];
+        for (size_t blockPos = 0; blockPos < end; blockPos += 64) {
+            const uint8_t *block = in + blockPos;
+            if (end - blockPos < 64) {
+                memset(tail, ' ', sizeof(tail));
+                memcpy(tail, block, end - blockPos);
+                block = tail;
+            }
+            blockMasks m;
+            scanBlock(block, m);
+            uint64_t inString = strings.track(m);
+            if (blockPos + 64 <= nextSplit) {
+                depth += countOnes(m.open & ~inString) - countOnes(m.close & ~inString);
+                continue;
+            }
+            for (uint64_t ops = m.op & ~inString; ops; ops &= ops - 1) {
+                size_t pos = blockPos + countTrailingZeros(ops);
+                switch (in[pos]) {
+                    case '[': case '{':
+                        ++depth;
+                        break;
+                    case ']': case '}':
+                        --depth;
+                        break;
+                    case ',':
+                        if (depth == 1 && pos >= nextSplit) {
+                            runs.emplace_back(&in[runStart], &in[pos]);
+                            runStart = pos + 1;
+                            nextSplit = runStart + runSize;
+                        }
+                        break;
+                }
+            }
+        }
+        runs.emplace_back(&in[runStart], &in[end - 1]);
+        return runs;
+    }
+
+
+#pragma mark - STAGE 2: WRITING VALUES:
+
+
+    static inline bool isDigit(uint8_t c) {
+        return c >= '0' && c <= '9';
+    }
+
+    // Stage 2: Walks the structural characters found by stage 1, checking the JSON grammar and
+    // writing the values to the encoder. Open arrays and objects are tracked in a stack instead
+    // of by recursion, so the nesting depth isn't limited by the C stack. When the structurals
+    // run out, the state is saved in _state, to be resumed with the next chunk.
+    void JSONConverter::writeValues() {
+        auto in = (const uint8_t*)_input.buf;
+        const uint32_t *next = _structurals.get(), *end = next + _nStructurals;
+        const uint8_t *c = in;
+
+        auto string = [&](bool isKey) {
+            const uint8_t *start = c + 1;
+            if (_usuallyFalse(next == end))
+                fail(kErrTruncatedJSON, in + _input.size);
+            c = in + *next++;               // the closing quote
+            writeString(start, c, isKey);
+        };
+
+        // Advances `c` to the next structural character, or else returns, to resume at STATE:
+        #define NEXT_CHAR(STATE) \
+            if (_usuallyFalse(next == end)) {_state = STATE; return;} \
+            c = in + *next++
+
         try {
-            converter(jsn)->pop(state);
+            switch (_state) {
+                case kValue:        goto value;
+                case kValueOrEnd:   goto valueOrEnd;
+                case kKey:          goto key;
+                case kKeyOrEnd:     goto keyOrEnd;
+                case kColon:        goto colon;
+                case kAfterValue:   goto afterValue;
+                case kFinished:     return;
+            }
+
+        value:
+            NEXT_CHAR(kValue);
+        gotValue:
+            switch (*c) {
+                case '{':
+                    if (_usuallyFalse(_inObject.size() >= kMaxDepth))
+                        fail(kErrTooDeep, c);
+                    _encoder.beginDictionary();
+                    _inObject.push_back(true);
+                    goto keyOrEnd;
+                case '[':
+                    if (_usuallyFalse(_inObject.size() >= kMaxDepth))
+                        fail(kErrTooDeep, c);
+                    _encoder.beginArray();
+                    _inObject.push_back(false);
+                    goto valueOrEnd;
+                case '"':
+                    string(false);
+                    goto afterValue;
+                case '-': case '0': case '1': case '2': case '3': case '4':
+                case '5': case '6': case '7': case '8': case '9':
+                    writeNumber(c);
+                    goto afterValue;
+                case 't': case 'f': case 'n':
+                    writeLiteral(c);
+                    goto afterValue;
+                default:
+                    fail(kErrSyntax, c);
+            }
+
+        valueOrEnd:
+            NEXT_CHAR(kValueOrEnd);
+            if (*c != ']')
+                goto gotValue;
+            _encoder.endArray();
+            _inObject.pop_back();
+            goto afterValue;
+
+        keyOrEnd:
+            NEXT_CHAR(kKeyOrEnd);
+            if (*c != '}')
+                goto gotKey;
+            _encoder.endDictionary();
+            _inObject.pop_back();
+            goto afterValue;
+
+        key:
+            NEXT_CHAR(kKey);
+        gotKey:
+            if (*c != '"')
+                fail(kErrSyntax, c);
+            string(true);
+        colon:
+            NEXT_CHAR(kColon);
+            if (*c != ':')
+                fail(kErrSyntax, c);
+            goto value;
+
+        afterValue:
+            if (_inObject.empty()) {
+                if (next != end)
+                    fail(kErrSyntax, in + *next);
+                _state = kAfterValue;
+                return;
+            }
+            NEXT_CHAR(kAfterValue);
+            switch (*c) {
+                case ',':
+                    if (_inObject.back())
+                        goto key;
+                    goto value;
+                case '}':
+                    if (!_inObject.back())
+                        fail(kErrSyntax, c);
+                    _encoder.endDictionary();
+                    _inObject.pop_back();
+                    goto afterValue;
+                case ']':
+                    if (_inObject.back())
+                        fail(kErrSyntax, c);
+                    _encoder.endArray();
+                    _inObject.pop_back();
+                    goto afterValue;
+                default:
+                    fail(kErrSyntax, c);
+            }
         } catch (const FleeceException &x) {
-            converter(jsn)->gotException(x.code, x.what(), state->pos_begin);
+            gotException(x.code, x.what(), _inputOffset + (c - in));
+            throw JSONParseError();
+        } catch (const std::bad_alloc&) {
+            gotException(MemoryError, nullptr, _inputOffset + (c - in));
+            throw JSONParseError();
+        } catch (const JSONParseError&) {
+            throw;
         } catch (...) {
-            converter(jsn)->gotException(InternalError, nullptr, state->pos_begin);
+            gotException(InternalError, nullptr, _inputOffset + (c - in));
+            throw JSONParseError();
         }
+        #undef NEXT_CHAR
     }
 
-    static int errorCallback(jsonsl_t jsn,
-                             jsonsl_error_t err,
-                             struct jsonsl_state_st *state,
-                             char *errat) noexcept
+    // Copies bytes from `p` to `out` up to the next backslash or `end`, advancing both. Copies
+    // a vector at a time where it can: each vector is stored whole, but the pointers only
+    // advance up to its first backslash. The store can't overrun the output buffer, since
+    // unescaping never makes the output longer than the input.
+    static inline void copyToBackslash(const uint8_t* &p, const uint8_t *end, uint8_t* &out) {
+#if defined(__AVX2__)
+        const __m256i kBackslash = _mm256_set1_epi8('\\');
+        for (; end - p >= 32; p += 32, out += 32) {
+            __m256i c = _mm256_loadu_si256((const __m256i*)p);
+            _mm256_storeu_si256((__m256i*)out, c);
+            uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, kBackslash));
+            if (mask) {
+                int n = countTrailingZeros(mask);
+                p += n;
+                out += n;
+                return;
+            }
+        }
+#elif defined(FLEECE_JSON_SSE2)
+        const __m128i kBackslash = _mm_set1_epi8('\\');
+        for (; end - p >= 16; p += 16, out += 16) {
+            __m128i c = _mm_loadu_si128((const __m128i*)p);
+            _mm_storeu_si128((__m128i*)out, c);
+            uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(c, kBackslash));
+            if (mask) {
+                int n = countTrailingZeros(mask);
+                p += n;
+                out += n;
+                return;
+            }
+        }
+#endif
+        while (p < end && *p != '\\')
+            *out++ = *p++;
+    }
+
+    // Decodes the string between `start` and `end`, whose first backslash is at `backslash`,
+    // into `dst`, which must have room for `end - start` bytes. Returns the decoded length.
+    size_t JSONConverter::unescape(const uint8_t *start, const uint8_t *backslash,
+                                   const uint8_t *end, uint8_t *dst)
     {
-        return converter(jsn)->gotError(err, errat);
+        memcpy(dst, start, backslash - start);
+        uint8_t *out = dst + (backslash - start);
+        const uint8_t *p = backslash;
+        for (;;) {
+            copyToBackslash(p, end, out);
+            if (p == end)
+                break;
+            const uint8_t *escape = p;
+            ++p;                            // (stage 1 ensures a backslash isn't last)
+            switch (*p++) {
+                case '"':   *out++ = '"'; break;
+                case '\\':  *out++ = '\\'; break;
+                case '/':   *out++ = '/'; break;
+                case 'b':   *out++ = '\b'; break;
+                case 'f':   *out++ = '\f'; break;
+                case 'n':   *out++ = '\n'; break;
+                case 'r':   *out++ = '\r'; break;
+                case 't':   *out++ = '\t'; break;
+                case 'u': {
+                    auto hex4 = [&]() {
+                        if (end - p < 4)
+                            fail(kErrUEscapeTooShort, p);
+                        uint32_t n = 0;
+                        for (int i = 0; i < 4; ++i, ++p) {
+                            uint8_t h = *p;
+                            if (isDigit(h))
+                                h -= '0';
+                            else if ((h | 0x20) >= 'a' && (h | 0x20) <= 'f')
+                                h = (h | 0x20) - 'a' + 10;
+                            else
+                                fail(kErrBadHex, p);
+                            n = (n << 4) | h;
+                        }
+                        return n;
+                    };
+                    uint32_t cp = hex4();
+                    if (cp == 0 || (cp >= 0xDC00 && cp <= 0xDFFF))
+                        fail(kErrInvalidCodepoint, escape);
+                    if (cp >= 0xD800 && cp <= 0xDBFF) {
+                        // UTF-16 surrogate pair:
+                        if (end - p < 2 || p[0] != '\\' || p[1] != 'u')
+                            fail(kErrInvalidCodepoint, escape);
+                        p += 2;
+                        uint32_t low = hex4();
+                        if (low < 0xDC00 || low > 0xDFFF)
+                            fail(kErrInvalidCodepoint, escape);
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                    // Encode as UTF-8, which is shorter than the escape sequence:
+                    if (cp < 0x80) {
+                        *out++ = (uint8_t)cp;
+                    } else if (cp < 0x800) {
+                        *out++ = (uint8_t)(0xC0 | (cp >> 6));
+                        *out++ = (uint8_t)(0x80 | (cp & 0x3F));
+                    } else if (cp < 0x10000) {
+                        *out++ = (uint8_t)(0xE0 | (cp >> 12));
+                        *out++ = (uint8_t)(0x80 | ((cp >> 6) & 0x3F));
+                        *out++ = (uint8_t)(0x80 | (cp & 0x3F));
+                    } else {
+                        *out++ = (uint8_t)(0xF0 | (cp >> 18));
+                        *out++ = (uint8_t)(0x80 | ((cp >> 12) & 0x3F));
+                        *out++ = (uint8_t)(0x80 | ((cp >> 6) & 0x3F));
+                        *out++ = (uint8_t)(0x80 | (cp & 0x3F));
+                    }
+                    break;
+                }
+                default:
+                    fail(kErrInvalidEscape, escape);
+            }
+        }
+        return out - dst;
+    }
+
+    // Writes the string between `start` and `end`, decoding any escape sequences in it.
+    void JSONConverter::writeString(const uint8_t *start, const uint8_t *end, bool isKey) {
+        auto in = (const uint8_t*)_input.buf;
+        if (_usuallyFalse((size_t)(end - in) > _firstControlChar))
+            fail(kErrControlCharacter, in + _firstControlChar);
+
+        auto backslash = (const uint8_t*)memchr(start, '\\', end - start);
+        if (!backslash) {
+            slice str(start, end - start);
+            if (isKey)
+                _encoder.writeKey(str);
+            else
+                _encoder.writeString(str);
+        } else if (isKey) {
+            // Keys are rarely escaped, and writeKey needs the whole key, so decode it first:
+            _unescaped.resize(end - start);
+            _unescaped.resize(unescape(start, backslash, end, (uint8_t*)&_unescaped[0]));
+            _encoder.writeKey(slice(_unescaped));
+        } else {
+            // Decode the string straight into the encoder's output:
+            uint8_t *dst = _encoder.beginString(end - start);
+            _encoder.endString(unescape(start, backslash, end, dst));
+        }
+    }
+
+    void JSONConverter::writeNumber(const uint8_t *start) {
+        auto end = (const uint8_t*)_input.end();
+        const uint8_t *p = start;
+        bool negative = (*p == '-');
+        if (negative)
+            ++p;
+        if (p == end || !isDigit(*p))
+            fail(kErrInvalidNumber, start);
+
+        // Accumulate the digits into a significand with a decimal exponent. The integer part
+        // alone fits (exp10 == 0) up to UINT64_MAX; after that, digits are dropped, only
+        // scaling the exponent and noting whether anything nonzero was lost.
+        uint64_t magnitude = 0;
+        int exp10 = 0;
+        bool full = false, truncated = false, isFloat = false;
+        if (*p == '0') {
+            ++p;
+        } else {
+            for (; p < end && isDigit(*p); ++p) {
+                unsigned digit = *p - '0';
+                if (!full && magnitude <= (UINT64_MAX - digit) / 10) {
+                    magnitude = magnitude * 10 + digit;
+                } else {
+                    full = true;
+                    truncated |= (digit != 0);
+                    if (exp10 < kMaxExponent)
+                        ++exp10;
+                }
+            }
+        }
+        if (p < end && *p == '.') {
+            isFloat = true;
+            if (++p == end || !isDigit(*p))
+                fail(kErrInvalidNumber, p);
+            for (; p < end && isDigit(*p); ++p) {
+                unsigned digit = *p - '0';
+                if (!full && magnitude <= (UINT64_MAX - digit) / 10) {
+                    magnitude = magnitude * 10 + digit;
+                    --exp10;
+                } else {
+                    full = true;
+                    truncated |= (digit != 0);
+                }
+            }
+        }
+        if (p < end && (*p | 0x20) == 'e') {
+            isFloat = true;
+            bool negativeExp = false;
+            if (++p < end && (*p == '+' || *p == '-'))
+                negativeExp = (*p++ == '-');
+            if (p == end || !isDigit(*p))
+                fail(kErrInvalidNumber, p);
+            int exponent = 0;
+            for (; p < end && isDigit(*p); ++p) {
+                if (exponent < kMaxExponent)
+                    exponent = exponent * 10 + (*p - '0');
+            }
+            exp10 += negativeExp ? -exponent : exponent;
+        }
+        if (p < end && !isDelimiter(*p))
+            fail(kErrInvalidNumber, p);
+
+        if (!isFloat && !full && (!negative || magnitude <= (uint64_t)INT64_MAX + 1)) {
+            if (!negative)
+                _encoder.writeUInt(magnitude);
+            else if (magnitude == (uint64_t)INT64_MAX + 1)
+                _encoder.writeInt(INT64_MIN);
+            else
+                _encoder.writeInt(-(int64_t)magnitude);
+        } else {
+            double d;
+            if (_usuallyFalse(!DecimalToDouble(magnitude, exp10, negative, truncated, d))) {
+                // Rare hard cases (subnormals, overflow, ambiguous long significands.)
+                // The input isn't NUL-terminated, so strtod needs a copy:
+                std::string number((const char*)start, p - start);
+                d = ::strtod(number.c_str(), nullptr);
+            }
+            _encoder.writeDouble(d);
+        }
+    }
+
+    void JSONConverter::writeLiteral(const uint8_t *start) {
+        size_t avail = (const uint8_t*)_input.end() - start;
+        auto matches = [&](const char *literal, size_t len) {
+            return avail >= len && memcmp(start, literal, len) == 0
+                                && (avail == len || isDelimiter(start[len]));
+        };
+        if (matches("true", 4))
+            _encoder.writeBool(true);
+        else if (matches("false", 5))
+            _encoder.writeBool(false);
+        else if (matches("null", 4))
+            _encoder.writeNull();
+        else
+            fail(kErrSyntax, start);
     }
 
 }
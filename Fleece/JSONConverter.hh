@@ -21,63 +21,128 @@
 #include "Encoder.hh"
 #include "FleeceException.hh"
 #include "slice.hh"
+#include <memory>
+#include <string>
 #include <vector>
-#include <map>
-
-extern "C" {
-    struct jsonsl_state_st;
-    struct jsonsl_st;
-}
 
 namespace fleece {
 
-    /** Parses JSON data and writes the values in it to a Fleece encoder. */
+    /** Parses JSON data and writes the values in it to a Fleece encoder.
+        Parsing is done in two stages: the first finds the structural characters (brackets,
+        braces, colons, commas, quotes, and the starts of numbers and literals), a block of input
+        at a time, using SIMD instructions where available. The second walks that index and
+        writes the values to the Encoder. The stages alternate over windows of the input, so the
+        index's size doesn't depend on the input's. Nesting depth is limited only by kMaxDepth.
+        The JSON can be given all at once to encodeJSON(), or in pieces to feed() and finish(). */
     class JSONConverter {
     public:
         JSONConverter(Encoder&) noexcept;
-        ~JSONConverter();
 
         /** Parses JSON data and writes the values to the encoder.
             @return  True if parsing succeeded, false if the JSON is invalid. */
         bool encodeJSON(slice json);
 
-        /** See jsonsl_error_t for error codes, plus a few more defined below. */
+        /** Like encodeJSON, but if the JSON is a large array, converts its items on up to
+            `maxThreads` threads (by default, one per CPU core.) A quick first pass finds commas
+            between the array's items that divide them into runs of similar size; the runs are
+            converted into separate buffers by Encoder::writeParallel, which joins them into one
+            array. Other JSON, and arrays smaller than kMinParallelSize, are just passed to
+            encodeJSON, as they are when the encoder has shared keys (they aren't thread-safe.)
+            On error, the position reported is that of the first error in the JSON. */
+        bool encodeJSONParallel(slice json, unsigned maxThreads =0);
+
+        /** The smallest JSON that encodeJSONParallel will convert on multiple threads. */
+        static constexpr size_t kMinParallelSize = 1 << 20;
+
+        /** Parses the next piece of a JSON document that's arriving in chunks, such as from a
+            socket, and writes the values it completes to the encoder. Chunks can be split
+            anywhere; a token cut off at the end of one is carried over to the next, so the
+            chunk's memory doesn't need to outlive the call. Call finish() after the last chunk.
+            @return  False if the JSON is already known to be invalid. */
+        bool feed(slice chunk);
+
+        /** Ends a document passed to feed(), checking that it wasn't truncated. The next call
+            to feed() starts a new document.
+            @return  True if parsing succeeded, false if the JSON is invalid. */
+        bool finish();
+
+        /** Error codes returned by jsonError(). These replace the jsonsl_error_t codes it
+            returned when the converter was built on jsonsl; only kErrTruncatedJSON and
+            kErrExceptionThrown keep their old values, so code that checks for specific jsonsl
+            errors needs to switch to these. */
+        enum {
+            kErrNone = 0,
+            kErrSyntax,                 // Unexpected character
+            kErrInvalidEscape,          // Backslash followed by an unknown character
+            kErrUEscapeTooShort,        // Fewer than 4 hex digits after "\u"
+            kErrBadHex,                 // Non-hex digit after "\u"
+            kErrInvalidCodepoint,       // "\u0000", or an unpaired UTF-16 surrogate
+            kErrControlCharacter,       // Unescaped control character in a string
+            kErrInvalidNumber,          // Malformed number
+            kErrTooDeep,                // Arrays/objects nested more than kMaxDepth levels
+            kErrTooLarge,               // A single string, number or literal is larger than 4GB
+            kErrTruncatedJSON = 1000,   // Input ended in the middle of a value
+            kErrExceptionThrown         // The Encoder threw an exception
+        };
+
+        /** The maximum nesting depth of arrays and objects. */
+        static constexpr size_t kMaxDepth = 10000;
+
+        /** One of the kErr... codes above. */
         int jsonError() noexcept                {return _jsonError;}
         ErrorCode errorCode() noexcept          {return _errorCode;}
         const char* errorMessage() noexcept;
         
-        /** Byte offset in input where error occurred */
+        /** Byte offset in input where error occurred (counting from the start of the
+            document, if it was fed in chunks.) */
         size_t errorPos() noexcept              {return _errorPos;}
 
-        /** Extra error codes beyond those in jsonsl_error_t. */
-        enum {
-            kErrTruncatedJSON = 1000,
-            kErrExceptionThrown
-        };
-
         /** Resets the converter, as though you'd deleted it and constructed a new one. */
         void reset();
 
         /** Convenience method to convert JSON to Fleece data. Throws FleeceException on error. */
         static alloc_slice convertJSON(slice json, SharedKeys *sk =nullptr);
 
-    //private:
-        void push(struct jsonsl_state_st *state NONNULL);
-        void pop(struct jsonsl_state_st *state NONNULL);
-        int gotError(int err, size_t pos) noexcept;
-        int gotError(int err, const char *errat NONNULL) noexcept;
-        void gotException(ErrorCode code, const char *what NONNULL, size_t pos) noexcept;
-
     private:
-        typedef std::map<size_t, uint64_t> startToLengthMap;
+        // Where stage 2 is in the JSON grammar, saved at the end of each chunk:
+        enum parseState : uint8_t {
+            kValue, kValueOrEnd, kKey, kKeyOrEnd, kColon, kAfterValue, kFinished
+        };
+
+        static constexpr size_t kMaxRunSize = 16 << 20;    // Max size of a parallel run
+        static constexpr size_t kWindowSize = 64 << 10;    // Input indexed by stage 1 at once
+
+        bool encodeItems(slice items, size_t offset);
+        static std::vector<slice> splitArrayItems(slice json, size_t nRuns);
+        size_t parse(slice input, size_t inputOffset, bool complete);
+        static size_t endOfToken(slice token, slice next);
+        size_t findStructurals(bool complete);
+        void writeValues();
+        void writeString(const uint8_t *start NONNULL, const uint8_t *end NONNULL, bool isKey);
+        size_t unescape(const uint8_t *start NONNULL, const uint8_t *backslash NONNULL,
+                        const uint8_t *end NONNULL, uint8_t *dst NONNULL);
+        void writeNumber(const uint8_t *start NONNULL);
+        void writeLiteral(const uint8_t *start NONNULL);
+        [[noreturn]] void fail(int err, size_t pos);
+        [[noreturn]] void fail(int err, const uint8_t *at NONNULL);
+        void gotException(ErrorCode code, const char *what, size_t pos) noexcept;
 
         Encoder &_encoder;                  // encoder to write to
-        struct jsonsl_st * _jsn {nullptr};  // JSON parser
-        int _jsonError {0};                 // Parse error from jsonsl
+        int _jsonError {kErrNone};          // Parse error
         ErrorCode _errorCode {NoError};
         std::string _errorMessage;
         size_t _errorPos {0};               // Byte index where parse error occurred
         slice _input;                       // Current JSON being parsed
+        size_t _inputOffset {0};            // Position of _input in the whole document
+        size_t _docSize {0};                // Number of bytes fed so far
+        std::string _pending;               // Incomplete token carried over to the next chunk
+        parseState _state {kValue};         // Stage 2's state between chunks
+        std::vector<bool> _inObject;        // Stack of open collections; true for objects
+        std::unique_ptr<uint32_t[]> _structurals; // Offsets of structural characters in _input
+        size_t _structuralsCapacity {0};    // Allocated size of _structurals
+        size_t _nStructurals {0};           // Number of offsets in _structurals
+        size_t _firstControlChar;           // Offset of the first control character in a string
+        std::string _unescaped;             // Buffer for keys that contain escapes
     };
 
 }
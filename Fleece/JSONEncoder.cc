@@ -18,45 +18,121 @@
 
 #include "JSONEncoder.hh"
 #include "Fleece.hh"
+#include "TempArray.hh"
 #include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#if defined(__AVX2__)
+    #include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define FLEECE_JSON_SSE2
+    #include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+    #include <intrin.h>
+#endif
 
 namespace fleece {
 
+    const size_t JSONEncoder::kDefaultFlushThreshold;
+    const uint32_t JSONEncoder::kMinParallelCount;
+
+    // The most array items writeValueParallel gives a worker at once. Having more ranges than
+    // threads balances the load; capping their size bounds the memory they're buffered in.
+    static const uint32_t kMaxItemsPerRange = 1024;
+
+
+    // True for the bytes that writeString escapes.
+    static inline bool needsEscape(uint8_t ch) {
+        return ch == '"' || ch == '\\' || ch < 32 || ch == 127;
+    }
+
+    static inline int countTrailingZeros(uint32_t n) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward(&index, n);
+        return (int)index;
+#else
+        return __builtin_ctz(n);
+#endif
+    }
+
+    // Returns a pointer to the first byte in [p, end) that needs escaping, or `end`. Checks a
+    // vector at a time when it can; the last partial vector is checked a byte at a time, to
+    // avoid reading past the end of the string.
+    static inline const uint8_t* findEscape(const uint8_t *p, const uint8_t *end) {
+#if defined(__AVX2__)
+        const __m256i kQuote = _mm256_set1_epi8('"'), kBackslash = _mm256_set1_epi8('\\'),
+                      k1F = _mm256_set1_epi8(0x1F), kDel = _mm256_set1_epi8(127);
+        for (; end - p >= 32; p += 32) {
+            __m256i c = _mm256_loadu_si256((const __m256i*)p);
+            __m256i hits = _mm256_or_si256(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(c, kQuote), _mm256_cmpeq_epi8(c, kBackslash)),
+                    _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(c, k1F), k1F),
+                                    _mm256_cmpeq_epi8(c, kDel)));
+            uint32_t mask = (uint32_t)_mm256_movemask_epi8(hits);
+            if (mask)
+                return p + countTrailingZeros(mask);
+        }
+#elif defined(FLEECE_JSON_SSE2)
+        const __m128i kQuote = _mm_set1_epi8('"'), kBackslash = _mm_set1_epi8('\\'),
+                      k1F = _mm_set1_epi8(0x1F), kDel = _mm_set1_epi8(127);
+        for (; end - p >= 16; p += 16) {
+            __m128i c = _mm_loadu_si128((const __m128i*)p);
+            __m128i hits = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(c, kQuote), _mm_cmpeq_epi8(c, kBackslash)),
+                    _mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(c, k1F), k1F),
+                                 _mm_cmpeq_epi8(c, kDel)));
+            uint32_t mask = (uint32_t)_mm_movemask_epi8(hits);
+            if (mask)
+                return p + countTrailingZeros(mask);
+        }
+#endif
+        while (p < end && !needsEscape(*p))
+            ++p;
+        return p;
+    }
+
     void JSONEncoder::writeString(slice str) {
         comma();
         _out << '"';
-        auto start = (const uint8_t*)str.buf;
+        auto p = (const uint8_t*)str.buf;
         auto end = (const uint8_t*)str.end();
-        for (auto p = start; p < end; p++) {
-            uint8_t ch = *p;
-            if (ch == '"' || ch == '\\' || ch < 32 || ch == 127) {
-                // Write characters from start up to p-1:
-                _out.write({start, p});
-                start = p + 1;
-                switch (ch) {
-                    case '"':
-                    case '\\':
-                        _out << '\\';
-                        --start; // ch will be written in next pass
-                        break;
-                    case '\r':
-                        _out.write("\\r"_sl);
-                        break;
-                    case '\n':
-                        _out.write("\\n"_sl);
-                        break;
-                    case '\t':
-                        _out.write("\\t"_sl);
-                        break;
-                    default: {
-                        char buf[7];
-                        _out.write(buf, sprintf(buf, "\\u%04x", (unsigned)ch));
-                        break;
-                    }
+        for (;;) {
+            // Copy the run of characters that don't need escaping, then escape the next one:
+            auto escape = findEscape(p, end);
+            _out.write(p, escape - p);
+            if (escape == end)
+                break;
+            uint8_t ch = *escape;
+            p = escape + 1;
+            switch (ch) {
+                case '"':
+                    _out.write("\\\""_sl);
+                    break;
+                case '\\':
+                    _out.write("\\\\"_sl);
+                    break;
+                case '\r':
+                    _out.write("\\r"_sl);
+                    break;
+                case '\n':
+                    _out.write("\\n"_sl);
+                    break;
+                case '\t':
+                    _out.write("\\t"_sl);
+                    break;
+                default: {
+                    static const char kHexDigits[] = "0123456789abcdef";
+                    char buf[6] = {'\\', 'u', '0', '0', kHexDigits[ch >> 4], kHexDigits[ch & 0xF]};
+                    _out.write(buf, sizeof(buf));
+                    break;
                 }
             }
         }
-        _out.write({start, end});
         _out << '"';
     }
 
@@ -86,20 +162,44 @@ namespace fleece {
     void JSONEncoder::writeDict(const Dict *dict) {
         beginDictionary();
         if (_canonical) {
-            // In canonical mode, ensure the keys are written in sorted order:
+            // In canonical mode, ensure the keys are written in sorted order. A Fleece dict is
+            // stored sorted, with any shared (integer) keys first, so the shared keys and the
+            // string keys are each a run that's usually sorted already once decoded. Sort only
+            // the runs that need it, then merge the two while writing. (That's correct even for
+            // an unsorted dict that mixes them.) The items are buffered on the stack unless
+            // there are a lot of them.
             struct kv {
                 slice key;
                 const Value *value;
                 bool operator< (const kv &other) const {return key < other.key;}
             };
-            std::vector<kv> items;
-            items.reserve(dict->count());
-            for (auto iter = dict->begin(_sharedKeys); iter; ++iter)
-                items.push_back({iter.keyString(), iter.value()});
-            std::sort(items.begin(), items.end());
-            for (auto &item : items) {
-                writeKey(item.key);
-                writeValue(item.value);
+            uint32_t count = dict->count(), nShared = 0;
+            bool sorted = true;
+            TempArray(items, kv, count);
+            kv *item = items;
+            for (auto iter = dict->begin(_sharedKeys); iter; ++iter, ++item) {
+                *item = {iter.keyString(), iter.value()};
+                if (iter.key()->isInteger())
+                    ++nShared;
+                if (item > items && !(item[-1] < item[0]))
+                    sorted = false;
+            }
+
+            kv *shared = items, *sharedEnd = items, *strings = items, *stringsEnd = item;
+            if (!sorted) {
+                sharedEnd = strings = items + nShared;
+                if (!std::is_sorted(shared, sharedEnd))
+                    std::sort(shared, sharedEnd);
+                if (!std::is_sorted(strings, stringsEnd))
+                    std::sort(strings, stringsEnd);
+            }
+            while (shared < sharedEnd || strings < stringsEnd) {
+                if (strings == stringsEnd || (shared < sharedEnd && *shared < *strings))
+                    item = shared++;
+                else
+                    item = strings++;
+                writeKey(item->key);
+                writeValue(item->value);
             }
         } else {
             for (auto iter = dict->begin(_sharedKeys); iter; ++iter) {
@@ -168,4 +268,106 @@ namespace fleece {
         _sharedKeys = savedSK;
     }
 
+
+
+    void JSONEncoder::writeValueParallel(const Value *v, unsigned maxThreads) {
+        if (maxThreads == 0)
+            maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+        const Array *array = (v->type() == kArray) ? v->asArray() : nullptr;
+        if (!array || maxThreads < 2 || array->count() < kMinParallelCount) {
+            writeValue(v);
+            return;
+        }
+
+        const uint32_t count = array->count();
+        const uint32_t rangeSize = std::min(std::max(count / (4 * maxThreads), 1u),
+                                            kMaxItemsPerRange);
+        const size_t nRanges = (count + rangeSize - 1) / rangeSize;
+        const size_t maxInFlight = 2 * maxThreads;
+        const bool json5 = _json5, canonical = _canonical;
+        const SharedKeys *sharedKeys = _sharedKeys;
+
+        // Each worker repeatedly takes the next range and converts it into its own buffer,
+        // unless the ranges not yet written out have reached maxInFlight:
+        std::vector<alloc_slice> outputs(nRanges);
+        std::vector<std::exception_ptr> errors(nRanges);
+        std::vector<bool> done(nRanges, false);
+        size_t nStarted = 0, nWritten = 0;              // These are guarded by the mutex
+        bool stopping = false;
+        std::mutex mutex;
+        std::condition_variable rangeDone, rangeWritten;
+
+        auto runWorker = [&]() {
+            JSONEncoder child;
+            child._json5 = json5;
+            child._canonical = canonical;
+            child._sharedKeys = sharedKeys;
+            std::unique_lock<std::mutex> lock(mutex);
+            for (;;) {
+                rangeWritten.wait(lock, [&]{
+                    return stopping || nStarted == nRanges || nStarted < nWritten + maxInFlight;
+                });
+                if (stopping || nStarted == nRanges)
+                    return;
+                size_t n = nStarted++;
+                lock.unlock();
+                try {
+                    child.reset();
+                    Array::iterator iter(array);
+                    iter += (uint32_t)(n * rangeSize);
+                    for (uint32_t i = 0; i < rangeSize && iter; ++i, ++iter)
+                        child.writeValue(iter.value());
+                    outputs[n] = child.extractOutput();
+                } catch (...) {
+                    errors[n] = std::current_exception();
+                }
+                lock.lock();
+                done[n] = true;
+                rangeDone.notify_all();
+            }
+        };
+
+        std::vector<std::thread> threads;
+        auto stopWorkers = [&]() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            rangeWritten.notify_all();
+            for (auto &thread : threads)
+                thread.join();
+        };
+
+        // Meanwhile this thread writes the ranges out in order, separated by commas:
+        try {
+            size_t nThreads = std::min((size_t)maxThreads, nRanges);
+            threads.reserve(nThreads);
+            for (size_t t = 0; t < nThreads; ++t)
+                threads.emplace_back(runWorker);
+            beginArray();
+            for (size_t n = 0; n < nRanges; ++n) {
+                alloc_slice output;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    rangeDone.wait(lock, [&]{return done[n];});
+                    if (errors[n])
+                        std::rethrow_exception(errors[n]);
+                    output = std::move(outputs[n]);
+                    ++nWritten;
+                }
+                rangeWritten.notify_all();
+                if (n > 0)
+                    _out << ',';
+                _out << output;
+                if (_out.bufferedLength() >= _flushThreshold)
+                    _out.flush();
+            }
+            endArray();
+        } catch (...) {
+            stopWorkers();
+            throw;
+        }
+        stopWorkers();
+    }
+
 }
@@ -21,6 +21,7 @@
 #include "Writer.hh"
 #include "Value.hh"
 #include "FleeceException.hh"
+#include "NumConversion.hh"
 
 
 namespace fleece {
@@ -34,6 +35,32 @@ namespace fleece {
         :_out(reserveOutputSize)
         { }
 
+        /** Constructs an encoder that streams its output to a file. Output is flushed to the
+            file whenever about flushThreshold() bytes of it have built up, so memory use stays
+            bounded no matter how large the JSON is. extractOutput() flushes the rest and returns
+            null. (The file is not closed.) */
+        JSONEncoder(FILE *outputFile NONNULL)
+        :_out(outputFile)
+        ,_flushThreshold(kDefaultFlushThreshold)
+        { }
+
+        /** Constructs an encoder that streams its output to a callback, in the same manner as
+            the FILE-based constructor. */
+        JSONEncoder(Writer::OutputCallback callback)
+        :_out(callback)
+        ,_flushThreshold(kDefaultFlushThreshold)
+        { }
+
+        static const size_t kDefaultFlushThreshold = 64 * 1024;
+
+        /** The number of bytes a streaming encoder buffers before flushing them; ignored if
+            the encoder isn't streaming. */
+        size_t flushThreshold() const           {return _flushThreshold;}
+        void setFlushThreshold(size_t bytes)    {if (_out.isStreaming()) _flushThreshold = bytes;}
+
+        /** Writes any buffered output of a streaming encoder to its file or callback. */
+        void flush()                            {_out.flush();}
+
         /** In JSON5 mode, dictionary keys that are JavaScript identifiers will be unquoted. */
         void setJSON5(bool j5)                  {_json5 = j5;}
         void setCanonical(bool canonical)       {_canonical = canonical;}
@@ -55,10 +82,10 @@ namespace fleece {
         void writeNull()                        {comma(); _out << slice("null");}
         void writeBool(bool b)                  {comma(); _out.write(b ? "true"_sl : "false"_sl);}
 
-        void writeInt(int64_t i)                {writef("%lld", i);}
-        void writeUInt(uint64_t i)              {writef("%llu", i);}
-        void writeFloat(float f)                {writef("%.6g", f);}
-        void writeDouble(double d)              {writef("%.16g", d);}
+        void writeInt(int64_t i)                {writeFormatted(i, FormatInt);}
+        void writeUInt(uint64_t i)              {writeFormatted(i, FormatUInt);}
+        void writeFloat(float f)                {writeFormatted(f, FormatFloat);}
+        void writeDouble(double d)              {writeFormatted(d, FormatDouble);}
 
         void writeString(const std::string &s)  {writeString(slice(s));}
         void writeString(slice s);
@@ -67,6 +94,19 @@ namespace fleece {
                                                           _out << '"';}
         void writeValue(const Value *v, SharedKeys *sk =nullptr);
 
+        /** Writes a value like writeValue, except that the items of a large array are converted
+            on up to `maxThreads` threads (by default, one per CPU core.) The array is divided
+            into ranges of items, each converted by a worker JSONEncoder with the same settings;
+            the ranges are written out in order, so the output is identical to writeValue's.
+            No more than two ranges per thread are buffered at once, so a streaming encoder's
+            memory use stays bounded. Other values, and arrays with fewer than
+            kMinParallelCount items, are just passed to writeValue.
+            The shared keys, if any, are read on all the threads, so mustn't change meanwhile. */
+        void writeValueParallel(const Value *v, unsigned maxThreads =0);
+
+        /** The smallest array whose items writeValueParallel converts on multiple threads. */
+        static const uint32_t kMinParallelCount = 256;
+
         void writeJSON(slice json)              {comma(); _out << json;}
         void writeRaw(slice raw)                {_out << raw;}
 
@@ -111,23 +151,29 @@ namespace fleece {
         void writeDict(const Dict*);
         
         void comma() {
+            // Values are a convenient place to check whether a streaming encoder should flush;
+            // a non-streaming one has a threshold of SIZE_MAX so it never does.
+            if (_usuallyFalse(_out.bufferedLength() >= _flushThreshold))
+                _out.flush();
             if (_first)
                 _first = false;
             else
                 _out << ',';
         }
 
+        // Numbers are written in their shortest form that round-trips; see NumConversion.hh.
         template <class T>
-        void writef(const char *fmt, T t) {
+        void writeFormatted(T n, size_t (*format)(T, char*)) {
             comma();
-            char str[32];
-            _out.write(str, sprintf(str, fmt, t));
+            char str[kFormatBufferSize];
+            _out.write(str, format(n, str));
         }
 
         Writer _out;
         bool _json5 {false};
         bool _canonical {false};
         bool _first {true};
+        size_t _flushThreshold {SIZE_MAX};
         const SharedKeys *_sharedKeys {nullptr};
     };
 
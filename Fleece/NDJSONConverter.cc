@@ -0,0 +1,223 @@
+//
+// NDJSONConverter.cc
+//
+// Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "NDJSONConverter.hh"
+#include "JSONConverter.hh"
+#include "Encoder.hh"
+#include "FleeceException.hh"
+#include "varint.hh"
+#include <algorithm>
+#include <string.h>
+#include <string>
+
+namespace fleece {
+
+    // A run of complete lines of input, converted by one worker.
+    struct NDJSONConverter::batch {
+        std::string input;                  // Lines of NDJSON (the last may lack a newline)
+        std::string output;                 // Length-prefixed Fleece documents
+        uint64_t lines {0};                 // Lines converted
+        uint64_t records {0};               // Documents written to output
+        std::string error;                  // Error message, if a line couldn't be converted
+        bool done {false};                  // Set when the worker has finished
+
+        void clear() {
+            input.clear();
+            output.clear();
+            lines = records = 0;
+            error.clear();
+            done = false;
+        }
+
+        void convert(Encoder &enc, JSONConverter &cvt) {
+            output.reserve(input.size());
+            const char *line = input.data(), *end = line + input.size();
+            while (line < end) {
+                auto eol = (const char*)memchr(line, '\n', end - line);
+                if (!eol)
+                    eol = end;
+                ++lines;
+                const char *p = line;
+                while (p < eol && (*p == ' ' || *p == '\t' || *p == '\r'))
+                    ++p;
+                if (p < eol) {                      // (skip blank lines)
+                    enc.reset();
+                    if (!cvt.encodeJSON(slice(line, eol))) {
+                        error = std::string(cvt.errorMessage()) + " at column "
+                                    + std::to_string(cvt.errorPos() + 1);
+                        return;
+                    }
+                    slice doc = enc.finishInPlace();
+                    uint8_t prefix[kMaxVarintLen64];
+                    output.append((const char*)prefix, PutUVarInt(prefix, doc.size));
+                    output.append((const char*)doc.buf, doc.size);
+                    ++records;
+                }
+                line = eol + 1;
+            }
+        }
+    };
+
+
+    NDJSONConverter::NDJSONConverter(const Output &output, unsigned threads, size_t batchSize)
+    :_output(output)
+    ,_batchSize(std::max(batchSize, (size_t)1))
+    ,_filling(new batch)
+    ,_startTime(std::chrono::steady_clock::now())
+    {
+        if (threads == 0)
+            threads = std::max(std::thread::hardware_concurrency(), 1u);
+        _maxInFlight = 2 * threads;
+        try {
+            _workers.reserve(threads);
+            for (unsigned i = 0; i < threads; ++i)
+                _workers.emplace_back(&NDJSONConverter::runWorker, this);
+        } catch (...) {
+            stopWorkers();              // the destructor won't run, so don't leave them behind
+            throw;
+        }
+    }
+
+    NDJSONConverter::~NDJSONConverter() {
+        stopWorkers();
+    }
+
+    void NDJSONConverter::stopWorkers() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _workAvailable.notify_all();
+        for (auto &worker : _workers)
+            worker.join();
+    }
+
+    void NDJSONConverter::feed(slice input) {
+        _stats.inputBytes += input.size;
+        while (input.size > 0) {
+            // Fill the batch up to the first newline past its target size:
+            std::string &buf = _filling->input;
+            size_t room = (buf.size() < _batchSize) ? _batchSize - buf.size() : 0;
+            const void *eol = nullptr;
+            if (input.size > room)
+                eol = memchr(input.offset(room), '\n', input.size - room);
+            if (!eol) {
+                buf.append((const char*)input.buf, input.size);
+                return;
+            }
+            size_t n = (const uint8_t*)eol + 1 - (const uint8_t*)input.buf;
+            buf.append((const char*)input.buf, n);
+            input.moveStart(n);
+            submitBatch();
+        }
+    }
+
+    void NDJSONConverter::finish() {
+        if (!_filling->input.empty())
+            submitBatch();
+        std::unique_lock<std::mutex> lock(_mutex);
+        emitBatches(lock, 0);
+    }
+
+    // Queues the batch being filled for the workers, and emits what they've finished.
+    void NDJSONConverter::submitBatch() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _batches.push_back(std::move(_filling));
+        _workAvailable.notify_one();
+        ++_stats.batches;
+        if (_spares.empty()) {
+            _filling.reset(new batch);
+        } else {
+            _filling = std::move(_spares.back());
+            _spares.pop_back();
+        }
+        emitBatches(lock, _maxInFlight);
+    }
+
+    // Passes the output of finished batches to the callback, in input order. While more than
+    // `maxInFlight` batches are queued, waits for the oldest; this is what blocks feed() when
+    // the workers fall behind.
+    void NDJSONConverter::emitBatches(std::unique_lock<std::mutex> &lock, size_t maxInFlight) {
+        while (!_batches.empty()) {
+            batch *b = _batches.front().get();
+            if (!b->done) {
+                if (_batches.size() <= maxInFlight)
+                    return;
+                if (maxInFlight > 0)
+                    ++_stats.stalls;
+                _batchDone.wait(lock, [&]{return b->done;});
+            }
+            std::unique_ptr<batch> finished = std::move(_batches.front());
+            _batches.pop_front();
+            --_nStarted;
+            lock.unlock();
+
+            if (!b->error.empty()) {
+                std::string message = b->error + " of line "
+                                        + std::to_string(_stats.lines + b->lines);
+                FleeceException::_throw(JSONError, message.c_str());
+            }
+            _stats.lines += b->lines;
+            _stats.records += b->records;
+            _stats.outputBytes += b->output.size();
+            _stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()
+                                                           - _startTime).count();
+            if (!b->output.empty())
+                _output(slice(b->output));
+
+            b->clear();
+            lock.lock();
+            _spares.push_back(std::move(finished));
+        }
+    }
+
+    void NDJSONConverter::runWorker() {
+        Encoder enc;
+        JSONConverter cvt(enc);
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (;;) {
+            _workAvailable.wait(lock, [&]{return _stopping || _nStarted < _batches.size();});
+            if (_stopping)
+                return;
+            batch *b = _batches[_nStarted++].get();
+            lock.unlock();
+            try {
+                b->convert(enc, cvt);
+            } catch (const std::exception &x) {
+                b->error = x.what();
+            } catch (...) {
+                b->error = "unexpected exception";
+            }
+            lock.lock();
+            b->done = true;
+            _batchDone.notify_all();
+        }
+    }
+
+    /*static*/ slice NDJSONConverter::nextDocument(slice &output) {
+        if (output.size == 0)
+            return nullslice;
+        uint64_t size;
+        throwIf(!ReadUVarInt(&output, &size) || size > output.size,
+                InvalidData, "invalid length prefix in NDJSON converter output");
+        slice doc(output.buf, (size_t)size);
+        output.moveStart((ptrdiff_t)size);
+        return doc;
+    }
+
+}
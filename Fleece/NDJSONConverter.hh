@@ -0,0 +1,111 @@
+//
+// NDJSONConverter.hh
+//
+// Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+
+#include "slice.hh"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fleece {
+
+    /** Throughput counters of an NDJSONConverter. */
+    struct NDJSONStats {
+        uint64_t records {0};               // JSON documents converted
+        uint64_t lines {0};                 // Lines read, including blank ones
+        uint64_t inputBytes {0};            // Bytes of NDJSON fed in
+        uint64_t outputBytes {0};           // Bytes of output, including the length prefixes
+        uint64_t batches {0};               // Batches of lines handed to the workers
+        uint64_t stalls {0};                // Times feed() waited for the workers to catch up
+        double seconds {0};                 // Time since the converter was created
+    };
+
+
+    /** Converts newline-delimited JSON (one JSON document per line) to Fleece, on a pool of
+        worker threads. Input given to feed() is split at newlines into batches of lines; each
+        worker converts a batch at a time, with its own reusable Encoder and JSONConverter.
+        The output is the Fleece documents in the order of the input lines, each preceded by its
+        length as a varint; nextDocument() reads it back. Blank lines are skipped.
+        The output callback is called only on the thread calling feed() or finish(). If the
+        workers fall behind, feed() blocks until they catch up, so memory use is bounded by
+        the batch size times the number of batches in flight.
+        Shared keys aren't supported, since they aren't thread-safe. */
+    class NDJSONConverter {
+    public:
+        /** Receives consecutive length-prefixed Fleece documents. */
+        typedef std::function<void(slice output)> Output;
+
+        static const size_t kDefaultBatchSize = 256 * 1024;
+
+        /** Starts the worker threads; by default, one per CPU core. Each batch of lines given
+            to a worker is about `batchSize` bytes long (more if a single line is longer.) */
+        NDJSONConverter(const Output &output,
+                        unsigned threads =0,
+                        size_t batchSize =kDefaultBatchSize);
+
+        /** Stops the worker threads, discarding any output not yet passed to the callback. */
+        ~NDJSONConverter();
+
+        /** Adds NDJSON input, which can be split anywhere (even mid-line), and passes any
+            output that's ready to the callback.
+            Throws a FleeceException if a line already converted is invalid JSON; the exception
+            message gives the line and column numbers. The converter can't be used after that. */
+        void feed(slice input);
+
+        /** Converts any remaining input (including a last line without a newline), waits for
+            the workers, and passes the rest of the output to the callback. Throws like feed(). */
+        void finish();
+
+        /** Counts of what has been done, as of the last output passed to the callback. */
+        const NDJSONStats& stats() const        {return _stats;}
+
+        /** Reads the next document from the output, advancing `output` past it. Returns
+            nullslice at the end of the output; throws if the length prefix is invalid. */
+        static slice nextDocument(slice &output);
+
+    private:
+        struct batch;
+
+        void submitBatch();
+        void emitBatches(std::unique_lock<std::mutex>&, size_t maxInFlight);
+        void runWorker();
+        void stopWorkers();
+
+        Output _output;                                 // Callback that receives the output
+        size_t _batchSize;                              // Input bytes per batch
+        size_t _maxInFlight;                            // Batches queued before feed() blocks
+        std::unique_ptr<batch> _filling;                // Batch that feed() is filling
+        NDJSONStats _stats;
+        std::chrono::steady_clock::time_point _startTime;
+        std::vector<std::thread> _workers;
+        std::mutex _mutex;                              // Guards the members below it
+        std::condition_variable _workAvailable;         // Signaled when a batch is queued
+        std::condition_variable _batchDone;             // Signaled when a worker finishes one
+        std::deque<std::unique_ptr<batch>> _batches;    // Queued batches, in input order
+        size_t _nStarted {0};                           // Number of _batches taken by workers
+        std::vector<std::unique_ptr<batch>> _spares;    // Emitted batches, for reuse
+        bool _stopping {false};                         // Tells the workers to exit
+    };
+
+}
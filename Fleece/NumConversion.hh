@@ -0,0 +1,55 @@
+//
+// NumConversion.hh
+//
+// Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace fleece {
+
+    /** Computes the double nearest to `significand` × 10^`exp10` (negated if `negative`),
+        rounding ties to even, without going through a string or the C library.
+        If `truncated` is true, `significand` was cut short of nonzero digits, i.e. the exact
+        value lies strictly between `significand` and `significand + 1` (× 10^`exp10`).
+        Returns false, leaving `result` unchanged, in the rare cases where the result can't be
+        determined this way (a truncated significand too close to a rounding boundary, or a
+        result that's subnormal or overflows); the caller should then fall back to strtod.
+        Uses the Clinger fast path when it's exact, otherwise the Eisel-Lemire algorithm. */
+    bool DecimalToDouble(uint64_t significand, int exp10, bool negative, bool truncated,
+                         double &result);
+
+
+    /** The size of buffer the Format functions below need; none of them writes more. */
+    static const size_t kFormatBufferSize = 32;
+
+    /** Writes the decimal form of an integer to `buf`, returning the number of characters
+        written. (Like the functions below, it doesn't add a NUL terminator.) */
+    size_t FormatInt(int64_t n, char *buf);
+    size_t FormatUInt(uint64_t n, char *buf);
+
+    /** Writes the shortest decimal form of a number that parses back to exactly that number
+        (the closest one, if there's a choice), using the Ryu algorithm. The layout is like
+        printf's "%g": positional for decimal exponents from -4 to 15, otherwise exponential,
+        e.g. "0.1", "123.456", "1e-05", "6.02e+23". Infinities and NaN are written like printf
+        does, as "inf", "-inf" and "nan", though they aren't valid JSON. Returns the number of
+        characters written. */
+    size_t FormatDouble(double d, char *buf);
+    size_t FormatFloat(float f, char *buf);
+
+}
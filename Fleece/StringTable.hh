@@ -42,6 +42,9 @@ namespace fleece {
 
         slot& find(slice key) const noexcept        {return find(key, key.hash());}
 
+        /** Finds the slot for a key whose hash (as computed by slice::hash) is already known. */
+        slot& find(slice key, uint32_t hash) const noexcept;
+
         void add(slice, const info&);
 
         void addAt(slot&, slice key, const info&) noexcept;
@@ -66,7 +69,6 @@ namespace fleece {
 
     private:
         void allocTable(size_t size);
-        slot& find(fleece::slice key, uint32_t hash) const noexcept;
         bool _add(slice, uint32_t h, const info&) noexcept;
         void incCount()                             {if (++_count > _maxCount) grow();}
         void grow();
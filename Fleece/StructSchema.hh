@@ -0,0 +1,237 @@
+//
+// StructSchema.hh
+//
+// Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "Encoder.hh"
+#include "Dict.hh"
+#include "SharedKeys.hh"
+#include "TempArray.hh"
+#include <algorithm>
+#include <initializer_list>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+/*  Typed encoding and decoding of C++ structs. A struct declares its fields once, after its
+    declaration and in the same namespace:
+
+        struct Person {
+            std::string name;
+            int age;
+            std::vector<std::string> tags;
+        };
+        FLEECE_STRUCT(Person,
+                      FLEECE_FIELD(Person, name),
+                      FLEECE_FIELD(Person, age),
+                      FLEECE_FIELD_NAMED(Person, tags, "labels"))
+
+    Then `fleece::encodeStruct(enc, person)` writes it as a dict, and
+    `fleece::decodeStruct(value, person)` reads it back.
+
+    The schema sorts the keys and hashes them once, the first time it's used. After that,
+    encoding writes the keys in order with beginSortedDictionary and pre-hashed writeKey calls,
+    so the encoder never sorts or hashes them; decoding looks up all the keys at once with
+    Dict's multi-key get.
+
+    Supported field types are bool, integers, float, double, std::string, std::vector of a
+    supported type, and other structs declared with FLEECE_STRUCT. */
+
+#define FLEECE_STRUCT(STRUCT, ...) \
+    inline const ::fleece::StructSchema<STRUCT>& fleeceStructSchema(const STRUCT*) { \
+        static const ::fleece::StructSchema<STRUCT> sSchema {__VA_ARGS__}; \
+        return sSchema; \
+    }
+
+#define FLEECE_FIELD(STRUCT, MEMBER) \
+    FLEECE_FIELD_NAMED(STRUCT, MEMBER, #MEMBER)
+
+#define FLEECE_FIELD_NAMED(STRUCT, MEMBER, KEY) \
+    ::fleece::StructField<STRUCT>::make<decltype(STRUCT::MEMBER), &STRUCT::MEMBER>(KEY)
+
+
+namespace fleece {
+
+    template <class S> class StructSchema;
+
+    /** Returns the schema of a struct declared with FLEECE_STRUCT. */
+    template <class S>
+    const StructSchema<S>& structSchema() {
+        return fleeceStructSchema((const S*)nullptr);       // found by argument-dependent lookup
+    }
+
+
+    //////// Encoding field values:
+
+    inline void encodeField(Encoder &enc, bool b)               {enc.writeBool(b);}
+    inline void encodeField(Encoder &enc, float f)              {enc.writeFloat(f);}
+    inline void encodeField(Encoder &enc, double d)             {enc.writeDouble(d);}
+    inline void encodeField(Encoder &enc, const std::string &s) {enc.writeString(s);}
+
+    template <class T>
+    typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type
+    encodeField(Encoder &enc, T i)                              {enc.writeInt(i);}
+
+    template <class T>
+    typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value>::type
+    encodeField(Encoder &enc, T i)                              {enc.writeUInt(i);}
+
+    template <class T>
+    void encodeField(Encoder &enc, const std::vector<T> &items) {
+        enc.beginArray(items.size());
+        for (auto &item : items)
+            encodeField(enc, item);
+        enc.endArray();
+    }
+
+    template <class T>
+    typename std::enable_if<std::is_class<T>::value>::type
+    encodeField(Encoder &enc, const T &s)                       {structSchema<T>().encode(enc, s);}
+
+
+    //////// Decoding field values:
+
+    inline void decodeField(const Value *v, bool &b)            {b = v->asBool();}
+    inline void decodeField(const Value *v, float &f)           {f = v->asFloat();}
+    inline void decodeField(const Value *v, double &d)          {d = v->asDouble();}
+    inline void decodeField(const Value *v, std::string &s)     {s = (std::string)v->asString();}
+
+    template <class T>
+    typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type
+    decodeField(const Value *v, T &i)                           {i = (T)v->asInt();}
+
+    template <class T>
+    typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value>::type
+    decodeField(const Value *v, T &i)                           {i = (T)v->asUnsigned();}
+
+    template <class T>
+    void decodeField(const Value *v, std::vector<T> &items) {
+        items.clear();
+        const Array *array = v->asArray();
+        if (!array)
+            return;
+        items.resize(array->count());
+        size_t i = 0;
+        for (Array::iterator iter(array); iter; ++iter)
+            decodeField(iter.value(), items[i++]);
+    }
+
+    template <class T>
+    typename std::enable_if<std::is_class<T>::value>::type
+    decodeField(const Value *v, T &s)                           {structSchema<T>().decode(v, s);}
+
+
+    //////// Schema:
+
+    /** Describes one field of struct S: its key, and functions that encode and decode it. */
+    template <class S>
+    struct StructField {
+        slice key;
+        uint32_t keyHash;
+        void (*encode)(Encoder&, const S&);
+        void (*decode)(const Value*, S&);
+
+        template <class T, T S::*MEMBER>
+        static StructField make(const char *key) {
+            slice keySlice(key);
+            return {keySlice, keySlice.hash(), &encodeMember<T, MEMBER>, &decodeMember<T, MEMBER>};
+        }
+
+    private:
+        template <class T, T S::*MEMBER>
+        static void encodeMember(Encoder &enc, const S &s)      {encodeField(enc, s.*MEMBER);}
+
+        template <class T, T S::*MEMBER>
+        static void decodeMember(const Value *v, S &s)          {decodeField(v, s.*MEMBER);}
+    };
+
+
+    /** The fields of struct S, sorted by key. Created by the FLEECE_STRUCT macro. */
+    template <class S>
+    class StructSchema {
+    public:
+        StructSchema(std::initializer_list<StructField<S>> fields)
+        :_fields(fields)
+        {
+            std::sort(_fields.begin(), _fields.end(),
+                      [](const StructField<S> &a, const StructField<S> &b) {
+                          return a.key.compare(b.key) < 0;
+                      });
+            _keys.reserve(_fields.size());
+            for (auto &field : _fields)
+                _keys.emplace_back(field.key);
+        }
+
+        size_t count() const                                    {return _fields.size();}
+
+        /** Writes a struct to an Encoder, as a dictionary. */
+        void encode(Encoder &enc, const S &s) const {
+            enc.beginSortedDictionary(_fields.size());
+            for (auto &field : _fields) {
+                enc.writeKey(field.key, field.keyHash);
+                field.encode(enc, s);
+            }
+            enc.endDictionary();
+        }
+
+        /** Reads a struct from a dictionary. Fields whose keys are missing are left unchanged.
+            Returns false if the value isn't a dictionary.
+            If the dict was encoded with shared keys, pass the SharedKeys object. */
+        bool decode(const Value *v, S &s, SharedKeys *sk =nullptr) const {
+            const Dict *dict = v ? v->asDict() : nullptr;
+            if (!dict)
+                return false;
+            size_t n = _fields.size();
+            if (sk) {
+                for (size_t i = 0; i < n; i++) {
+                    const Value *value = dict->get(_fields[i].key, sk);
+                    if (value)
+                        _fields[i].decode(value, s);
+                }
+                return true;
+            }
+            // Dict::get(key[]) updates the keys' lookup hints, so it gets its own copy of them:
+            TempArray(keyBuf, char, n * sizeof(Dict::key));
+            auto keys = (Dict::key*)(char*)keyBuf;
+            memcpy((void*)keys, _keys.data(), n * sizeof(Dict::key));
+            TempArray(values, const Value*, n);
+            dict->get(keys, values, n);
+            for (size_t i = 0; i < n; i++) {
+                if (values[i])
+                    _fields[i].decode(values[i], s);
+            }
+            return true;
+        }
+
+    private:
+        std::vector<StructField<S>> _fields;
+        std::vector<Dict::key> _keys;
+    };
+
+
+    /** Writes a struct declared with FLEECE_STRUCT to an Encoder, as a dictionary. */
+    template <class S>
+    void encodeStruct(Encoder &enc, const S &s)                 {structSchema<S>().encode(enc, s);}
+
+    /** Reads a struct declared with FLEECE_STRUCT from a dictionary. Returns false if the value
+        isn't a dictionary. */
+    template <class S>
+    bool decodeStruct(const Value *v, S &s, SharedKeys *sk =nullptr) {
+        return structSchema<S>().decode(v, s, sk);
+    }
+
+}
@@ -24,6 +24,7 @@
 #include "varint.hh"
 #include "PlatformCompat.hh"
 #include "JSONEncoder.hh"
+#include "NumConversion.hh"
 #include <assert.h>
 #include <math.h>
 
@@ -150,45 +151,41 @@ namespace fleece {
     }
 
     alloc_slice Value::toString() const {
-        char buf[32], *str = buf;
+        char buf[kFormatBufferSize];
+        size_t length;
         switch (tag()) {
             case kShortIntTag:
             case kIntTag: {
                 int64_t i = asInt();
                 if (isUnsigned())
-                    sprintf(str, "%llu", (unsigned long long)i);
+                    length = FormatUInt((uint64_t)i, buf);
                 else
-                    sprintf(str, "%lld", (long long)i);
+                    length = FormatInt(i, buf);
                 break;
             }
             case kSpecialTag: {
                 switch (tinyValue()) {
                     case kSpecialValueNull:
-                        str = (char*)"null";
-                        break;
+                        return alloc_slice("null");
                     case kSpecialValueFalse:
-                        str = (char*)"false";
-                        break;
+                        return alloc_slice("false");
                     case kSpecialValueTrue:
-                        str = (char*)"true";
-                        break;
+                        return alloc_slice("true");
                     default:
-                        str = (char*)"{?special?}";
-                        break;
+                        return alloc_slice("{?special?}");
                 }
-                break;
             }
             case kFloatTag: {
                 if (_byte[0] & 0x8)
-                    sprintf(str, "%.16g", asDouble());
+                    length = FormatDouble(asDouble(), buf);
                 else
-                    sprintf(str, "%.6g", asFloat());
+                    length = FormatFloat(asFloat(), buf);
                 break;
             }
             default:
                 return alloc_slice(asString());
         }
-        return alloc_slice(str);
+        return alloc_slice(buf, length);
     }
 
     slice Value::asString() const noexcept {
@@ -224,9 +221,25 @@ namespace fleece {
     }
 
 
+    template <int VER>
+    alloc_slice Value::toJSONParallel(const SharedKeys *sk, bool canonical,
+                                      unsigned maxThreads) const
+    {
+        JSONEncoder encoder;
+        encoder.setSharedKeys(sk);
+        if (VER >= 5)
+            encoder.setJSON5(true);
+        encoder.setCanonical(canonical);
+        encoder.writeValueParallel(this, maxThreads);
+        return encoder.extractOutput();
+    }
+
+
     // Explicitly instantiate both needed versions of the templates:
     template alloc_slice Value::toJSON<1>(const SharedKeys *sk, bool canonical) const;
     template alloc_slice Value::toJSON<5>(const SharedKeys *sk, bool canonical) const;
+    template alloc_slice Value::toJSONParallel<1>(const SharedKeys*, bool, unsigned) const;
+    template alloc_slice Value::toJSONParallel<5>(const SharedKeys*, bool, unsigned) const;
 
 
     std::string Value::toJSONString() const {
@@ -129,6 +129,12 @@ namespace fleece {
         template <int VER =1>
         alloc_slice toJSON(const SharedKeys* =nullptr, bool canonical =false) const;
 
+        /** Returns the same JSON as toJSON, but if this is a large array, its items are
+            converted on multiple threads; see JSONEncoder::writeValueParallel. */
+        template <int VER =1>
+        alloc_slice toJSONParallel(const SharedKeys* =nullptr, bool canonical =false,
+                                   unsigned maxThreads =0) const;
+
         /** Returns a JSON string representation of a Value. */
         std::string toJSONString() const;
 
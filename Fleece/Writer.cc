@@ -17,15 +17,24 @@
 //
 
 #include "Writer.hh"
+#include "FleeceException.hh"
 #include "PlatformCompat.hh"
 #include "decode.h"
 #include "encode.h"
 #include <assert.h>
 #include <algorithm>
 
+#ifndef _MSC_VER
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 
 namespace fleece {
 
+    const size_t Writer::kMaxRetainedChunkSize;
+
     Writer::Writer(size_t initialCapacity)
     :_chunkSize(initialCapacity),
      _length(0)
@@ -36,21 +45,96 @@ namespace fleece {
             addChunk(initialCapacity);
     }
 
-    Writer::Writer(Writer&& w) noexcept
-    :_chunks(std::move(w._chunks))
+    Writer::Writer(FILE *outputFile)
+    :Writer()
     {
-        w._chunks.clear();
+        _outputFile = outputFile;
+    }
+
+    Writer::Writer(OutputCallback callback)
+    :Writer()
+    {
+        _outputCallback = callback;
+    }
+
+    Writer::Writer(slice outputBuffer)
+    :_chunkSize(outputBuffer.size),
+     _length(0),
+     _fixedCapacity(true)
+    {
+        _chunks.emplace_back((void*)outputBuffer.buf, outputBuffer.size);
+    }
+
+#ifndef _MSC_VER
+    Writer::Writer(const char *mappedFilePath, size_t maxLength)
+    :_chunkSize(0),
+     _length(0)
+    {
+        size_t pageSize = ::sysconf(_SC_PAGESIZE);
+        _maxMappedLength = (maxLength + pageSize - 1) / pageSize * pageSize;
+        _fd = ::open(mappedFilePath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (_fd < 0)
+            FleeceException::_throwErrno("Writer can't open output file");
+        // Reserve the address space up front, so the mapping can always grow in place:
+        void *mapping = ::mmap(nullptr, _maxMappedLength, PROT_NONE, MAP_PRIVATE | MAP_ANON,
+                               -1, 0);
+        if (mapping == MAP_FAILED) {
+            ::close(_fd);
+            FleeceException::_throwErrno("Writer can't reserve address space");
+        }
+        _chunks.emplace_back(mapping, 0);
+    }
+#endif
+
+    Writer::Writer(Writer&& w) noexcept {
+        moveFrom(w);
     }
 
     Writer::~Writer() {
+        closeMappedFile();
         for (auto &chunk : _chunks)
             freeChunk(chunk);
     }
 
     Writer& Writer::operator= (Writer&& w) noexcept {
+        if (&w != this) {
+            closeMappedFile();
+            for (auto &chunk : _chunks)
+                freeChunk(chunk);
+            moveFrom(w);
+        }
+        return *this;
+    }
+
+    // Takes over w's output and its target (file, callback, buffer or mapping.) w is left with
+    // neither; it can only be destroyed, assigned to or reset.
+    void Writer::moveFrom(Writer &w) noexcept {
         _chunks = std::move(w._chunks);
+        _chunkSize = w._chunkSize;
+        _length = w._length;
+        _flushedLength = w._flushedLength;
+        _outputFile = w._outputFile;
+        _outputCallback = std::move(w._outputCallback);
+        _fixedCapacity = w._fixedCapacity;
+        _fd = w._fd;
+        _mappedLength = w._mappedLength;
+        _maxMappedLength = w._maxMappedLength;
+        // A chunk in w's inline buffer has to move into this one's:
+        for (auto &chunk : _chunks) {
+            if (chunk.start() == w._initialBuf) {
+                memcpy(_initialBuf, w._initialBuf, chunk.length());
+                chunk.relocate(_initialBuf);
+            }
+        }
+
         w._chunks.clear();
-        return *this;
+        w._chunkSize = kDefaultInitialCapacity;
+        w._length = w._flushedLength = 0;
+        w._outputFile = nullptr;
+        w._outputCallback = nullptr;
+        w._fixedCapacity = false;
+        w._fd = -1;
+        w._mappedLength = w._maxMappedLength = 0;
     }
 
     void Writer::reset() {
@@ -59,13 +143,25 @@ namespace fleece {
             addChunk(_chunkSize);
         } else {
             if (size > 1) {
+                // Next time, allocate a chunk big enough for this much data at once, within
+                // reason:
+                _chunkSize = std::max(_chunkSize,
+                                      std::min(bufferedLength(), kMaxRetainedChunkSize));
                 for (size_t i = 0; i < size-1; i++)
                     freeChunk(_chunks[i]);
                 _chunks.erase(_chunks.begin(), _chunks.end() - 1);
             }
+            if (_chunks[0].isHeap()
+                    && _chunks[0].capacity() > std::max(_chunkSize, kMaxRetainedChunkSize)) {
+                // Don't hang onto a huge chunk left by one unusually large document:
+                freeChunk(_chunks[0]);
+                _chunks.clear();
+                addChunk(_chunkSize);
+            }
             _chunks[0].reset();
         }
         _length = 0;
+        _flushedLength = 0;
     }
 
     const void* Writer::curPos() const {
@@ -73,7 +169,7 @@ namespace fleece {
     }
 
     size_t Writer::posToOffset(const void *pos) const {
-        size_t offset = 0;
+        size_t offset = _flushedLength;
         for (auto &chunk : _chunks) {
             if (chunk.contains(pos))
                 return offset + chunk.offsetOf(pos);
@@ -99,6 +195,12 @@ namespace fleece {
     }
 
     const void* Writer::writeToNewChunk(const void* data, size_t length) {
+        if (_usuallyFalse(_fixedCapacity)) {
+            FleeceException::_throw(MemoryError, "Writer's output buffer is full");
+        } else if (_usuallyFalse(isMappedFile())) {
+            growMappedFile(_chunks[0].length() + length);
+            return _chunks[0].write(data, length);
+        }
         if (_usuallyTrue(_chunkSize <= 64*1024))
             _chunkSize *= 2;
         addChunk(std::max(length, _chunkSize));
@@ -107,6 +209,12 @@ namespace fleece {
         return result;
     }
 
+    void Writer::retract(size_t length) {
+        assert(length <= _chunks.back().length());
+        _chunks.back().retract(length);
+        _length -= length;
+    }
+
     void Writer::rewrite(const void *pos, slice data) {
         assert(pos); //FIX: Check that it's actually inside a chunk
         ::memcpy((void*)pos, data.buf, data.size);
@@ -117,8 +225,49 @@ namespace fleece {
     }
 
     void Writer::freeChunk(Chunk &chunk) {
-        if (chunk.start() != &_initialBuf)
-            chunk.free();
+        chunk.free();
+    }
+
+
+#pragma mark - MEMORY-MAPPED FILE:
+
+    // Extends the mapped file so it can hold at least `minCapacity` bytes. The new pages are
+    // mapped right after the existing ones, inside the reserved address range, so that pointers
+    // to already-written data stay valid.
+    void Writer::growMappedFile(size_t minCapacity) {
+#ifdef _MSC_VER
+        FleeceException::_throw(InternalError, "Memory-mapped output is unsupported");
+#else
+        Chunk &chunk = _chunks[0];
+        size_t pageSize = ::sysconf(_SC_PAGESIZE);
+        size_t capacity = std::max(minCapacity, std::max(2 * chunk.capacity(), 16 * pageSize));
+        capacity = std::min((capacity + pageSize - 1) / pageSize * pageSize, _maxMappedLength);
+        if (capacity < minCapacity)
+            FleeceException::_throw(MemoryError, "Writer's memory-mapped output is full");
+        if (::ftruncate(_fd, capacity) < 0)
+            FleeceException::_throwErrno("Writer can't extend output file");
+        if (capacity > _mappedLength) {
+            void *addr = offsetby(chunk.start(), _mappedLength);
+            if (::mmap(addr, capacity - _mappedLength, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_FIXED, _fd, _mappedLength) == MAP_FAILED)
+                FleeceException::_throwErrno("Writer can't map output file");
+            _mappedLength = capacity;
+        }
+        chunk.grow(capacity);
+#endif
+    }
+
+    void Writer::closeMappedFile() noexcept {
+#ifndef _MSC_VER
+        if (!isMappedFile())
+            return;
+        if (!_chunks.empty())
+            ::munmap(_chunks[0].start(), _maxMappedLength);
+        (void)::ftruncate(_fd, _length);
+        ::close(_fd);
+        _fd = -1;
+        _chunks.clear();
+#endif
     }
 
     std::vector<slice> Writer::output() const {
@@ -129,17 +278,49 @@ namespace fleece {
         return result;
     }
 
+    void Writer::flush() {
+#ifndef _MSC_VER
+        if (isMappedFile()) {
+            // Trim the file; the next write will extend it again. The mapping stays in place.
+            if (::ftruncate(_fd, _length) < 0)
+                FleeceException::_throwErrno("Writer can't truncate output file");
+            _chunks[0].grow(_length);
+            return;
+        }
+#endif
+        if (!isStreaming() || bufferedLength() == 0)
+            return;
+        for (auto &chunk : _chunks) {
+            slice contents = chunk.contents();
+            if (contents.size == 0)
+                continue;
+            if (_outputFile) {
+                if (fwrite(contents.buf, 1, contents.size, _outputFile) < contents.size)
+                    FleeceException::_throwErrno("Writer can't write to file");
+            } else {
+                _outputCallback(contents);
+            }
+        }
+        // Keep the last chunk around for reuse, like reset() does:
+        size_t length = _length;
+        reset();
+        _length = _flushedLength = length;
+    }
+
     alloc_slice Writer::extractOutput() {
         alloc_slice output;
-#if 0 //TODO: Restore this optimization
-        if (_chunks.size() == 1 && _chunks[0].start() != &_initialBuf) {
-            _chunks[0].resizeToFit();
-            output = alloc_slice::adopt(_chunks[0].contents());
+        if (isStreaming() || isMappedFile()) {
+            flush();
+            return output;
+        }
+        if (_chunks.size() == 1 && _chunks[0].isHeap()) {
+            // Hand over the buffer itself, and go back to using the inline buffer:
+            output = _chunks[0].extractContents();
             _chunks.clear();
+            _chunks.emplace_back(_initialBuf, sizeof(_initialBuf));
             _length = 0;
-        } else
-#endif
-        {
+            _flushedLength = 0;
+        } else {
             output = alloc_slice(length());
             void* dst = (void*)output.buf;
             for (auto &chunk : _chunks) {
@@ -152,6 +333,19 @@ namespace fleece {
         return output;
     }
 
+    slice Writer::contiguousOutput() {
+        if (_chunks.size() > 1) {
+            Chunk whole(bufferedLength());
+            for (auto &chunk : _chunks) {
+                whole.write(chunk.contents().buf, chunk.length());
+                freeChunk(chunk);
+            }
+            _chunks.clear();
+            _chunks.push_back(std::move(whole));
+        }
+        return _chunks[0].contents();
+    }
+
 
 #pragma mark - CHUNK:
 
@@ -160,22 +354,23 @@ namespace fleece {
      _available(buf, size)
     { }
 
+    // Heap chunks are allocated as alloc_slices, so extractOutput can hand one over as-is.
     Writer::Chunk::Chunk(size_t capacity)
-    :_start(::malloc(capacity)),
-    _available(_start, capacity)
-    {
-        if (_usuallyFalse(!_start))
-            throw std::bad_alloc();
-    }
+    :_buffer(capacity),
+     _start((void*)_buffer.buf),
+     _available(_start, capacity)
+    { }
 
     Writer::Chunk::Chunk(Chunk&& c) noexcept
-    :_start(c._start),
+    :_buffer(std::move(c._buffer)),
+     _start(c._start),
      _available(c._available)
     {
         c._start = nullptr;
     }
 
     Writer::Chunk& Writer::Chunk::operator=(Chunk&& c) noexcept {
+        _buffer = std::move(c._buffer);
         _start = c._start;
         _available = c._available;
         c._start = nullptr;
@@ -184,7 +379,7 @@ namespace fleece {
 
 
     void Writer::Chunk::free() noexcept {
-        ::free(_start);
+        _buffer.reset();
         _start = nullptr;
     }
 
@@ -205,12 +400,22 @@ namespace fleece {
         return true;
     }
 
-    void Writer::Chunk::resizeToFit() noexcept {
+    alloc_slice Writer::Chunk::extractContents() noexcept {
+        alloc_slice result = std::move(_buffer);
         size_t len = length();
-        void *newStart = ::realloc(_start, len);
-        if (newStart)
-            _start = newStart;
-        _available = slice(offsetby(newStart,len), (size_t)0);
+        if (len < result.size - result.size / 4) {
+            // Give back the unused space; realloc can usually shrink a block in place.
+            try {
+                result.resize(len);
+            } catch (...) {
+                result.shorten(len);
+            }
+        } else {
+            result.shorten(len);
+        }
+        _start = nullptr;
+        _available = nullslice;
+        return result;
     }
 
 
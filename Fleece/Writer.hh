@@ -19,6 +19,8 @@
 #pragma once
 
 #include "slice.hh"
+#include <functional>
+#include <stdio.h>
 #include <vector>
 
 namespace fleece {
@@ -30,6 +32,33 @@ namespace fleece {
         static const size_t kDefaultInitialCapacity = 256;
 
         Writer(size_t initialCapacity =kDefaultInitialCapacity);
+
+        /** Callback that receives output data when a streaming Writer is flushed. */
+        typedef std::function<void(slice)> OutputCallback;
+
+        /** Constructs a Writer that streams its output to a file instead of keeping it in
+            memory. Data accumulates in memory until flush() is called. */
+        Writer(FILE *outputFile NONNULL);
+
+        /** Constructs a Writer that streams its output to a callback instead of keeping it in
+            memory. Data accumulates in memory until flush() is called. */
+        Writer(OutputCallback);
+
+        /** Constructs a Writer that writes into a caller-provided buffer, without allocating any
+            memory for its output. If the output outgrows the buffer, a MemoryError is thrown. */
+        explicit Writer(slice outputBuffer);
+
+#ifndef _MSC_VER
+        /** Constructs a Writer whose output is a memory-mapped file, created (or truncated) at
+            the given path. The mapping grows in place as data is written, so nothing is ever
+            copied or moved. `maxLength` is the address space to reserve, which limits the
+            output size. flush() trims the file to the length written. */
+        Writer(const char *mappedFilePath NONNULL, size_t maxLength =kDefaultMaxMappedLength);
+
+        static const size_t kDefaultMaxMappedLength = (sizeof(void*) >= 8) ? (1ull << 36)
+                                                                           : (1ull << 28);
+#endif
+
         ~Writer();
 
         Writer(Writer&&) noexcept;
@@ -38,6 +67,31 @@ namespace fleece {
         void reset();
 
         size_t length() const                   {return _length;}
+
+        /** True if the Writer streams its output to a file or callback. */
+        bool isStreaming() const                {return _outputFile || _outputCallback;}
+
+        /** The number of bytes written but not yet flushed; only differs from length() if
+            streaming. */
+        size_t bufferedLength() const           {return _length - _flushedLength;}
+
+        /** True if the Writer's output is a memory-mapped file. */
+        bool isMappedFile() const               {return _fd >= 0;}
+
+        /** The most that can still be written. This is only limited when writing to a
+            caller-provided buffer or a memory-mapped file; otherwise it's SIZE_MAX. */
+        size_t spaceLeft() const {
+            if (_fixedCapacity)
+                return _chunks.back().available().size;
+            else if (isMappedFile())
+                return _maxMappedLength - _chunks[0].length();
+            return SIZE_MAX;
+        }
+
+        /** In streaming mode, writes all buffered data to the output and frees it. Any pointers
+            into previously written data become invalid. In memory-mapped mode, trims the file to
+            the length written. Otherwise does nothing. */
+        void flush();
         const void* curPos() const;
         size_t posToOffset(const void *pos NONNULL) const;
 
@@ -45,9 +99,18 @@ namespace fleece {
         std::vector<slice> output() const;
 
         /** Returns the data written. The Writer stops managing this memory; it now belongs to
-            the caller and will be freed when no more alloc_slices refer to it. */
+            the caller and will be freed when no more alloc_slices refer to it.
+            If all the output is in a single heap buffer, that buffer is handed over without
+            being copied. With a caller-provided buffer, the data is copied.
+            In streaming or memory-mapped mode this flushes the data and returns a null slice. */
         alloc_slice extractOutput();
 
+        /** Returns the data written as a single slice, coalescing the chunks into one if
+            necessary. Unlike extractOutput, the Writer keeps ownership of the memory, so it can
+            reuse it after a reset(). The slice is only valid until the next write or reset.
+            (In streaming mode, this is only the data that hasn't been flushed.) */
+        slice contiguousOutput();
+
         const void* write(const void* data, size_t length);
         const void* write(slice s)              {return write(s.buf, s.size);}
 
@@ -65,6 +128,10 @@ namespace fleece {
             the output. */
         const void* reserveSpace(size_t length)      {return write(nullptr, length);}
 
+        /** Takes back the last `length` bytes written, which must all be in the current chunk;
+            that's the case for space just reserved with reserveSpace(). */
+        void retract(size_t length);
+
         /** Overwrites already-written data.
             @param pos  The position in the output at which to start overwriting
             @param newData  The data that replaces the old */
@@ -80,9 +147,17 @@ namespace fleece {
             Chunk& operator=(Chunk&&) noexcept;
             void free() noexcept;
             void reset()              {_available.setStart(_start);}
+            void retract(size_t n)    {_available.moveStart(-(ptrdiff_t)n);}
+            void relocate(void *newStart) {
+                size_t used = length();
+                _available = slice(offsetby(newStart, used), _available.size);
+                _start = newStart;
+            }
             const void* write(const void* data, size_t length);
             bool pad();
-            void resizeToFit() noexcept;
+            void grow(size_t capacity)  {_available.setEnd(offsetby(_start, capacity));}
+            alloc_slice extractContents() noexcept;
+            bool isHeap() const       {return _buffer.buf != nullptr;}
             void* start()             {return _start;}
             size_t length() const     {return (int8_t*)_available.buf - (int8_t*)_start;}
             size_t capacity() const   {return (int8_t*)_available.end() - (int8_t*)_start;}
@@ -91,13 +166,20 @@ namespace fleece {
             bool contains(const void *ptr) const   {return ptr >= _start && ptr <= _available.buf;}
             size_t offsetOf(const void *ptr) const {return (int8_t*)ptr - (int8_t*)_start;}
         private:
+            alloc_slice _buffer;                // Owns the memory, if it's on the heap
             void *_start;
             slice _available;
         };
 
+        // The largest chunk reset() keeps for reuse, unless the initial capacity was larger.
+        static const size_t kMaxRetainedChunkSize = 1024 * 1024;
+
         const void* writeToNewChunk(const void* data, size_t length);
         void addChunk(size_t capacity);
         void freeChunk(Chunk &chunk);
+        void growMappedFile(size_t minCapacity);
+        void closeMappedFile() noexcept;
+        void moveFrom(Writer&) noexcept;
 
         Writer(const Writer&) = delete;
         const Writer& operator=(const Writer&) = delete;
@@ -105,6 +187,13 @@ namespace fleece {
         std::vector<Chunk> _chunks;
         size_t _chunkSize;
         size_t _length;
+        size_t _flushedLength {0};              // Bytes already handed to the output
+        FILE* _outputFile {nullptr};            // Streaming output file, if any
+        OutputCallback _outputCallback;         // Streaming output callback, if any
+        bool _fixedCapacity {false};            // True if writing to a caller-provided buffer
+        int _fd {-1};                           // Memory-mapped output file, if any
+        size_t _mappedLength {0};               // Length of the file that's mapped into memory
+        size_t _maxMappedLength {0};            // Address space reserved for the mapping
         uint8_t _initialBuf[kDefaultInitialCapacity];
     };
 
@@ -17,18 +17,49 @@
 //
 
 #include "FleeceTests.hh"
+#include "EncoderPool.hh"
 #include "JSONConverter.hh"
+#include "JSONEncoder.hh"
+#include "NDJSONConverter.hh"
 #include "KeyTree.hh"
 #include "Path.hh"
+#include "StructSchema.hh"
 #include "Internal.hh"
-#include "jsonsl.h"
 #include "mn_wordlist.h"
 #include <iostream>
 #include <float.h>
+#include <random>
 
 
 namespace fleece {
 
+struct TestAddress {
+    std::string street;
+    std::string city;
+    uint16_t zip;
+};
+FLEECE_STRUCT(TestAddress,
+              FLEECE_FIELD(TestAddress, street),
+              FLEECE_FIELD(TestAddress, city),
+              FLEECE_FIELD(TestAddress, zip))
+
+struct TestPerson {
+    std::string name;
+    int64_t balance;
+    double latitude;
+    bool isActive;
+    std::vector<std::string> tags;
+    std::vector<TestAddress> addresses;
+};
+FLEECE_STRUCT(TestPerson,
+              FLEECE_FIELD(TestPerson, name),
+              FLEECE_FIELD(TestPerson, balance),
+              FLEECE_FIELD(TestPerson, latitude),
+              FLEECE_FIELD_NAMED(TestPerson, isActive, "active"),
+              FLEECE_FIELD(TestPerson, tags),
+              FLEECE_FIELD(TestPerson, addresses))
+
+
 class EncoderTests {
 public:
     EncoderTests()
@@ -159,7 +190,7 @@ public:
 
     void checkJSONStr(std::string json,
                       const char *expectedStr,
-                      int expectedErr = JSONSL_ERROR_SUCCESS)
+                      int expectedErr = JSONConverter::kErrNone)
     {
         json = std::string("[\"") + json + std::string("\"]");
         JSONConverter j(enc);
@@ -481,6 +512,71 @@ public:
 #endif
     }
 
+    TEST_CASE_METHOD(EncoderTests, "DictionaryKeyOrderCache", "[Encoder]") {
+        // Dicts with the same keys in the same (unsorted) order reuse the cached sort order:
+        enc.beginArray();
+        for (int i = 0; i < 10; i++) {
+            enc.beginDictionary();
+            enc.writeKey("zebra");
+            enc.writeInt(i);
+            enc.writeKey("x");
+            enc.writeInt(-i);
+            enc.writeKey(i < 5 ? "aardvark" : "aardwolf");
+            enc.writeString("hi");
+            enc.endDictionary();
+        }
+        enc.endArray();
+        endEncoding();
+        auto root = Value::fromData(result)->asArray();
+        REQUIRE(root);
+        REQUIRE(root->get(3)->toJSON() == "{\"aardvark\":\"hi\",\"x\":-3,\"zebra\":3}"_sl);
+        REQUIRE(root->get(7)->toJSON() == "{\"aardwolf\":\"hi\",\"x\":-7,\"zebra\":7}"_sl);
+        CHECK(enc.stats().dictShapeMisses == 2);
+        CHECK(enc.stats().dictShapeHits == 8);
+        CHECK(enc.stats().dictsPresorted == 0);
+
+        // Copying a Fleece Dict copies it whole, already sorted, so no sorting is needed:
+        alloc_slice original = result;
+        enc.writeValue(root->get(3));
+        endEncoding();
+        REQUIRE(Value::fromData(result)->toJSON() == root->get(3)->toJSON());
+        CHECK(enc.stats().dictsPresorted == 0);
+        CHECK(enc.stats().subtreesCopied == 1);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "StructSchema", "[Encoder]") {
+        TestPerson person {"Concepcion Burns", -123456789, 37.5, true, {"foo", "bar"},
+                           {{"1 Main St.", "Springfield", 12345},
+                            {"2 Elm St.", "Shelbyville", 54321}}};
+        encodeStruct(enc, person);
+        endEncoding();
+        auto root = Value::fromData(result);
+        REQUIRE(root);
+        REQUIRE(root->toJSON() == "{\"active\":true,\"addresses\":["
+                    "{\"city\":\"Springfield\",\"street\":\"1 Main St.\",\"zip\":12345},"
+                    "{\"city\":\"Shelbyville\",\"street\":\"2 Elm St.\",\"zip\":54321}],"
+                    "\"balance\":-123456789,\"latitude\":37.5,\"name\":\"Concepcion Burns\","
+                    "\"tags\":[\"foo\",\"bar\"]}"_sl);
+        REQUIRE(root->asDict()->get("name"_sl)->asString() == "Concepcion Burns"_sl);
+
+        TestPerson decoded {};
+        REQUIRE(decodeStruct(root, decoded));
+        CHECK(decoded.name == person.name);
+        CHECK(decoded.balance == person.balance);
+        CHECK(decoded.latitude == person.latitude);
+        CHECK(decoded.isActive == person.isActive);
+        CHECK(decoded.tags == person.tags);
+        REQUIRE(decoded.addresses.size() == 2);
+        CHECK(decoded.addresses[1].city == "Shelbyville");
+        CHECK(decoded.addresses[1].zip == 54321);
+
+        // Missing keys leave fields alone; non-dicts fail:
+        TestAddress address {"x", "y", 1};
+        REQUIRE(decodeStruct(root, address));
+        CHECK(address.street == "x");
+        REQUIRE(!decodeStruct(root->asDict()->get("tags"_sl), address));
+    }
+
     TEST_CASE_METHOD(EncoderTests, "Deep Nesting", "[Encoder]") {
         for (int depth = 0; depth < 100; ++depth) {
             enc.beginArray();
@@ -507,6 +603,318 @@ public:
         REQUIRE(a->toJSON() == alloc_slice("[\"a\",\"hello\",\"a\",\"hello\"]"));
     }
 
+    TEST_CASE_METHOD(EncoderTests, "SharedLongStringsAndNumbers", "[Encoder]") {
+        auto encode = [&]() {
+            enc.beginArray();
+            for (int i = 0; i < 3; i++) {
+                enc.writeString("0f8fad5b-d9cb-469f-a165-70867728950e");
+                enc.writeDouble(3.14159);
+                enc.writeInt(1234567890123ll);
+            }
+            enc.endArray();
+            endEncoding();
+            auto a = Value::fromData(result)->asArray();
+            REQUIRE(a);
+            REQUIRE(a->count() == 9);
+            for (uint32_t i = 0; i < 9; i += 3) {
+                REQUIRE(a->get(i)->asString() == "0f8fad5b-d9cb-469f-a165-70867728950e"_sl);
+                REQUIRE(a->get(i+1)->asDouble() == 3.14159);
+                REQUIRE(a->get(i+2)->asInt() == 1234567890123ll);
+            }
+            size_t size = result.size;
+            enc.reset();
+            return size;
+        };
+
+        size_t plainSize = encode();
+        enc.maxSharedStringSize(64);
+        size_t sharedStringsSize = encode();
+        CHECK(sharedStringsSize == plainSize - 2*38);
+        enc.uniqueNumbers(true);
+        size_t sharedNumbersSize = encode();
+        CHECK(sharedNumbersSize == sharedStringsSize - 2*10 - 2*8);
+        CHECK(enc.stats().savedNumbers == 4);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "UniqueCollections", "[Encoder]") {
+        auto encode = [&]() {
+            enc.beginArray();
+            for (int i = 0; i < 3; i++) {
+                enc.beginDictionary();
+                enc.writeKey("city");
+                enc.writeString("Springfield");
+                enc.writeKey("tags");
+                enc.beginArray();
+                enc.writeString("home");
+                enc.writeString("work");
+                enc.endArray();
+                enc.endDictionary();
+                enc.beginArray();           // same items as the dict, but not the same
+                enc.writeString("city");
+                enc.writeString("Springfield");
+                enc.endArray();
+            }
+            enc.endArray();
+            endEncoding();
+            auto a = Value::fromData(result)->asArray();
+            REQUIRE(a);
+            REQUIRE(a->toJSON() == "[{\"city\":\"Springfield\",\"tags\":[\"home\",\"work\"]},"
+                                    "[\"city\",\"Springfield\"],"
+                                    "{\"city\":\"Springfield\",\"tags\":[\"home\",\"work\"]},"
+                                    "[\"city\",\"Springfield\"],"
+                                    "{\"city\":\"Springfield\",\"tags\":[\"home\",\"work\"]},"
+                                    "[\"city\",\"Springfield\"]]"_sl);
+            size_t size = result.size;
+            enc.reset();
+            return size;
+        };
+
+        size_t plainSize = encode();
+        enc.uniqueCollections(true);
+        size_t uniqueSize = encode();
+        CHECK(uniqueSize < plainSize);
+        // The 2nd and 3rd of each dict, 'tags' array and array are pointers to the 1st:
+        CHECK(enc.stats().savedCollections == 6);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "EncoderStats", "[Encoder]") {
+        SharedKeys sk;
+        sk.setMaxKeyLength(8);
+        enc.setSharedKeys(&sk);
+        auto encode = [&]() {
+            enc.beginArray();
+            for (int i = 0; i < 3; i++) {
+                enc.beginDictionary();
+                enc.writeKey("name");                   // gets shared
+                enc.writeString("shared string");
+                enc.writeKey("a long key name");        // too long to share
+                enc.writeInt(i);
+                enc.endDictionary();
+            }
+            enc.endArray();
+            endEncoding();
+        };
+        encode();
+        auto &stats = enc.stats();
+        CHECK(stats.sharedKeyHits == 3);
+        CHECK(stats.sharedKeyMisses == 3);
+        CHECK(stats.savedStrings == 4);
+        CHECK(stats.savedStringBytes == 2 * 14 + 2 * 18);   // ("a long key name" needs a varint)
+        CHECK(stats.narrowCollections == 4);
+        CHECK(stats.narrowItems == 3 + 3 * 2);
+        CHECK(stats.wideCollections == 0);
+        CHECK(stats.dictsPresorted + stats.dictShapeHits + stats.dictShapeMisses == 3);
+
+        // Stats accumulate until they're reset:
+        encode();
+        CHECK(stats.savedStrings == 8);
+        enc.resetStats();
+        CHECK(stats.savedStrings == 0);
+        CHECK(stats.narrowCollections == 0);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "EncoderKeys", "[Encoder]") {
+        EncoderKey nameKey("name"_sl), longKey("a long key name"_sl), xKey("x"_sl);
+        auto encode = [&](bool useKeys) {
+            enc.beginArray();
+            for (int i = 0; i < 3; i++) {
+                enc.beginDictionary();
+                if (useKeys) enc.writeKey(nameKey); else enc.writeKey("name");
+                enc.writeString("shared string");
+                if (useKeys) enc.writeKey(longKey); else enc.writeKey("a long key name");
+                enc.writeInt(i);
+                if (useKeys) enc.writeKey(xKey); else enc.writeKey("x");
+                enc.writeBool(true);
+                enc.endDictionary();
+            }
+            enc.endArray();
+            endEncoding();
+            return result;
+        };
+
+        SECTION("Strings") {
+            alloc_slice expected = encode(false);
+            CHECK(encode(true) == expected);
+            CHECK(encode(true) == expected);        // (after reset, keys are re-cached)
+        }
+        SECTION("New encoder") {
+            // An encoder at the same address as a destroyed one mustn't reuse stale offsets:
+            alloc_slice expected = encode(false);
+            enc.~Encoder();
+            new (&enc) Encoder();
+            CHECK(encode(true) == expected);
+        }
+        SECTION("SharedKeys") {
+            SharedKeys sk;
+            sk.setMaxKeyLength(8);
+            enc.setSharedKeys(&sk);
+            alloc_slice expected = encode(false);
+            enc.resetStats();
+            CHECK(encode(true) == expected);
+            CHECK(enc.stats().sharedKeyHits == 6);
+            CHECK(enc.stats().sharedKeyMisses == 3);
+            CHECK(enc.stats().savedStrings == 4);
+
+            auto dict = Value::fromData(expected)->asArray()->get(2)->asDict();
+            CHECK(dict->get("name"_sl, &sk)->asString() == "shared string"_sl);
+            CHECK(dict->get("a long key name"_sl, &sk)->asInt() == 2);
+        }
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "DeltaReusesBaseCollections", "[Encoder]") {
+        alloc_slice base = JSONConverter::convertJSON(readFile(kTestFilesDir "1000people.json"));
+        auto people = Value::fromData(base)->asArray();
+        REQUIRE(people);
+
+        // Re-encode the people from scratch, from JSON, with one person's name changed:
+        std::string json = readFile(kTestFilesDir "1000people.json").asString();
+        auto pos = json.find("\"Concepcion Burns\"");
+        REQUIRE(pos != std::string::npos);
+        json.replace(pos, 18, "\"Connie Burns\"");
+
+        auto encodeDelta = [&](bool reuseCollections) {
+            Encoder e;
+            e.setBase(base);
+            if (reuseCollections)
+                e.reuseBaseCollections();
+            else
+                e.reuseBaseStrings();
+            JSONConverter jc(e);
+            REQUIRE(jc.encodeJSON(slice(json)));
+            alloc_slice delta = e.extractOutput();
+
+            alloc_slice combined(base.size + delta.size);
+            memcpy((void*)combined.buf, base.buf, base.size);
+            memcpy((uint8_t*)combined.buf + base.size, delta.buf, delta.size);
+            auto root = Value::fromData(combined);
+            REQUIRE(root);
+            REQUIRE(root->asArray()->get(123)->asDict()->get("name"_sl)->asString()
+                        == "Connie Burns"_sl);
+            REQUIRE(root->asArray()->get(122)->toJSON() == people->get(122)->toJSON());
+            return delta.size;
+        };
+        size_t fullDeltaSize = encodeDelta(false);
+        size_t smallDeltaSize = encodeDelta(true);
+        fprintf(stderr, "Delta is %zu bytes, or %zu bytes reusing base collections\n",
+                fullDeltaSize, smallDeltaSize);
+        // All that's left is the changed person, and the root array's 1000 pointers:
+        CHECK(smallDeltaSize < 4500);
+        CHECK(smallDeltaSize * 100 < fullDeltaSize);
+
+        // reset() turns off the options reuseBaseCollections() turned on:
+        Encoder reused, fresh;
+        reused.setBase(base);
+        reused.reuseBaseCollections();
+        reused.reset();
+        for (Encoder *e : {&reused, &fresh}) {
+            e->beginArray();
+            for (int i = 0; i < 2; ++i) {
+                e->beginArray();
+                e->writeString("a string that's too long to be uniqued"_sl);
+                e->writeDouble(3.14159);
+                e->endArray();
+            }
+            e->endArray();
+        }
+        CHECK(reused.extractOutput() == fresh.extractOutput());
+    }
+
+    // Appends `nDeltas` deltas to 1000people, each changing one person's name.
+    static alloc_slice makeDeltaChain(int nDeltas) {
+        alloc_slice data = JSONConverter::convertJSON(readFile(kTestFilesDir "1000people.json"));
+        for (int n = 1; n <= nDeltas; ++n) {
+            auto people = Value::fromData(data)->asArray();
+            Encoder enc;
+            enc.setBase(data);
+            enc.reuseBaseStrings();
+            enc.beginArray();
+            for (uint32_t i = 0; i < people->count(); ++i) {
+                if (i != (uint32_t)n * 7) {
+                    enc.writeValue(people->get(i));         // written as a pointer into the base
+                    continue;
+                }
+                enc.beginDictionary();
+                for (Dict::iterator iter(people->get(i)->asDict()); iter; ++iter) {
+                    enc.writeKey(iter.keyString());
+                    if (iter.keyString() == "name"_sl)
+                        enc.writeString("Person #" + std::to_string(n));
+                    else
+                        enc.writeValue(iter.value());
+                }
+                enc.endDictionary();
+            }
+            enc.endArray();
+            alloc_slice delta = enc.extractOutput();
+
+            alloc_slice combined(data.size + delta.size);
+            memcpy((void*)combined.buf, data.buf, data.size);
+            memcpy((uint8_t*)combined.buf + data.size, delta.buf, delta.size);
+            data = combined;
+        }
+        return data;
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "CompactDeltaChain", "[Encoder]") {
+        alloc_slice data = makeDeltaChain(10);
+        auto root = Value::fromData(data);
+        REQUIRE(root);
+        REQUIRE(root->asArray()->get(70)->asDict()->get("name"_sl)->asString() == "Person #10"_sl);
+
+        alloc_slice compacted = Encoder::compact(data);
+        auto newRoot = Value::fromData(compacted);      // validates the data
+        REQUIRE(newRoot);
+        REQUIRE(newRoot->toJSON() == root->toJSON());
+        size_t baseSize = makeDeltaChain(0).size;
+        fprintf(stderr, "Compacted %zu bytes to %zu (the original was %zu)\n",
+                data.size, compacted.size, baseSize);
+        // All that's left of the deltas is the ten changed people:
+        CHECK(compacted.size < baseSize + 1000);
+
+        // Compacting a compact document changes nothing:
+        REQUIRE(Encoder::compact(compacted) == compacted);
+
+        // Scalar roots, inline or not:
+        for (slice json : {"17"_sl, "\"a string that isn't inline\""_sl, "[]"_sl}) {
+            alloc_slice scalar = JSONConverter::convertJSON(json);
+            REQUIRE(Encoder::compact(scalar) == scalar);
+        }
+        auto compactError = [](slice data) -> int {
+            try {
+                Encoder::compact(data);
+            } catch (const FleeceException &x) {
+                return x.code;
+            }
+            return NoError;
+        };
+        REQUIRE(compactError("not Fleece"_sl) == InvalidData);
+
+        // Damaged data is rejected, the same as by Value::fromData:
+        alloc_slice doc = JSONConverter::convertJSON("[\"hello\", {\"x\": [1, 2.5, \"there\"]}]"_sl);
+        for (size_t i = 0; i < doc.size; ++i) {
+            alloc_slice damaged(doc.buf, doc.size);     // (a copy)
+            ((uint8_t*)damaged.buf)[i] ^= 0x5A;
+            if (Value::fromData(damaged))
+                REQUIRE(Value::fromData(Encoder::compact(damaged)));
+            else
+                REQUIRE(compactError(damaged) == InvalidData);
+        }
+
+        // A collection's first item is only dereferenced after its bounds are checked:
+        {
+            Encoder e;
+            e.beginArray();
+            e.writeString("a string that isn't inline"_sl);
+            e.writeInt(100000);                         // (makes the array wide)
+            e.endArray();
+            alloc_slice damaged(e.extractOutput());
+            auto firstItem = (uint8_t*)Value::fromData(damaged) + 2; // (past the header)
+            REQUIRE(firstItem[0] >= 0x80);              // a pointer to the string
+            memset(firstItem, 0xFF, 4);                 // now points ~4GB before the data
+            REQUIRE(!Value::fromData(damaged));
+            REQUIRE(compactError(damaged) == InvalidData);
+        }
+    }
+
     TEST_CASE("Widening Edge Case", "[Encoder]") {
         // Tests an edge case in the Encoder's logic for widening an array/dict when a pointer
         // reaches back 64KB. See couchbase/couchbase-lite-core#493
@@ -527,6 +935,45 @@ public:
 
 #pragma mark - JSON:
 
+    TEST_CASE_METHOD(EncoderTests, "OptimizeLayout", "[Encoder]") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        auto encodePeople = [&](bool optimize) {
+            enc.reset();
+            enc.resetStats();
+            enc.optimizeLayout(optimize);
+            JSONConverter jr(enc);
+            REQUIRE(jr.encodeJSON(input));
+            enc.end();
+            return enc.extractOutput();
+        };
+
+        alloc_slice plain = encodePeople(false);
+        auto plainStats = enc.stats();
+        alloc_slice laidOut = encodePeople(true);
+        auto laidOutStats = enc.stats();
+
+        auto root = Value::fromData(laidOut);
+        REQUIRE(root);
+        CHECK(root->toJSON() == Value::fromData(plain)->toJSON());
+        CHECK(laidOut.size <= plain.size);
+        CHECK(laidOutStats.narrowCollections + laidOutStats.wideCollections
+              == plainStats.narrowCollections + plainStats.wideCollections);
+        CHECK(laidOutStats.wideCollections < plainStats.wideCollections / 10);
+
+        // Each person's strings come right before it:
+        auto person = root->asArray()->get(500)->asDict();
+        auto name = person->get(slice("name"));
+        REQUIRE(name);
+        CHECK((const uint8_t*)person - (const uint8_t*)name < 0x400);
+
+        // A scalar root is left alone:
+        enc.reset();
+        enc.writeString("just a string");
+        enc.end();
+        result = enc.extractOutput();
+        CHECK(Value::fromData(result)->asString() == slice("just a string"));
+    }
+
     TEST_CASE_METHOD(EncoderTests, "JSONStrings", "[Encoder]") {
         checkJSONStr("", "");
         checkJSONStr("x", "x");
@@ -543,21 +990,21 @@ public:
         checkJSONStr("Price \\u20ac250", "Price €250");
         checkJSONStr("Price \\uffff?", "Price \uffff?");
         checkJSONStr("Price \\u20ac", "Price €");
-        checkJSONStr("Price \\u20a", nullptr, JSONSL_ERROR_UESCAPE_TOOSHORT);
-        checkJSONStr("Price \\u20", nullptr, JSONSL_ERROR_UESCAPE_TOOSHORT);
-        checkJSONStr("Price \\u2", nullptr, JSONSL_ERROR_UESCAPE_TOOSHORT);
-        checkJSONStr("Price \\u", nullptr, JSONSL_ERROR_UESCAPE_TOOSHORT);
-        checkJSONStr("\\uzoop!", nullptr, JSONSL_ERROR_PERCENT_BADHEX);
-        checkJSONStr("!\\u0000!", nullptr, JSONSL_ERROR_INVALID_CODEPOINT);
+        checkJSONStr("Price \\u20a", nullptr, JSONConverter::kErrUEscapeTooShort);
+        checkJSONStr("Price \\u20", nullptr, JSONConverter::kErrUEscapeTooShort);
+        checkJSONStr("Price \\u2", nullptr, JSONConverter::kErrUEscapeTooShort);
+        checkJSONStr("Price \\u", nullptr, JSONConverter::kErrUEscapeTooShort);
+        checkJSONStr("\\uzoop!", nullptr, JSONConverter::kErrBadHex);
+        checkJSONStr("!\\u0000!", nullptr, JSONConverter::kErrInvalidCodepoint);
 
         // UTF-16 surrogate pair decoding:
         checkJSONStr("lmao\\uD83D\\uDE1C!", "lmao😜!");
-        checkJSONStr("lmao\\uD83D", nullptr, JSONSL_ERROR_INVALID_CODEPOINT);
-        checkJSONStr("lmao\\uD83D\\n", nullptr, JSONSL_ERROR_INVALID_CODEPOINT);
-        checkJSONStr("lmao\\uD83D\\u", nullptr, JSONSL_ERROR_UESCAPE_TOOSHORT);
-        checkJSONStr("lmao\\uD83D\\u333", nullptr, JSONSL_ERROR_UESCAPE_TOOSHORT);
-        checkJSONStr("lmao\\uD83D\\u3333", nullptr, JSONSL_ERROR_INVALID_CODEPOINT);
-        checkJSONStr("lmao\\uDE1C\\uD83D!", nullptr, JSONSL_ERROR_INVALID_CODEPOINT);
+        checkJSONStr("lmao\\uD83D", nullptr, JSONConverter::kErrInvalidCodepoint);
+        checkJSONStr("lmao\\uD83D\\n", nullptr, JSONConverter::kErrInvalidCodepoint);
+        checkJSONStr("lmao\\uD83D\\u", nullptr, JSONConverter::kErrUEscapeTooShort);
+        checkJSONStr("lmao\\uD83D\\u333", nullptr, JSONConverter::kErrUEscapeTooShort);
+        checkJSONStr("lmao\\uD83D\\u3333", nullptr, JSONConverter::kErrInvalidCodepoint);
+        checkJSONStr("lmao\\uDE1C\\uD83D!", nullptr, JSONConverter::kErrInvalidCodepoint);
     }
 
     TEST_CASE_METHOD(EncoderTests, "JSON", "[Encoder]") {
@@ -572,6 +1019,515 @@ public:
         REQUIRE((slice)output == json);
     }
 
+    TEST_CASE_METHOD(EncoderTests, "JSONErrors", "[Encoder]") {
+        auto check = [&](const char *json, int expectedErr, size_t expectedPos) {
+            INFO("JSON: " << json);
+            JSONConverter j(enc);
+            CHECK(!j.encodeJSON(slice(json)));
+            CHECK(j.jsonError() == expectedErr);
+            CHECK(j.errorPos() == expectedPos);
+            CHECK(j.errorCode() == JSONError);
+            enc.reset();
+        };
+        check("[1,2,,3]", JSONConverter::kErrSyntax, 5);
+        check("[1 2]", JSONConverter::kErrSyntax, 3);
+        check("{\"a\" 1}", JSONConverter::kErrSyntax, 5);
+        check("{\"a\":1,}", JSONConverter::kErrSyntax, 7);
+        check("{1:2}", JSONConverter::kErrSyntax, 1);
+        check("[1}", JSONConverter::kErrSyntax, 2);
+        check("[true, nul]", JSONConverter::kErrSyntax, 7);
+        check("[truest]", JSONConverter::kErrSyntax, 1);
+        check("[1] [2]", JSONConverter::kErrSyntax, 4);
+        check("[01]", JSONConverter::kErrInvalidNumber, 2);
+        check("[-]", JSONConverter::kErrInvalidNumber, 1);
+        check("[1.]", JSONConverter::kErrInvalidNumber, 3);
+        check("[1e+]", JSONConverter::kErrInvalidNumber, 4);
+        check("[12ab]", JSONConverter::kErrInvalidNumber, 3);
+        check("[\"a\\x\"]", JSONConverter::kErrInvalidEscape, 3);
+        check("[\"tab\there\"]", JSONConverter::kErrControlCharacter, 5);
+        check("[1, [2, {\"a\":", JSONConverter::kErrTruncatedJSON, 13);
+        check("{\"a\":\"b", JSONConverter::kErrTruncatedJSON, 7);
+
+        // Valid documents with all the scalar types, with whitespace everywhere:
+        JSONConverter j(enc);
+        REQUIRE(j.encodeJSON(" [ 0 , -0 , 18446744073709551615 , -9223372036854775808 ,"
+                             " 18446744073709551616 , 1.5e3 , true , false , null ,"
+                             " \"\\/\\b\\f\\r\\t\" , { } , [ ] ] \n"_sl));
+        endEncoding();
+        auto a = checkArray(12);
+        CHECK(a->get(0)->asInt() == 0);
+        CHECK(a->get(1)->asInt() == 0);
+        CHECK(a->get(2)->asUnsigned() == UINT64_MAX);
+        CHECK(a->get(3)->asInt() == INT64_MIN);
+        CHECK(a->get(4)->asDouble() == 18446744073709551616.0);
+        CHECK(a->get(5)->asDouble() == 1500.0);
+        CHECK(a->get(9)->asString() == "/\b\f\r\t"_sl);
+        CHECK(a->get(10)->asDict()->count() == 0);
+        CHECK(a->get(11)->asArray()->count() == 0);
+
+        // Strings long enough to cross the parser's 64-byte blocks, with escapes at the edges:
+        std::string str, json = "[\"";
+        for (int i = 0; i < 300; ++i) {
+            str += (i % 61 == 0) ? '"' : (i % 67 == 0) ? '\\' : (char)('a' + i % 26);
+            json += (i % 61 == 0) ? "\\\"" : (i % 67 == 0) ? "\\\\" : std::string(1, 'a' + i % 26);
+        }
+        json += "\"]";
+        REQUIRE(j.encodeJSON(slice(json)));
+        endEncoding();
+        CHECK(checkArray(1)->get(0)->asString() == slice(str));
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "JSONEscapedStrings", "[Encoder]") {
+        // Escaped strings are decoded straight into the output; check lengths around the vector
+        // sizes and around where the length's varint shrinks (escaped 130 bytes, decoded 120),
+        // with escapes at each end, and each string twice, so the second is a duplicate.
+        for (bool unique : {false, true}) {
+            for (size_t length = 1; length <= 140; ++length) {
+                for (size_t nEscapes : {1, 2, 5, 12}) {
+                    std::string escaped, expected;
+                    size_t escapeAt = 0;
+                    for (size_t i = 0; i < length; ++i) {
+                        if (i >= escapeAt) {
+                            escaped += (i % 2) ? "\\\"" : "\\n";
+                            expected += (i % 2) ? '"' : '\n';
+                            escapeAt = i + std::max(length / nEscapes, (size_t)1);
+                        } else {
+                            escaped += (char)('a' + i % 26);
+                            expected += (char)('a' + i % 26);
+                        }
+                    }
+                    escaped += "\\t";
+                    expected += '\t';
+                    std::string json = "{\"k\\u00e9y\":[\"" + escaped + "\",\""
+                                                           + escaped + "\"]}";
+                    INFO("JSON: " << json);
+
+                    enc.uniqueStrings(unique);
+                    JSONConverter j(enc);
+                    REQUIRE(j.encodeJSON(slice(json)));
+                    endEncoding();
+                    auto d = checkDict(1);
+                    auto a = d->get("k\xC3\xA9y"_sl)->asArray();
+                    REQUIRE(a->count() == 2);
+                    CHECK(a->get(0)->asString() == slice(expected));
+                    CHECK(a->get(1)->asString() == slice(expected));
+                    enc.reset();
+                }
+            }
+        }
+
+        // A string whose escaped form is too big for a fixed output buffer, but whose decoded
+        // form isn't:
+        std::string escaped, expected;
+        for (int i = 0; i < 40; ++i) {
+            escaped += "\\u0041";
+            expected += 'A';
+        }
+        uint8_t buffer[64];
+        Encoder bufEnc(slice(buffer, sizeof(buffer)));
+        JSONConverter j(bufEnc);
+        REQUIRE(j.encodeJSON(slice("[\"" + escaped + "\"]")));
+        bufEnc.end();
+        auto root = Value::fromData(slice(buffer, bufEnc.bytesWritten()));
+        REQUIRE(root);
+        CHECK(root->asArray()->get(0)->asString() == slice(expected));
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "JSONNumbers", "[Encoder]") {
+        auto parse = [&](std::string number) -> double {
+            INFO("Number: " << number);
+            JSONConverter j(enc);
+            REQUIRE(j.encodeJSON(slice("[" + number + "]")));
+            endEncoding();
+            double d = checkArray(1)->get(0)->asDouble();
+            enc.reset();
+            return d;
+        };
+        // Results must be the correctly rounded ones, which the compiler computes for literals:
+        CHECK(parse("0.1") == 0.1);
+        CHECK(parse("-123.456") == -123.456);
+        CHECK(parse("6.02e+23") == 6.02e+23);
+        CHECK(parse("1e23") == 1e23);                                   // not exact in Clinger
+        CHECK(parse("9007199254740993.0") == 9007199254740992.0);       // tie, rounds to even
+        CHECK(parse("9007199254740995.0") == 9007199254740996.0);
+        CHECK(parse("3.14159265358979323846264338327950288") == 3.14159265358979323846);
+        CHECK(parse("1.00000000000000011102230246251565404236316680908203125") == 1.0); // tie
+        CHECK(parse("1.00000000000000011102230246251565404236316680908203126")
+              == 1.0000000000000002);                                   // just past the tie
+        CHECK(parse("0.00000000000000000000000000000000000000001234") == 1.234e-41);
+        CHECK(parse("123456789012345678901234567890") == 123456789012345678901234567890.0);
+        CHECK(parse("1.7976931348623157e308") == 1.7976931348623157e308);
+        CHECK(parse("2.2250738585072014e-308") == 2.2250738585072014e-308);
+        CHECK(parse("2.2250738585072011e-308") == 2.2250738585072011e-308);    // subnormal
+        CHECK(parse("4.9e-324") == 4.9e-324);
+        CHECK(parse("1e-400") == 0.0);
+        CHECK(parse("1e400") == HUGE_VAL);
+        CHECK(parse("-1e100000000000") == -HUGE_VAL);
+        CHECK(parse("0e100000000000") == 0.0);
+
+        // Random doubles printed at assorted precisions agree with strtod:
+        std::mt19937_64 random(1234);
+        char buf[64];
+        for (int i = 0; i < 2000; ++i) {
+            uint64_t bits = random();
+            double d;
+            memcpy(&d, &bits, sizeof(d));
+            if (std::isnan(d) || std::isinf(d))
+                continue;
+            sprintf(buf, "%.*g", 1 + i % 18, d);
+            CHECK(parse(buf) == strtod(buf, nullptr));
+        }
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "JSONNumberOutput", "[Encoder]") {
+        enc.beginArray();
+        enc << 0 << -1 << 1234567890 << INT64_MIN << UINT64_MAX;
+        enc << 0.1 << -123.456 << 0.30000000000000004 << 1e-5 << 0.0001 << 6.02e23 << 1e100
+            << 123456789012345.6 << 1.7976931348623157e308 << 4.9e-324;
+        enc << 0.1f << 3.4028235e38f << 1.5f;
+        enc.endArray();
+        endEncoding();
+        auto a = checkArray(18);
+        CHECK(a->toJSON() == "[0,-1,1234567890,-9223372036854775808,18446744073709551615,"
+                             "0.1,-123.456,0.30000000000000004,1e-05,0.0001,6.02e+23,1e+100,"
+                             "123456789012345.6,1.7976931348623157e+308,5e-324,"
+                             "0.1,3.4028235e+38,1.5]"_sl);
+        CHECK(a->get(4)->toString() == "18446744073709551615"_sl);
+        CHECK(a->get(7)->toString() == "0.30000000000000004"_sl);
+        CHECK(a->get(15)->toString() == "0.1"_sl);
+
+        // Random doubles survive a round trip through JSON:
+        std::mt19937_64 random(5678);
+        for (int i = 0; i < 1000; ++i) {
+            uint64_t bits = random();
+            double d;
+            memcpy(&d, &bits, sizeof(d));
+            if (std::isnan(d) || std::isinf(d))
+                continue;
+            enc.reset();
+            enc.beginArray();
+            enc << d;
+            enc.endArray();
+            endEncoding();
+            alloc_slice json = checkArray(1)->toJSON();
+            INFO("JSON: " << std::string(json));
+            enc.reset();
+            JSONConverter j(enc);
+            REQUIRE(j.encodeJSON(json));
+            endEncoding();
+            CHECK(checkArray(1)->get(0)->asDouble() == d);
+        }
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "JSONStringOutput", "[Encoder]") {
+        auto escaped = [](const std::string &str) {
+            std::string json = "\"";
+            for (char c : str) {
+                switch (c) {
+                    case '"':   json += "\\\""; break;
+                    case '\\':  json += "\\\\"; break;
+                    case '\n':  json += "\\n"; break;
+                    case '\r':  json += "\\r"; break;
+                    case '\t':  json += "\\t"; break;
+                    case 0x01:  json += "\\u0001"; break;
+                    case 0x1F:  json += "\\u001f"; break;
+                    case 0x7F:  json += "\\u007f"; break;
+                    default:    json += c; break;
+                }
+            }
+            return json + "\"";
+        };
+        // Strings of many lengths, with a character that needs escaping at every position, so
+        // it's found in every lane of a vector and in the unaligned tail:
+        const char kSpecial[] = {'"', '\\', '\n', '\r', '\t', 0x01, 0x1F, 0x7F};
+        for (size_t length = 0; length <= 70; ++length) {
+            std::string plain;
+            for (size_t i = 0; i < length; ++i)
+                plain += (char)((i % 3 == 0) ? '\xC3' : 'a' + i % 26);   // (some bytes >127)
+            for (size_t pos = 0; pos <= length; ++pos) {
+                for (char special : kSpecial) {
+                    std::string str = plain;
+                    if (pos < length)
+                        str[pos] = special;
+                    JSONEncoder json;
+                    json.writeString(str);
+                    CHECK(std::string(json.extractOutput()) == escaped(str));
+                }
+            }
+        }
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "JSONDeepNesting", "[Encoder]") {
+        const size_t depth = JSONConverter::kMaxDepth;
+        std::string json = std::string(depth, '[') + std::string(depth, ']');
+        JSONConverter j(enc);
+        REQUIRE(j.encodeJSON(slice(json)));
+        endEncoding();
+        const Value *v = Value::fromData(result);
+        for (size_t i = 1; i < depth; ++i)
+            v = v->asArray()->get(0);
+        CHECK(v->asArray()->count() == 0);
+
+        json = "[" + json + "]";
+        CHECK(!j.encodeJSON(slice(json)));
+        CHECK(j.jsonError() == JSONConverter::kErrTooDeep);
+        CHECK(j.errorPos() == depth);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "JSONCanonical", "[Encoder]") {
+        // Shared keys get numbered out of alphabetical order:
+        SharedKeys sk;
+        sk.setMaxKeyLength(8);
+        int key;
+        for (const char *str : {"zeta", "mu", "beta", "alpha"})
+            REQUIRE(sk.encodeAndAdd(slice(str), key));
+
+        // Encodes a dict with the given keys, then checks that its canonical JSON has the keys
+        // in order:
+        auto check = [&](std::vector<std::string> keys, bool sortKeys) {
+            enc.setSharedKeys(&sk);
+            enc.sortKeys(sortKeys);
+            enc.beginDictionary();
+            for (auto &k : keys) {
+                enc.writeKey(k);
+                enc.writeString(k);
+            }
+            enc.endDictionary();
+            endEncoding();
+            std::sort(keys.begin(), keys.end());
+            std::string expected = "{";
+            for (auto &k : keys)
+                expected += (expected.size() > 1 ? ",\"" : "\"") + k + "\":\"" + k + "\"";
+            expected += "}";
+
+            JSONEncoder json;
+            json.setSharedKeys(&sk);
+            json.setCanonical(true);
+            json.writeValue(Value::fromData(result));
+            CHECK(std::string(json.extractOutput()) == expected);
+        };
+
+        check({}, true);
+        check({"zeta"}, true);
+        check({"mu", "zeta", "more than 8"}, true);                  // already in order
+        check({"zeta", "beta", "alpha", "mu"}, true);               // shared keys only
+        check({"zeta", "beta", "long key 1", "yet another key", "alpha", "long key 0"}, true);
+        check({"long key 1", "zeta", "long key 0", "alpha"}, false); // unsorted dict
+        // Too many items to sort on the stack:
+        std::vector<std::string> keys = {"zeta", "mu", "beta", "alpha"};
+        for (int i = 0; i < 100; ++i)
+            keys.push_back("long key " + std::to_string(i));
+        check(keys, true);
+        check(keys, false);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "JSONChunked", "[Encoder]") {
+        // Feeds the JSON in chunks of `chunkSize` bytes and returns the Fleece output:
+        auto convertChunked = [&](slice json, size_t chunkSize, JSONConverter &j) {
+            enc.reset();
+            bool ok = true;
+            for (size_t pos = 0; pos < json.size; pos += chunkSize)
+                ok = j.feed(json(pos, std::min(chunkSize, json.size - pos))) && ok;
+            ok = j.finish() && ok;
+            return ok ? enc.extractOutput() : alloc_slice();
+        };
+
+        std::string json = json5("{'foo':123, 'long key string':\"a \\\"quoted\\\" string\","
+                                 "'ironic':[null,false,true,-100,0,100,123.456,6.02e+23],"
+                                 "'':'hello\\nt\\\\here', 'u': '\\u00e9\\ud83d\\ude00',"
+                                 "'nested': [[], {}, [[{'x': [1]}]]]}");
+        alloc_slice expected = JSONConverter::convertJSON(slice(json));
+        JSONConverter j(enc);
+        for (size_t chunkSize = 1; chunkSize <= json.size(); ++chunkSize) {
+            INFO("chunk size " << chunkSize);
+            CHECK(convertChunked(slice(json), chunkSize, j) == expected);
+        }
+
+        alloc_slice people = readFile(kTestFilesDir "1000people.json");
+        expected = JSONConverter::convertJSON(people);
+        for (size_t chunkSize : {100, 1000, 4096, 65536})
+            CHECK(convertChunked(people, chunkSize, j) == expected);
+
+        // Errors are reported at the same position, however the input is split:
+        for (const char *bad : {"[1,2,,3]", "{\"a\":1,}", "[true, nul]", "[12ab]", "[\"a\\x\"]",
+                                "[\"tab\there\"]", "[1] [2]", "[1, [2, {\"a\":", "{\"a\":\"b", "123 4"}) {
+            INFO("JSON: " << bad);
+            enc.reset();
+            JSONConverter whole(enc);
+            REQUIRE(!whole.encodeJSON(slice(bad)));
+            for (size_t chunkSize = 1; chunkSize <= strlen(bad); ++chunkSize) {
+                INFO("chunk size " << chunkSize);
+                CHECK(!convertChunked(slice(bad), chunkSize, j));
+                CHECK(j.jsonError() == whole.jsonError());
+                CHECK(j.errorPos() == whole.errorPos());
+            }
+        }
+
+        // A scalar document can be split too:
+        for (size_t chunkSize = 1; chunkSize <= 5; ++chunkSize) {
+            alloc_slice data = convertChunked("12345"_sl, chunkSize, j);
+            REQUIRE(data);
+            CHECK(Value::fromData(data)->asInt() == 12345);
+        }
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "JSONLargeInput", "[Encoder]") {
+        // Input much larger than the converter indexes at once, with tokens cut off at the
+        // window edges, and strings longer than a window:
+        std::string longString, escapedLongString;
+        for (size_t i = 0; i < 200000; ++i) {
+            char c = (i % 1000 == 999) ? '"' : (char)('a' + i % 26);
+            longString += c;
+            if (c == '"')
+                escapedLongString += '\\';
+            escapedLongString += c;
+        }
+        std::string json = "[";
+        for (int i = 0; i < 20000; ++i) {
+            if (i == 5000 || i == 15000)
+                json += "\"" + escapedLongString + "\",";
+            json += "\"item " + std::to_string(i) + "\"," + std::to_string(i * 7) + ".25,";
+        }
+        json += "true]";
+
+        REQUIRE(JSONConverter(enc).encodeJSON(slice(json)));
+        endEncoding();
+        auto a = checkArray(40003);
+        CHECK(a->get(10000)->asString() == slice(longString));
+        CHECK(a->get(30001)->asString() == slice(longString));
+        CHECK(a->get(30002)->asString() == "item 15000"_sl);
+        CHECK(a->get(40001)->asDouble() == 139993.25);
+        CHECK(a->get(40002)->asBool() == true);
+
+        // Feeding it in small chunks gives the same result:
+        alloc_slice expected(result);
+        enc.reset();
+        JSONConverter j(enc);
+        slice input(json);
+        for (size_t pos = 0; pos < input.size; pos += 1000)
+            REQUIRE(j.feed(input(pos, std::min((size_t)1000, input.size - pos))));
+        REQUIRE(j.finish());
+        CHECK(enc.extractOutput() == expected);
+
+        // An error far into the input is reported at its position in the whole input:
+        json.insert(json.size() - 1, ",");
+        enc.reset();
+        JSONConverter bad(enc);
+        CHECK(!bad.encodeJSON(slice(json)));
+        CHECK(bad.jsonError() == JSONConverter::kErrSyntax);
+        CHECK(bad.errorPos() == json.size() - 1);
+
+        // Numbers and literals can be longer than a window too:
+        enc.reset();
+        REQUIRE(JSONConverter(enc).encodeJSON(slice("[1.5" + std::string(100000, '0') + "]")));
+        endEncoding();
+        CHECK(checkArray(1)->get(0)->asDouble() == 1.5);
+        enc.reset();
+        CHECK(!bad.encodeJSON(slice("[1, tru" + std::string(100000, 'e') + "]")));
+        CHECK(bad.jsonError() == JSONConverter::kErrSyntax);
+        CHECK(bad.errorPos() == 4);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "JSONParallel", "[Encoder]") {
+        alloc_slice json = readFile(kTestFilesDir "1000people.json");
+        REQUIRE(json.size >= JSONConverter::kMinParallelSize);
+        alloc_slice expected = JSONConverter::convertJSON(json);
+        for (unsigned threads : {2, 3, 8}) {
+            INFO("threads=" << threads);
+            JSONConverter j(enc);
+            REQUIRE(j.encodeJSONParallel(json, threads));
+            endEncoding();
+            auto people = Value::fromData(result)->asArray();
+            REQUIRE(people);
+            CHECK(people->count() == 1000);
+            CHECK(people->toJSON() == Value::fromData(expected)->toJSON());
+            enc.reset();
+        }
+
+        // The output is no larger than from encodeJSON. (Strings aren't uniqued, since the
+        // threads can't share their string tables.)
+        auto convertedSize = [&](unsigned threads) {
+            Encoder e;
+            e.uniqueStrings(false);
+            JSONConverter j(e);
+            REQUIRE((threads ? j.encodeJSONParallel(json, threads) : j.encodeJSON(json)));
+            return e.extractOutput().size;
+        };
+        size_t serialSize = convertedSize(0);
+        for (unsigned threads : {2, 3, 8})
+            CHECK(convertedSize(threads) <= serialSize);
+
+        // Errors are reported at the same place as by encodeJSON:
+        std::string bad((const char*)json.buf, json.size);
+        size_t nameKey = bad.find("\"name\"", bad.size() * 2 / 3);
+        std::vector<std::string> badJSON {
+            bad.substr(0, nameKey) + "name" + bad.substr(nameKey + 6),     // unquoted key
+            bad.substr(0, bad.rfind(']')) + ",]",                          // trailing comma
+            bad.substr(0, bad.rfind(']')) + ",{}] x",                      // trailing garbage
+        };
+        for (auto &badOne : badJSON) {
+            JSONConverter serial(enc);
+            REQUIRE(!serial.encodeJSON(slice(badOne)));
+            enc.reset();
+            JSONConverter parallel(enc);
+            CHECK(!parallel.encodeJSONParallel(slice(badOne), 4));
+            CHECK(parallel.jsonError() == serial.jsonError());
+            CHECK(parallel.errorPos() == serial.errorPos());
+            enc.reset();
+        }
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "NDJSON", "[Encoder]") {
+        // Make NDJSON out of 1000people, with some blank lines and CRLFs:
+        alloc_slice people = JSONConverter::convertJSON(readFile(kTestFilesDir "1000people.json"));
+        std::string ndjson;
+        std::vector<alloc_slice> expected;
+        for (Array::iterator i(Value::fromData(people)->asArray()); i; ++i) {
+            alloc_slice json = i.value()->toJSON();
+            ndjson.append((const char*)json.buf, json.size);
+            ndjson += (expected.size() % 10 == 3) ? "\r\n\n" : "\n";
+            expected.push_back(JSONConverter::convertJSON(json));
+        }
+        ndjson.pop_back();                                  // (the last line has no newline)
+
+        for (unsigned threads : {1, 3}) {
+            for (size_t batchSize : {(size_t)1000, NDJSONConverter::kDefaultBatchSize}) {
+                INFO("threads=" << threads << ", batchSize=" << batchSize);
+                std::string output;
+                NDJSONConverter cvt([&](slice out) {output.append((const char*)out.buf, out.size);},
+                                    threads, batchSize);
+                for (size_t pos = 0; pos < ndjson.size(); pos += 777)
+                    cvt.feed(slice(ndjson)(pos, std::min((size_t)777, ndjson.size() - pos)));
+                cvt.finish();
+
+                slice remaining(output);
+                for (auto &doc : expected)
+                    REQUIRE(NDJSONConverter::nextDocument(remaining) == doc);
+                CHECK(!NDJSONConverter::nextDocument(remaining));
+                CHECK(cvt.stats().records == 1000);
+                CHECK(cvt.stats().lines == 1100);
+                CHECK(cvt.stats().inputBytes == ndjson.size());
+                CHECK(cvt.stats().outputBytes == output.size());
+            }
+        }
+
+        // An invalid line is reported by number:
+        size_t badPos = ndjson.find("\n{", ndjson.size() / 2) + 1;
+        ndjson[badPos] = '[';
+        auto badLine = 1 + std::count(ndjson.begin(), ndjson.begin() + badPos, '\n');
+        NDJSONConverter cvt([](slice) { }, 2, 1000);
+        try {
+            cvt.feed(slice(ndjson));
+            cvt.finish();
+            FAIL("invalid NDJSON was accepted");
+        } catch (const FleeceException &x) {
+            CHECK(x.code == JSONError);
+            std::string suffix = " of line " + std::to_string(badLine);
+            std::string message = x.what();
+            CHECK(message.substr(message.size() - suffix.size()) == suffix);
+        }
+    }
+
     TEST_CASE_METHOD(EncoderTests, "JSONBinary", "[Encoder]") {
         enc.beginArray();
         enc.writeData(slice("not-really-binary"));
@@ -665,13 +1621,486 @@ public:
 
         fprintf(stderr, "\nJSON size: %zu bytes; Fleece size: %zu bytes (%.2f%%)\n",
                 input.size, result.size, (result.size*100.0/input.size));
-#ifndef NDEBUG
-        fprintf(stderr, "Narrow: %u, Wide: %u (total %u)\n", enc._numNarrow, enc._numWide, enc._numNarrow+enc._numWide);
-        fprintf(stderr, "Narrow count: %u, Wide count: %u (total %u)\n", enc._narrowCount, enc._wideCount, enc._narrowCount+enc._wideCount);
-        fprintf(stderr, "Used %u pointers to shared strings\n", enc._numSavedStrings);
+        auto &stats = enc.stats();
+        fprintf(stderr, "Narrow: %u, Wide: %u (total %u)\n",
+                (unsigned)stats.narrowCollections, (unsigned)stats.wideCollections,
+                (unsigned)(stats.narrowCollections + stats.wideCollections));
+        fprintf(stderr, "Narrow count: %u, Wide count: %u (total %u)\n",
+                (unsigned)stats.narrowItems, (unsigned)stats.wideItems,
+                (unsigned)(stats.narrowItems + stats.wideItems));
+        fprintf(stderr, "Used %u pointers to shared strings, saving %u bytes\n",
+                (unsigned)stats.savedStrings, (unsigned)stats.savedStringBytes);
+        fprintf(stderr, "Dicts already sorted: %u; key-order cache hits: %u, misses: %u (%.1f%% hit rate)\n",
+                (unsigned)stats.dictsPresorted, (unsigned)stats.dictShapeHits,
+                (unsigned)stats.dictShapeMisses,
+                stats.dictShapeHits * 100.0
+                    / std::max(uint64_t(1), stats.dictShapeHits + stats.dictShapeMisses));
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "StreamingEncoder", "[Encoder]") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+
+        alloc_slice expected;
+        {
+            JSONConverter jr(enc);
+            REQUIRE(jr.encodeJSON(input));
+            endEncoding();
+            expected = Value::fromData(result)->toJSON();
+        }
+
+        std::string streamed;
+        int nFlushes = 0;
+        Encoder streamer([&](slice data) {
+            streamed.append((const char*)data.buf, data.size);
+            ++nFlushes;
+        });
+        JSONConverter jr(streamer);
+        REQUIRE(jr.encodeJSON(input));
+        REQUIRE(!streamer.extractOutput());
+
+        REQUIRE(nFlushes > 1);
+        auto root = Value::fromData(slice(streamed));
+        REQUIRE(root);
+        REQUIRE(root->toJSON() == expected);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "StreamingEncoderNumbers", "[Encoder]") {
+        // Out-of-line numbers have to trigger flushes too, not just strings and collections:
+        static constexpr size_t kCount = 200000, kThreshold = 64 * 1024;
+        std::string streamed;
+        Encoder streamer([&](slice data) {
+            streamed.append((const char*)data.buf, data.size);
+        });
+        size_t maxBuffered = 0;
+        streamer.beginArray();
+        for (size_t i = 0; i < kCount; ++i) {
+            streamer.writeDouble(i + 0.1);
+            streamer.writeInt(i << 20);
+            maxBuffered = std::max(maxBuffered, streamer.bytesWritten() - streamed.size());
+        }
+        streamer.endArray();
+        REQUIRE(!streamer.extractOutput());
+
+        CHECK(maxBuffered <= 2 * kThreshold);
+        auto root = Value::fromData(slice(streamed))->asArray();
+        REQUIRE(root);
+        REQUIRE(root->count() == 2 * kCount);
+        for (size_t i = 0; i < kCount; i += 997) {
+            CHECK(root->get(uint32_t(2*i))->asDouble() == i + 0.1);
+            CHECK(root->get(uint32_t(2*i + 1))->asInt() == int64_t(i << 20));
+        }
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "StreamingJSONEncoder", "[Encoder]") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        JSONConverter jr(enc);
+        REQUIRE(jr.encodeJSON(input));
+        endEncoding();
+        auto root = Value::fromData(result);
+        alloc_slice expected = root->toJSON();
+
+        for (size_t threshold : {(size_t)1, (size_t)1000, JSONEncoder::kDefaultFlushThreshold}) {
+            std::string streamed;
+            size_t nFlushes = 0, maxFlush = 0;
+            JSONEncoder json([&](slice data) {
+                streamed.append((const char*)data.buf, data.size);
+                ++nFlushes;
+                maxFlush = std::max(maxFlush, data.size);
+            });
+            REQUIRE(json.flushThreshold() == JSONEncoder::kDefaultFlushThreshold);
+            json.setFlushThreshold(threshold);
+            json.writeValue(root);
+            REQUIRE(!json.extractOutput());
+            CHECK(streamed == std::string(expected));
+            CHECK(json.bytesWritten() == expected.size);
+            // No flush is much bigger than the threshold (the longest string in the input is
+            // under 1000 bytes), so memory use doesn't grow with the size of the output:
+            CHECK(nFlushes >= expected.size / (threshold + 1000));
+            CHECK(maxFlush < threshold + 1000);
+        }
+
+        // A non-streaming encoder ignores the threshold:
+        JSONEncoder json;
+        json.setFlushThreshold(1);
+        CHECK(json.flushThreshold() == SIZE_MAX);
+        json.writeValue(root);
+        CHECK(json.extractOutput() == expected);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "ParallelToJSON", "[Encoder]") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        SharedKeys sk;
+        enc.setSharedKeys(&sk);
+        JSONConverter jr(enc);
+        REQUIRE(jr.encodeJSON(input));
+        endEncoding();
+        auto people = Value::fromData(result);
+        REQUIRE(people->asArray()->count() >= JSONEncoder::kMinParallelCount);
+
+        for (unsigned threads : {1u, 2u, 3u, 8u, 2000u}) {
+            INFO("threads=" << threads);
+            CHECK(people->toJSONParallel(&sk, false, threads) == people->toJSON(&sk));
+            CHECK(people->toJSONParallel(&sk, true, threads) == people->toJSON(&sk, true));
+            CHECK(people->toJSONParallel<5>(&sk, false, threads) == people->toJSON<5>(&sk));
+
+            // Streamed, inside another array:
+            std::string streamed;
+            JSONEncoder json([&](slice data) {
+                streamed.append((const char*)data.buf, data.size);
+            });
+            json.setSharedKeys(&sk);
+            json.setFlushThreshold(1000);
+            json.beginArray();
+            json.writeValueParallel(people, threads);
+            json.writeValueParallel(people->asArray()->get(0), threads);
+            json.endArray();
+            json.flush();
+            CHECK(streamed == "[" + std::string(people->toJSON(&sk)) + ","
+                                  + std::string(people->asArray()->get(0)->toJSON(&sk)) + "]");
+        }
+
+        // Small arrays are converted serially:
+        enc.beginArray();
+        enc.writeInt(1);
+        enc.writeString("two");
+        enc.endArray();
+        endEncoding();
+        CHECK(Value::fromData(result)->toJSONParallel(nullptr, false, 4) == "[1,\"two\"]"_sl);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "ZeroCopyOutput", "[Encoder]") {
+        // A single heap chunk is handed over without copying:
+        Writer w(1000);
+        std::string data(900, 'x');
+        const void *pos = w.write(slice(data));
+        alloc_slice out = w.extractOutput();
+        REQUIRE(out == slice(data));
+        REQUIRE(out.buf == pos);
+        w << slice("again");
+        REQUIRE(w.extractOutput() == slice("again"));
+
+        // Encoding into a caller-provided buffer:
+        uint8_t buffer[100];
+        Encoder bufEnc(slice(buffer, sizeof(buffer)));
+        bufEnc.beginArray();
+        bufEnc.writeString("hello");
+        bufEnc.writeInt(12345);
+        bufEnc.endArray();
+        bufEnc.end();
+        auto root = Value::fromData(slice(buffer, bufEnc.bytesWritten()));
+        REQUIRE(root);
+        REQUIRE(root->toJSON() == "[\"hello\",12345]"_sl);
+
+        Encoder smallEnc(slice(buffer, 8));
+        try {
+            smallEnc.writeString("this string is too long");
+            FAIL("output larger than the buffer was accepted");
+        } catch (const FleeceException &x) {
+            CHECK(x.code == MemoryError);
+        }
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "WriterReset", "[Encoder]") {
+        // A huge document, written in pieces and then all at once, doesn't stop the Writer
+        // from being reused:
+        std::string big(4000000, 'x');
+        Writer w;
+        for (size_t i = 0; i < big.size(); i += 1000)
+            w << slice(&big[i], 1000);
+        CHECK(w.contiguousOutput() == slice(big));
+        w.reset();
+        w << slice(big);
+        w.reset();
+        CHECK(w.length() == 0);
+        w << slice("small");
+        CHECK(w.extractOutput() == slice("small"));
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "WriterMove", "[Encoder]") {
+        // Output in the inline buffer moves along with the Writer:
+        Writer small;
+        small << slice("hello");
+        Writer w(std::move(small));
+        w << slice(" there");
+        CHECK(w.extractOutput() == slice("hello there"));
+        small.reset();
+        small << slice("again");
+        CHECK(small.extractOutput() == slice("again"));
+
+        // Assignment frees the target's output and takes over the source's chunks:
+        std::string big(5000, 'x');
+        Writer large;
+        large << slice(big);
+        w << slice("discarded");
+        w = std::move(large);
+        w << slice("!");
+        CHECK(w.extractOutput() == slice(big + "!"));
+
+        // So does the streaming output:
+        std::string streamed;
+        Writer streamer([&](slice data) {streamed.append((const char*)data.buf, data.size);});
+        streamer << slice("streamed");
+        w = std::move(streamer);
+        CHECK(w.isStreaming());
+        CHECK(!streamer.isStreaming());
+        w.flush();
+        CHECK(streamed == "streamed");
+
+#ifndef _MSC_VER
+        // And the memory-mapped file:
+        const char *path = kTestFilesDir "writer_move.tmp";
+        {
+            Writer mapped(path);
+            mapped << slice(big);
+            Writer moved(std::move(mapped));
+            CHECK(moved.isMappedFile());
+            CHECK(!mapped.isMappedFile());
+            moved << slice("!");
+        }
+        {
+            mmap_slice file(path);
+            CHECK(file == slice(big + "!"));
+        }
+        remove(path);
 #endif
     }
 
+    TEST_CASE_METHOD(EncoderTests, "WriteEncoded", "[Encoder]") {
+        Encoder child;
+        child.beginDictionary();
+        child.writeKey("greeting");
+        child.writeString("hello there");
+        child.writeKey("n");
+        child.writeInt(123456);
+        child.endDictionary();
+        alloc_slice dict = child.extractOutput();
+
+        child.reset();
+        child.writeInt(7);
+        alloc_slice seven = child.extractOutput();
+
+        enc.beginArray();
+        enc.writeString("hello there");
+        enc.writeEncoded(dict);
+        enc.writeEncoded(seven);
+        enc.writeEncoded(dict);
+        enc.endArray();
+        endEncoding();
+        auto root = Value::fromData(result);
+        REQUIRE(root);
+        REQUIRE(root->toJSON() == "[\"hello there\",{\"greeting\":\"hello there\",\"n\":123456},"
+                                  "7,{\"greeting\":\"hello there\",\"n\":123456}]"_sl);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "CopySubtrees", "[Encoder]") {
+        alloc_slice people = JSONConverter::convertJSON(readFile(kTestFilesDir "1000people.json"));
+        auto peopleArray = Value::fromData(people)->asArray();
+        REQUIRE(peopleArray);
+
+        // Copy every other person; their dicts are copied whole, keys and all:
+        enc.beginArray();
+        for (Array::iterator i(peopleArray); i; i += 2)
+            enc.writeValue(i.value());
+        enc.endArray();
+        CHECK(enc.stats().subtreesCopied == (peopleArray->count() + 1) / 2);
+        endEncoding();
+        auto root = Value::fromData(result);    // validates the data
+        REQUIRE(root);
+        REQUIRE(root->asArray()->count() == (peopleArray->count() + 1) / 2);
+        for (uint32_t i = 0; i < root->asArray()->count(); ++i)
+            REQUIRE(root->asArray()->get(i)->toJSON() == peopleArray->get(2*i)->toJSON());
+
+        // A dict whose keys aren't sorted has to be re-encoded:
+        enc.reset();
+        enc.sortKeys(false);
+        enc.beginDictionary();
+        enc.writeKey("zebra");
+        enc.writeString("a long string value");
+        enc.writeKey("aardvark");
+        enc.writeString("another long string value");
+        enc.endDictionary();
+        alloc_slice unsorted = enc.extractOutput();
+        enc.reset();
+        enc.sortKeys(true);
+        enc.beginArray();
+        enc.writeValue(Value::fromData(unsorted));
+        enc.endArray();
+        CHECK(enc.stats().subtreesCopied == (peopleArray->count() + 1) / 2);
+        endEncoding();
+        REQUIRE(Value::fromData(result)->toJSON() ==
+                "[{\"aardvark\":\"another long string value\",\"zebra\":\"a long string value\"}]"_sl);
+
+        // A narrow pointer to a string written far earlier doesn't fit, so the dict is re-encoded:
+        alloc_slice people2 = JSONConverter::convertJSON(
+                        "[\"Fred Fleece\",\"something else entirely\",{\"name\":\"Fred Fleece\"}]"_sl);
+        enc.reset();
+        enc.beginArray();
+        enc.writeString("Fred Fleece");
+        std::string padding(70000, '.');
+        enc.writeString(padding);
+        enc.writeValue(Value::fromData(people2)->asArray()->get(2));
+        enc.endArray();
+        CHECK(enc.stats().subtreesCopied == (peopleArray->count() + 1) / 2);
+        endEncoding();
+        root = Value::fromData(result);
+        REQUIRE(root);
+        REQUIRE(root->asArray()->get(2)->toJSON() == "{\"name\":\"Fred Fleece\"}"_sl);
+
+        // ...and when that's found out, nothing has been copied yet. (Here the double is shared
+        // in the source, so it's outside the dict and would be copied ahead of it.)
+        Encoder src;
+        src.uniqueNumbers(true);
+        src.beginArray();
+        src.writeString("Fred Fleece");
+        src.writeDouble(3.14159);
+        src.writeString("something else entirely");
+        src.beginDictionary();
+        src.writeKey("name");
+        src.writeString("Fred Fleece");
+        src.writeKey("pi");
+        src.writeDouble(3.14159);
+        src.endDictionary();
+        src.endArray();
+        alloc_slice people3 = src.extractOutput();
+        auto writeWith = [&](std::function<void()> writeDict) {
+            enc.reset();
+            enc.beginArray();
+            enc.writeString("Fred Fleece");
+            enc.writeString(padding);
+            writeDict();
+            enc.endArray();
+            endEncoding();
+            return result;
+        };
+        alloc_slice copied = writeWith([&]{
+            enc.writeValue(Value::fromData(people3)->asArray()->get(3));
+        });
+        alloc_slice encoded = writeWith([&]{
+            enc.beginDictionary();
+            enc.writeKey("name");
+            enc.writeString("Fred Fleece");
+            enc.writeKey("pi");
+            enc.writeDouble(3.14159);
+            enc.endDictionary();
+        });
+        CHECK(copied.size == encoded.size);
+        CHECK((copied == encoded));
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "WriteParallel", "[Encoder]") {
+        alloc_slice people = JSONConverter::convertJSON(readFile(kTestFilesDir "1000people.json"));
+        auto peopleArray = Value::fromData(people)->asArray();
+        REQUIRE(peopleArray);
+
+        enc.beginArray();
+        enc.writeParallel(peopleArray->count(), [&](Encoder &child, size_t i) {
+            child.writeValue(peopleArray->get((uint32_t)i));
+        }, 4);
+        enc.endArray();
+        endEncoding();
+        auto root = Value::fromData(result);    // validates the data
+        REQUIRE(root);
+        REQUIRE(root->asArray()->count() == peopleArray->count());
+        REQUIRE(root->toJSON() == peopleArray->toJSON());
+
+        // The output is no larger than a serial encoding of the items. (Strings aren't uniqued,
+        // since the children can't share their string tables.)
+        auto encodeItems = [&](unsigned threads) {
+            Encoder e;
+            e.uniqueStrings(false);
+            e.beginArray();
+            if (threads == 0) {
+                for (Array::iterator i(peopleArray); i; ++i)
+                    e.writeValue(i.value());
+            } else {
+                e.writeParallel(peopleArray->count(), [&](Encoder &child, size_t i) {
+                    child.writeValue(peopleArray->get((uint32_t)i));
+                }, threads);
+            }
+            e.endArray();
+            return e.extractOutput().size;
+        };
+        size_t serialSize = encodeItems(0);
+        for (unsigned threads : {2, 4, 8})
+            CHECK(encodeItems(threads) <= serialSize);
+
+        // Errors in the item encoder are rethrown:
+        enc.reset();
+        enc.beginArray();
+        try {
+            enc.writeParallel(10, [&](Encoder &child, size_t i) {
+                if (i == 7)
+                    child.endDictionary();
+                child.writeInt(i);
+            });
+            FAIL("error in the item encoder wasn't rethrown");
+        } catch (const FleeceException &x) {
+            CHECK(x.code == EncodeError);
+        }
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "EncoderPool", "[Encoder]") {
+        EncoderPool pool(2);
+        Encoder *e1 = pool.acquire();
+        e1->sortKeys(false);
+        e1->beginDictionary();
+        e1->writeKey("b");
+        e1->writeInt(1);
+        e1->writeKey("a");
+        pool.release(e1);                   // abandoned in mid-document
+        REQUIRE(pool.count() == 1);
+
+        Encoder *e2 = pool.acquire();
+        REQUIRE(e2 == e1);
+        REQUIRE(pool.count() == 0);
+        e2->beginDictionary();
+        e2->writeKey("b");
+        e2->writeInt(1);
+        e2->writeKey("a");
+        e2->writeInt(2);
+        e2->endDictionary();
+        slice out = e2->finishInPlace();
+        REQUIRE(Value::fromData(out)->toJSON() == "{\"a\":2,\"b\":1}"_sl);  // sorted again
+
+        Encoder *e3 = pool.acquire();
+        REQUIRE(e3 != e2);
+        pool.release(e2);
+        pool.release(e3);
+        REQUIRE(pool.count() == 2);
+    }
+
+#ifndef _MSC_VER
+    TEST_CASE_METHOD(EncoderTests, "EncodeToMappedFile", "[Encoder]") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        alloc_slice expected;
+        {
+            JSONConverter jr(enc);
+            REQUIRE(jr.encodeJSON(input));
+            endEncoding();
+            expected = Value::fromData(result)->toJSON();
+        }
+
+        const char *path = kTestFilesDir "1000people_mapped.fleece";
+        size_t size;
+        {
+            Encoder mapped(path);
+            JSONConverter jr(mapped);
+            REQUIRE(jr.encodeJSON(input));
+            mapped.end();
+            size = mapped.bytesWritten();
+            REQUIRE(size > 0);
+        }
+        {
+            mmap_slice doc(path);
+            REQUIRE(doc.size == size);
+            auto root = Value::fromData(doc);
+            REQUIRE(root);
+            REQUIRE(root->toJSON() == expected);
+        }
+        remove(path);
+    }
+#endif
+
     TEST_CASE_METHOD(EncoderTests, "FindPersonByIndexUnsorted", "[Encoder]") {
         mmap_slice doc(kTestFilesDir "1000people.fleece");
         auto root = Value::fromTrustedData(doc)->asArray();
@@ -18,10 +18,15 @@
 
 #include "FleeceTests.hh"
 #include "Fleece.hh"
+#include "Fleece.h"
 #include "JSONConverter.hh"
+#include "JSONEncoder.hh"
 #include "varint.hh"
 #include <assert.h>
+#include <atomic>
 #include <chrono>
+#include <new>
+#include <random>
 #include <thread>
 #ifndef _MSC_VER
 #include <unistd.h>
@@ -45,6 +50,45 @@ using namespace fleece;
 
 static const bool kSortKeys = true;
 
+
+// Counts heap allocations made through operator new (which includes alloc_slice and the STL),
+// but only while an AllocationCounter exists, so other tests aren't affected.
+static std::atomic<bool> sCountAllocations {false};
+static std::atomic<size_t> sNumAllocations {0};
+
+struct AllocationCounter {
+    AllocationCounter()     {sNumAllocations = 0; sCountAllocations = true;}
+    ~AllocationCounter()    {sCountAllocations = false;}
+    size_t count() const    {return sNumAllocations;}
+};
+
+static void* countedAlloc(size_t size) noexcept {
+    if (sCountAllocations)
+        ++sNumAllocations;
+    return malloc(size ? size : 1);
+}
+
+static void* countedAllocOrThrow(size_t size) {
+    void *p = countedAlloc(size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size)                                   {return countedAllocOrThrow(size);}
+void* operator new[](size_t size)                                 {return countedAllocOrThrow(size);}
+void* operator new(size_t size, const std::nothrow_t&) noexcept   {return countedAlloc(size);}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {return countedAlloc(size);}
+void operator delete(void *p) noexcept                            {free(p);}
+void operator delete[](void *p) noexcept                          {free(p);}
+void operator delete(void *p, const std::nothrow_t&) noexcept     {free(p);}
+void operator delete[](void *p, const std::nothrow_t&) noexcept   {free(p);}
+#ifdef __cpp_sized_deallocation
+void operator delete(void *p, size_t) noexcept                    {free(p);}
+void operator delete[](void *p, size_t) noexcept                  {free(p);}
+#endif
+// (The aligned forms, from C++17, are left alone; Fleece doesn't over-align anything.)
+
 TEST_CASE("GetUVarint performance", "[.Perf]") {
     static constexpr int kNRounds = 10000000;
     Benchmark bench;
@@ -98,12 +142,672 @@ TEST_CASE("Perf Convert1000People", "[.Perf]") {
         std::this_thread::sleep_for(std::chrono::microseconds(100));
     }
     bench.printReport();
+    fprintf(stderr, "That's %.0f MB/sec of JSON\n", input.size / bench.median() / 1.0e6);
 
     fprintf(stderr, "\nJSON size: %zu bytes; Fleece size: %zu bytes (%.2f%%)\n",
             input.size, lastResult.size, (lastResult.size*100.0/input.size));
     writeToFile(lastResult, kTestFilesDir "1000people.fleece");
 }
 
+// Synthetic telemetry: 20,000 readings of mostly floating-point numbers, at the precisions
+// instruments and doubles print at.
+static std::string floatTelemetryJSON() {
+    std::mt19937_64 random(1234);
+    std::uniform_real_distribution<double> uniform(-1000.0, 1000.0);
+    std::string json = "[";
+    char buf[400];
+    for (int i = 0; i < 20000; ++i) {
+        sprintf(buf, "%s{\"t\":%.3f,\"lat\":%.6f,\"lon\":%.6f,\"temp\":%.2f,"
+                     "\"v\":[%.17g,%.17g,%.17g,%.9e]}",
+                (i ? "," : ""), 1.5e9 + i * 0.25, uniform(random) / 11, uniform(random) / 5.5,
+                uniform(random) / 20, uniform(random), uniform(random) * 1e-8,
+                uniform(random) * 1e12, uniform(random));
+        json += buf;
+    }
+    json += "]";
+    return json;
+}
+
+TEST_CASE("Perf ConvertFloats", "[.Perf]") {
+    static const int kSamples = 100;
+    std::string json = floatTelemetryJSON();
+    slice input(json);
+
+    Benchmark bench;
+    for (int i = 0; i < kSamples; i++) {
+        bench.start();
+        {
+            Encoder e(input.size);
+            JSONConverter jr(e);
+            REQUIRE(jr.encodeJSON(input));
+            e.end();
+            auto result = e.extractOutput();
+        }
+        bench.stop();
+    }
+    bench.printReport();
+    fprintf(stderr, "That's %.0f MB/sec of JSON\n", input.size / bench.median() / 1.0e6);
+}
+
+TEST_CASE("Perf FloatsToJSON", "[.Perf]") {
+    static const int kSamples = 100;
+    std::string json = floatTelemetryJSON();
+    alloc_slice doc = JSONConverter::convertJSON(slice(json));
+    const Value *root = Value::fromData(doc);
+    REQUIRE(root);
+
+    Benchmark bench;
+    size_t outputSize = 0;
+    for (int i = 0; i < kSamples; i++) {
+        bench.start();
+        {
+            alloc_slice output = root->toJSON();
+            outputSize = output.size;
+        }
+        bench.stop();
+    }
+    bench.printReport();
+    fprintf(stderr, "JSON size: %zu bytes (originally %zu); that's %.0f MB/sec\n",
+            outputSize, json.size(), outputSize / bench.median() / 1.0e6);
+}
+
+TEST_CASE("Perf LongStringsToJSON", "[.Perf]") {
+    static const int kSamples = 100;
+    // 2,000 documents with text fields of 1-8KB: prose with an occasional quote or newline.
+    std::mt19937_64 random(1234);
+    static const char* const kWords[] = {"the ", "quick ", "brown ", "fox ", "jumps ", "over ",
+                                         "lazy ", "dogs ", "\"quoted\" ", "caf\xC3\xA9 ",
+                                         "line\n", "and "};
+    Encoder enc;
+    enc.beginArray();
+    for (int i = 0; i < 2000; ++i) {
+        std::string text;
+        size_t length = 1024 + random() % 7168;
+        while (text.size() < length) {
+            size_t word = random() % 64;
+            text += kWords[word < 56 ? word % 8 : 8 + word % 4];
+        }
+        enc.beginDictionary();
+        enc.writeKey("id");
+        enc.writeInt(i);
+        enc.writeKey("body");
+        enc.writeString(text);
+        enc.endDictionary();
+    }
+    enc.endArray();
+    alloc_slice doc = enc.extractOutput();
+    const Value *root = Value::fromData(doc);
+    REQUIRE(root);
+
+    Benchmark bench;
+    size_t outputSize = 0;
+    for (int i = 0; i < kSamples; i++) {
+        bench.start();
+        {
+            alloc_slice output = root->toJSON();
+            outputSize = output.size;
+        }
+        bench.stop();
+    }
+    bench.printReport();
+    fprintf(stderr, "JSON size: %zu bytes; that's %.0f MB/sec\n",
+            outputSize, outputSize / bench.median() / 1.0e6);
+}
+
+TEST_CASE("Perf StreamJSON", "[.Perf]") {
+    static const int kSamples = 20;
+    // 20 copies of the 1000 people, written as JSON to memory and streamed to a file:
+    alloc_slice people = readFile(kTestFilesDir "1000people.json");
+    Encoder enc;
+    enc.beginArray();
+    for (int copy = 0; copy < 20; ++copy) {
+        JSONConverter jr(enc);
+        REQUIRE(jr.encodeJSON(people));
+    }
+    enc.endArray();
+    alloc_slice doc = enc.extractOutput();
+    const Value *root = Value::fromData(doc);
+    REQUIRE(root);
+
+    FILE *out = tmpfile();
+    REQUIRE(out);
+    for (bool streaming : {false, true}) {
+        Benchmark bench;
+        size_t outputSize = 0;
+        for (int i = 0; i < kSamples; i++) {
+            rewind(out);
+            bench.start();
+            if (streaming) {
+                REQUIRE(FLValue_WriteJSON((FLValue)root, nullptr, false, false, out, nullptr));
+                fflush(out);
+                outputSize = (size_t)ftell(out);
+            } else {
+                alloc_slice output = root->toJSON();
+                outputSize = output.size;
+            }
+            bench.stop();
+        }
+        fprintf(stderr, "%s %zu bytes of JSON: ", (streaming ? "Streaming" : "Building"),
+                outputSize);
+        bench.printReport();
+        fprintf(stderr, "That's %.0f MB/sec\n", outputSize / bench.median() / 1.0e6);
+    }
+    fclose(out);
+}
+
+TEST_CASE("Perf ParallelToJSON", "[.Perf]") {
+    static const int kSamples = 20;
+    // An array of 20 copies of the 1000 people:
+    alloc_slice people = readFile(kTestFilesDir "1000people.json");
+    Encoder enc;
+    enc.beginArray();
+    for (int copy = 0; copy < 20; ++copy) {
+        JSONConverter jr(enc);
+        REQUIRE(jr.encodeJSON(people));
+    }
+    enc.endArray();
+    alloc_slice doc = enc.extractOutput();
+    const Value *root = Value::fromData(doc);
+    REQUIRE(root);
+    alloc_slice expected = root->toJSON();
+
+    for (unsigned threads : {1u, 2u, 4u, std::max(std::thread::hardware_concurrency(), 1u)}) {
+        Benchmark bench;
+        for (int i = 0; i < kSamples; i++) {
+            bench.start();
+            alloc_slice output = root->toJSONParallel(nullptr, false, threads);
+            bench.stop();
+            REQUIRE(output == expected);
+        }
+        fprintf(stderr, "Writing %zu bytes of JSON on %u thread(s): ", expected.size, threads);
+        bench.printReport();
+        fprintf(stderr, "That's %.0f MB/sec\n", expected.size / bench.median() / 1.0e6);
+    }
+}
+
+TEST_CASE("Perf CanonicalJSON", "[.Perf]") {
+    static const int kSamples = 200;
+    // Hashes the canonical JSON of each of the 1000 people, as for content addressing; first
+    // with plain string keys, then with shared keys (which aren't numbered in alphabetical order.)
+    alloc_slice input = readFile(kTestFilesDir "1000people.json");
+    for (bool useSharedKeys : {false, true}) {
+        SharedKeys sk;
+        Encoder enc;
+        if (useSharedKeys)
+            enc.setSharedKeys(&sk);
+        JSONConverter jr(enc);
+        REQUIRE(jr.encodeJSON(input));
+        alloc_slice doc = enc.extractOutput();
+        const Array *people = Value::fromData(doc)->asArray();
+        REQUIRE(people);
+
+        uint64_t hash = 0;
+        JSONEncoder json([&](slice output) {
+            for (size_t i = 0; i < output.size; ++i)
+                hash = (hash ^ output[i]) * 0x100000001b3;      // (FNV-1a)
+        });
+        json.setSharedKeys(&sk);
+        json.setCanonical(true);
+
+        Benchmark bench;
+        AllocationCounter allocations;
+        size_t allocs = 0;
+        for (int i = 0; i < kSamples; i++) {
+            size_t startAllocs = allocations.count();
+            bench.start();
+            for (Array::iterator person(people); person; ++person) {
+                hash = 0xcbf29ce484222325;
+                json.reset();
+                json.writeValue(person.value());
+                json.flush();
+            }
+            bench.stop();
+            allocs += allocations.count() - startAllocs;
+        }
+        fprintf(stderr, "%s keys: ", (useSharedKeys ? "Shared" : "String"));
+        bench.printReport();
+        fprintf(stderr, "That's %.0f documents/sec; %.2f allocations per document\n",
+                people->count() / bench.median(), allocs / (double)kSamples / people->count());
+    }
+}
+
+TEST_CASE("Perf ConvertEscapedStrings", "[.Perf]") {
+    static const int kSamples = 100;
+    // Each of the 1000 people, serialized as JSON and embedded as a string in another JSON
+    // document, next to an HTML fragment: both are full of escaped quotes and newlines.
+    alloc_slice people = readFile(kTestFilesDir "1000people.json");
+    alloc_slice peopleFleece = JSONConverter::convertJSON(people);
+    const Array *peopleArray = Value::fromData(peopleFleece)->asArray();
+    JSONEncoder json;
+    json.beginArray();
+    unsigned n = 0;
+    for (Array::iterator i(peopleArray); i; ++i, ++n) {
+        json.beginDictionary();
+        json.writeKey("json");
+        json.writeString(i.value()->toJSON());
+        json.writeKey("html");
+        json.writeString("<div class=\"person\">\n  <a href=\"/people/"
+                         + std::to_string(n) + "\">\n    "
+                         + std::string(i.value()->asDict()->get("name"_sl)->asString())
+                         + "\n  </a>\n</div>\n");
+        json.endDictionary();
+    }
+    json.endArray();
+    alloc_slice input = json.extractOutput();
+
+    Benchmark bench;
+    for (int i = 0; i < kSamples; i++) {
+        bench.start();
+        {
+            Encoder e(input.size);
+            JSONConverter jr(e);
+            REQUIRE(jr.encodeJSON(input));
+            e.end();
+            auto result = e.extractOutput();
+        }
+        bench.stop();
+    }
+    bench.printReport();
+    fprintf(stderr, "That's %.0f MB/sec of JSON\n", input.size / bench.median() / 1.0e6);
+}
+
+TEST_CASE("Perf Convert1000People chunked", "[.Perf]") {
+    static const int kSamples = 200;
+    alloc_slice input = readFile(kTestFilesDir "1000people.json");
+
+    for (size_t chunkSize : {1024, 16384, 65536}) {
+        Benchmark bench;
+        for (int i = 0; i < kSamples; i++) {
+            bench.start();
+            {
+                Encoder e(input.size);
+                e.uniqueStrings(true);
+                e.sortKeys(kSortKeys);
+                JSONConverter jr(e);
+                for (size_t pos = 0; pos < input.size; pos += chunkSize)
+                    jr.feed(input(pos, std::min(chunkSize, input.size - pos)));
+                REQUIRE(jr.finish());
+                e.end();
+                auto result = e.extractOutput();
+            }
+            bench.stop();
+        }
+        fprintf(stderr, "Feeding %zu-byte chunks: ", chunkSize);
+        bench.printReport();
+    }
+}
+
+TEST_CASE("Perf ConvertJSON parallel", "[.Perf]") {
+    static const int kSamples = 20;
+    // A 26MB array, of 20 copies of the 1000 people:
+    alloc_slice people = readFile(kTestFilesDir "1000people.json");
+    std::string items((const char*)people.buf, people.size);
+    items = items.substr(1, items.rfind(']') - 1);
+    std::string json = "[";
+    for (int copy = 0; copy < 20; ++copy) {
+        if (copy > 0)
+            json += ',';
+        json += items;
+    }
+    json += ']';
+
+    for (unsigned threads : {1u, 2u, 4u, std::max(std::thread::hardware_concurrency(), 1u)}) {
+        Benchmark bench;
+        for (int i = 0; i < kSamples; i++) {
+            bench.start();
+            Encoder e;
+            JSONConverter jr(e);
+            REQUIRE(jr.encodeJSONParallel(slice(json), threads));
+            e.extractOutput();
+            bench.stop();
+        }
+        fprintf(stderr, "Converting %zu bytes on %u thread(s): ", json.size(), threads);
+        bench.printReport();
+        fprintf(stderr, "That's %.0f MB/sec of JSON\n", json.size() / bench.median() / 1.0e6);
+    }
+}
+
+TEST_CASE("Perf NDJSON", "[.Perf]") {
+    static const int kSamples = 20;
+    alloc_slice people = JSONConverter::convertJSON(readFile(kTestFilesDir "1000people.json"));
+    std::string ndjson;
+    for (int copy = 0; copy < 10; ++copy) {
+        for (Array::iterator i(Value::fromData(people)->asArray()); i; ++i) {
+            alloc_slice json = i.value()->toJSON();
+            ndjson.append((const char*)json.buf, json.size);
+            ndjson += '\n';
+        }
+    }
+
+    Benchmark serial;
+    for (int i = 0; i < kSamples; i++) {
+        serial.start();
+        size_t pos = 0;
+        while (pos < ndjson.size()) {
+            size_t eol = ndjson.find('\n', pos);
+            JSONConverter::convertJSON(slice(ndjson)(pos, eol - pos));
+            pos = eol + 1;
+        }
+        serial.stop();
+    }
+    fprintf(stderr, "One convertJSON call per line: ");
+    serial.printReport();
+
+    for (unsigned threads : {1u, std::max(std::thread::hardware_concurrency(), 1u)}) {
+        Benchmark bench;
+        for (int i = 0; i < kSamples; i++) {
+            bench.start();
+            NDJSONConverter cvt([](slice) { }, threads);
+            for (size_t pos = 0; pos < ndjson.size(); pos += 65536)
+                cvt.feed(slice(ndjson)(pos, std::min((size_t)65536, ndjson.size() - pos)));
+            cvt.finish();
+            bench.stop();
+        }
+        fprintf(stderr, "NDJSONConverter with %u thread(s): ", threads);
+        bench.printReport();
+        fprintf(stderr, "That's %.0f MB/sec of NDJSON\n", ndjson.size() / bench.median() / 1.0e6);
+    }
+}
+
+TEST_CASE("Perf DedupThresholds", "[.Perf]") {
+    static const int kSamples = 100;
+    alloc_slice input = readFile(kTestFilesDir "1000people.json");
+
+    struct config {const char *name; size_t maxSharedStringSize; bool numbers, collections;};
+    static const config kConfigs[] = {
+        {"no unique strings",          0,    false, false},
+        {"strings <= 15 bytes",        15,   false, false},
+        {"strings <= 64 bytes",        64,   false, false},
+        {"strings <= 1024 bytes",      1024, false, false},
+        {"strings <= 1024, numbers",   1024, true,  false},
+        {"... and collections",        1024, true,  true},
+    };
+    for (auto &c : kConfigs) {
+        Benchmark bench;
+        size_t size = 0;
+        for (int i = 0; i < kSamples; i++) {
+            bench.start();
+            {
+                Encoder e(input.size);
+                e.uniqueStrings(c.maxSharedStringSize > 0);
+                e.maxSharedStringSize(c.maxSharedStringSize);
+                e.uniqueNumbers(c.numbers);
+                e.uniqueCollections(c.collections);
+                e.sortKeys(kSortKeys);
+                JSONConverter jr(e);
+                jr.encodeJSON(input);
+                e.end();
+                size = e.extractOutput().size;
+            }
+            bench.stop();
+        }
+        fprintf(stderr, "%-26s: %7zu bytes (%.2f%% of JSON); ",
+                c.name, size, (size*100.0/input.size));
+        bench.printReport();
+    }
+}
+
+// Re-encodes a Value one scalar at a time, the way it'd be done without Encoder::compact.
+static void reencode(Encoder &enc, const Value *v) {
+    switch (v->type()) {
+        case kArray:
+            enc.beginArray(v->asArray()->count());
+            for (Array::iterator iter(v->asArray()); iter; ++iter)
+                reencode(enc, iter.value());
+            enc.endArray();
+            break;
+        case kDict:
+            enc.beginDictionary(v->asDict()->count());
+            for (Dict::iterator iter(v->asDict()); iter; ++iter) {
+                enc.writeKey(iter.keyString());
+                reencode(enc, iter.value());
+            }
+            enc.endDictionary();
+            break;
+        case kString:
+            enc.writeString(v->asString());
+            break;
+        default:
+            enc.writeValue(v);
+            break;
+    }
+}
+
+TEST_CASE("Perf CompactDeltaChain", "[.Perf]") {
+    static const int kSamples = 50, kDeltas = 20;
+
+    // Append deltas to 1000people, each renaming one person:
+    alloc_slice data = JSONConverter::convertJSON(readFile(kTestFilesDir "1000people.json"));
+    for (int n = 1; n <= kDeltas; ++n) {
+        auto people = Value::fromTrustedData(data)->asArray();
+        Encoder enc;
+        enc.setBase(data);
+        enc.reuseBaseStrings();
+        enc.beginArray();
+        uint32_t index = 0;
+        for (Array::iterator iter(people); iter; ++iter) {
+            if (index++ != (uint32_t)n * 13) {
+                enc.writeValue(iter.value());
+                continue;
+            }
+            enc.beginDictionary();
+            for (Dict::iterator d(iter.value()->asDict()); d; ++d) {
+                enc.writeKey(d.keyString());
+                if (d.keyString() == "name"_sl)
+                    enc.writeString("Person #" + std::to_string(n));
+                else
+                    enc.writeValue(d.value());
+            }
+            enc.endDictionary();
+        }
+        enc.endArray();
+        alloc_slice delta = enc.extractOutput();
+        alloc_slice combined(data.size + delta.size);
+        memcpy((void*)combined.buf, data.buf, data.size);
+        memcpy((uint8_t*)combined.buf + data.size, delta.buf, delta.size);
+        data = combined;
+    }
+
+    size_t size = 0;
+    fprintf(stderr, "Compacting %zu bytes with Encoder::compact... ", data.size);
+    Benchmark bench;
+    for (int i = 0; i < kSamples; i++) {
+        bench.start();
+        size = Encoder::compact(data).size;
+        bench.stop();
+    }
+    bench.printReport();
+    fprintf(stderr, "    reclaimed %zu bytes, leaving %zu\n", data.size - size, size);
+
+    fprintf(stderr, "Compacting %zu bytes by re-encoding... ", data.size);
+    Benchmark reencodeBench;
+    for (int i = 0; i < kSamples; i++) {
+        reencodeBench.start();
+        Encoder enc(data.size);
+        reencode(enc, Value::fromData(data));          // (compact validates the data too)
+        size = enc.extractOutput().size;
+        reencodeBench.stop();
+    }
+    reencodeBench.printReport();
+    fprintf(stderr, "    reclaimed %zu bytes, leaving %zu\n", data.size - size, size);
+}
+
+TEST_CASE("Perf OptimizeLayout", "[.Perf]") {
+    static const int kSamples = 50, kIterations = 100, kKeys = 5;
+    alloc_slice input = readFile(kTestFilesDir "1000people.json");
+
+    alloc_slice docs[2];
+    for (int optimize = 0; optimize <= 1; ++optimize) {
+        Encoder enc;
+        enc.optimizeLayout(optimize);
+        JSONConverter jr(enc);
+        jr.encodeJSON(input);
+        enc.end();
+        docs[optimize] = enc.extractOutput();
+        auto &stats = enc.stats();
+        fprintf(stderr, "optimizeLayout=%d: %zu bytes; %u narrow, %u wide collections\n",
+                optimize, docs[optimize].size,
+                (unsigned)stats.narrowCollections, (unsigned)stats.wideCollections);
+    }
+
+    double medians[2];
+    for (int optimize = 0; optimize <= 1; ++optimize) {
+        Dict::key keys[kKeys] = {
+            Dict::key(slice("about")),
+            Dict::key(slice("company")),
+            Dict::key(slice("eyeColor")),
+            Dict::key(slice("guid")),
+            Dict::key(slice("name")),
+        };
+        auto root = Value::fromTrustedData(docs[optimize])->asArray();
+        fprintf(stderr, "optimizeLayout=%d: looking up %d strings in each person... ",
+                optimize, kKeys);
+        Benchmark bench;
+        for (int i = 0; i < kSamples; i++) {
+            bench.start();
+            for (int j = 0; j < kIterations; j++) {
+                size_t total = 0;
+                for (Array::iterator iter(root); iter; ++iter) {
+                    const Dict *person = iter->asDict();
+                    for (auto &key : keys)
+                        total += person->get(key)->asString().size;
+                }
+                REQUIRE(total > 0);
+            }
+            bench.stop();
+        }
+        bench.printReport(1.0 / (kIterations * root->count() * kKeys), "lookup");
+        medians[optimize] = bench.median();
+    }
+    fprintf(stderr, "Lookup latency with optimizeLayout: %+.1f%%\n",
+            (medians[1] / medians[0] - 1.0) * 100.0);
+}
+
+TEST_CASE("Perf EncoderKeys", "[.Perf]") {
+    static const int kSamples = 50, kDicts = 10000;
+    static const char* const kKeyNames[] = {"_id", "about", "address", "age", "balance",
+        "company", "email", "eyeColor", "gender", "guid", "index", "isActive", "latitude",
+        "longitude", "name", "phone", "picture", "registered", "tags", "friends"};
+    static const int kNKeys = sizeof(kKeyNames) / sizeof(kKeyNames[0]);
+
+    for (int useSharedKeys = 0; useSharedKeys <= 1; ++useSharedKeys) {
+        for (int useEncoderKeys = 0; useEncoderKeys <= 1; ++useEncoderKeys) {
+            std::vector<EncoderKey> keys;
+            for (auto name : kKeyNames)
+                keys.emplace_back(slice(name));
+            SharedKeys sk;
+            Encoder enc;
+            fprintf(stderr, "SharedKeys=%d, EncoderKeys=%d: ", useSharedKeys, useEncoderKeys);
+            Benchmark bench;
+            for (int i = 0; i < kSamples; i++) {
+                bench.start();
+                enc.reset();
+                if (useSharedKeys)
+                    enc.setSharedKeys(&sk);
+                enc.beginArray(kDicts);
+                for (int d = 0; d < kDicts; ++d) {
+                    enc.beginDictionary(kNKeys);
+                    for (int k = 0; k < kNKeys; ++k) {
+                        if (useEncoderKeys)
+                            enc.writeKey(keys[k]);
+                        else
+                            enc.writeKey(slice(kKeyNames[k]));
+                        enc.writeInt(k);
+                    }
+                    enc.endDictionary();
+                }
+                enc.endArray();
+                enc.end();
+                bench.stop();
+            }
+            bench.printReport(1.0 / (kDicts * kNKeys), "key");
+        }
+    }
+}
+
+TEST_CASE("Perf PooledEncoder", "[.Perf]") {
+    static const int kSamples = 50;
+    AllocationCounter allocations;
+
+    // Each person in 1000people is one small document to encode:
+    alloc_slice people = JSONConverter::convertJSON(readFile(kTestFilesDir "1000people.json"));
+    auto root = Value::fromTrustedData(people)->asArray();
+
+    auto encodeAll = [&](Encoder *enc) {
+        size_t total = 0;
+        for (Array::iterator iter(root); iter; ++iter) {
+            enc->writeValue(iter.value());
+            total += enc->finishInPlace().size;
+            enc->reset();
+        }
+        return total;
+    };
+
+    fprintf(stderr, "Encoding 1000 people with a new Encoder each... ");
+    Benchmark bench;
+    size_t allocs = 0;
+    for (int i = 0; i < kSamples; i++) {
+        size_t startAllocs = allocations.count();
+        bench.start();
+        for (Array::iterator iter(root); iter; ++iter) {
+            Encoder enc;
+            enc.writeValue(iter.value());
+            FLEECE_UNUSED alloc_slice output = enc.extractOutput();
+        }
+        bench.stop();
+        allocs += allocations.count() - startAllocs;
+    }
+    bench.printReport(1.0/root->count(), "person");
+    fprintf(stderr, "    %.1f allocations per person\n", allocs / (double)kSamples / root->count());
+
+    fprintf(stderr, "Encoding 1000 people with a pooled Encoder... ");
+    EncoderPool pool;
+    Encoder *enc = pool.acquire();
+    size_t expectedSize = encodeAll(enc);          // warms up the encoder's capacity
+    pool.release(enc);
+    Benchmark pooledBench;
+    allocs = 0;
+    for (int i = 0; i < kSamples; i++) {
+        pooledBench.start();
+        size_t startAllocs = allocations.count();
+        enc = pool.acquire();
+        size_t size = encodeAll(enc);
+        pool.release(enc);
+        allocs += allocations.count() - startAllocs;
+        pooledBench.stop();
+        CHECK(size == expectedSize);
+    }
+    pooledBench.printReport(1.0/root->count(), "person");
+    fprintf(stderr, "    %zu allocations in total\n", allocs);
+    CHECK(allocs == 0);
+
+    fprintf(stderr, "Encoding 1000 people with a pooled FLEncoder... ");
+    FLEncoderPool flPool = FLEncoderPool_New(4);
+    FLEncoder flEnc = FLEncoderPool_Acquire(flPool);
+    FLEncoderPool_Release(flPool, flEnc);
+    Benchmark cBench;
+    allocs = 0;
+    for (int i = 0; i <= kSamples; i++) {
+        cBench.start();
+        size_t startAllocs = allocations.count();
+        flEnc = FLEncoderPool_Acquire(flPool);
+        for (Array::iterator iter(root); iter; ++iter) {
+            FLEncoder_WriteValue(flEnc, (FLValue)iter.value());
+            FLSlice output = FLEncoder_FinishInPlace(flEnc, nullptr);
+            CHECK(output.buf != nullptr);
+            FLEncoder_Reset(flEnc);
+        }
+        FLEncoderPool_Release(flPool, flEnc);
+        if (i > 0)
+            allocs += allocations.count() - startAllocs;   // the first round warms up the encoder
+        cBench.stop();
+    }
+    cBench.printReport(1.0/root->count(), "person");
+    fprintf(stderr, "    %zu allocations in total\n", allocs);
+    CHECK(allocs == 0);
+    FLEncoderPool_Free(flPool);
+}
+
 TEST_CASE("Perf LoadFleece", "[.Perf]") {
     static const int kIterations = 1000;
     alloc_slice doc = readFile(kTestFilesDir "1000people.fleece");
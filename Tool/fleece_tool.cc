@@ -17,6 +17,8 @@
 //
 
 #include "JSONConverter.hh"
+#include "NDJSONConverter.hh"
+#include "JSONEncoder.hh"
 #include <stdio.h>
 #include <unistd.h>
 #include <iostream>
@@ -27,9 +29,13 @@ using namespace std;
 
 static void usage(void) {
     fprintf(stderr, "usage: fleece --encode [JSON file]\n");
+    fprintf(stderr, "       fleece --encode-ndjson [NDJSON file]\n");
     fprintf(stderr, "       fleece --decode [Fleece file]\n");
     fprintf(stderr, "       fleece --dump [Fleece file]\n");
+    fprintf(stderr, "       fleece --compact [Fleece file]\n");
     fprintf(stderr, "  Reads stdin unless a file is given; always writes to stdout.\n");
+    fprintf(stderr, "  --encode-ndjson converts each line to a Fleece document, on all CPU cores,\n");
+    fprintf(stderr, "  and writes each document preceded by its length as a varint.\n");
 }
 
 static alloc_slice readInput(FILE *in) {
@@ -48,7 +54,7 @@ static alloc_slice readInput(FILE *in) {
 
 int main(int argc, const char * argv[]) {
     try {
-        bool encode = false, decode = false, dump = false;
+        bool encode = false, encodeNDJSON = false, decode = false, dump = false, compact = false;
 
         int i;
         for (i = 1; i < argc; ++i) {
@@ -60,10 +66,14 @@ int main(int argc, const char * argv[]) {
                 break;
             } else if (strcmp(arg, "--encode") == 0) {
                 encode = true;
+            } else if (strcmp(arg, "--encode-ndjson") == 0) {
+                encodeNDJSON = true;
             } else if (strcmp(arg, "--decode") == 0) {
                 decode = true;
             } else if (strcmp(arg, "--dump") == 0) {
                 dump = true;
+            } else if (strcmp(arg, "--compact") == 0) {
+                compact = true;
             } else if (strcmp(arg, "--help") == 0) {
                 usage();
                 return 0;
@@ -74,8 +84,8 @@ int main(int argc, const char * argv[]) {
             }
         }
 
-        if (encode + decode + dump != 1) {
-            fprintf(stderr, "Choose one of --encode, --decode, or --dump\n");
+        if (encode + encodeNDJSON + decode + dump + compact != 1) {
+            fprintf(stderr, "Choose one of --encode, --encode-ndjson, --decode, --dump or --compact\n");
             usage();
             return 1;
         }
@@ -96,24 +106,57 @@ int main(int argc, const char * argv[]) {
             return 1;
         }
 
-        if (encode && isatty(STDOUT_FILENO))
+        if ((encode || encodeNDJSON || compact) && isatty(STDOUT_FILENO))
             throw "Let's not spew binary Fleece data to a terminal! Please redirect stdout.";
 
+        if (encodeNDJSON) {
+            // Stream the input through, rather than reading it all first:
+            NDJSONConverter cvt([](slice output) {
+                fwrite(output.buf, output.size, 1, stdout);
+            });
+            char buf[65536];
+            size_t n;
+            while ((n = ::fread(buf, 1, sizeof(buf), in)) > 0)
+                cvt.feed(slice(buf, n));
+            if (ferror(in))
+                throw "Error reading input";
+            cvt.finish();
+            auto &stats = cvt.stats();
+            fprintf(stderr, "Converted %llu records (%llu bytes of JSON to %llu bytes of Fleece) "
+                            "in %.3f sec: %.0f records/sec, %.1f MB/sec\n",
+                    (unsigned long long)stats.records, (unsigned long long)stats.inputBytes,
+                    (unsigned long long)stats.outputBytes, stats.seconds,
+                    stats.records / stats.seconds, stats.inputBytes / stats.seconds / 1.0e6);
+            return 0;
+        }
+
         auto input = readInput(in);
 
         if (encode) {
-            auto output = JSONConverter::convertJSON(input);
-            fwrite(output.buf, 1, output.size, stdout);
+            Encoder enc(stdout);
+            JSONConverter cvt(enc);
+            if (!cvt.encodeJSONParallel(input))
+                throw cvt.errorMessage();
+            enc.end();
         } else if (decode) {
             auto root = Value::fromData(input);
             if (!root)
                 throw "Couldn't parse input as Fleece";
-            auto json = root->toJSON();
-            fwrite(json.buf, json.size, 1, stdout);
+            // Stream the JSON out, rather than building it all in memory first; the items of a
+            // large root array are converted on all CPU cores:
+            JSONEncoder enc(stdout);
+            enc.writeValueParallel(root);
+            enc.flush();
             fprintf(stdout, "\n");
         } else if (dump) {
             if (!Value::dump(input, cout))
                 throw "Couldn't parse input as Fleece";
+        } else if (compact) {
+            auto output = Encoder::compact(input);
+            fwrite(output.buf, output.size, 1, stdout);
+            auto reclaimed = (long long)input.size - (long long)output.size;
+            fprintf(stderr, "Compacted %zu bytes to %zu; reclaimed %lld bytes (%.1f%%)\n",
+                    input.size, output.size, reclaimed, reclaimed * 100.0 / input.size);
         }
 
         return 0;
@@ -123,6 +166,7 @@ int main(int argc, const char * argv[]) {
         return 1;
     } catch (const std::exception &x) {
         fprintf(stderr, "%s\n", x.what());
+        return 1;
     } catch (...) {
         fprintf(stderr, "Uncaught exception!\n");
         return 1;